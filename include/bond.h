@@ -0,0 +1,80 @@
+#ifndef BOND_H
+#define BOND_H
+
+#include "application_layer.h"
+#include "link_connection.h"
+#include "packet.h"
+
+// Link bonding: one transfer striped over several serial ports at once, each running its
+// own link layer connection on its own thread.
+// Data packets go to the link expected to get them through first, judging by the goodput
+// measured on each link, and the receiver puts them back in order by their sequence number.
+// When a link fails its unacknowledged packets are sent again on the others.
+// Control packets go over every link.
+
+#define MAX_BOND_LINKS 8
+#define BOND_QUEUE_DEPTH 4 // data packets queued on a link ahead of its window
+
+// Data packets travel with a bond header of their own: BOND_DATA and a 16 bit sequence
+// number, as the 8 bit one of the data packet goes round too soon to reorder by.
+#define BOND_DATA 0x04
+#define BOND_HEADER 3
+
+// TLV the bond adds to END: bond sequence number of the data packet that comes after it
+#define TLV_BOND_SEQUENCE 0x80
+
+// Control packets received ahead of the one being handed over
+#define BOND_CONTROL_QUEUE 16
+
+// Data packets sent but not known to be acknowledged. The receiver must be able to hold
+// them all while it waits for the oldest one, or the links could stall each other.
+#define BOND_MAX_IN_FLIGHT (MAX_BOND_LINKS * (BOND_QUEUE_DEPTH + MAX_SEQ_MODULUS))
+#define BOND_REORDER_SIZE 128
+
+#if BOND_MAX_IN_FLIGHT > BOND_REORDER_SIZE
+#error "too many packets in flight for the receiver to reorder"
+#endif
+
+typedef struct Bond Bond;
+
+// Opens a connection on each of the comma separated ports, with the other settings of
+// connectionParameters and the handshake a receiver sends back (see llopen_r).
+// Links that can't be opened are left out.
+// Return the bond, or NULL if no link could be opened.
+Bond *bondOpen(const char *serialPorts, LinkLayer connectionParameters, const HandshakeData *handshake);
+
+// Settings every link can take, with the bond header taken off the payload size.
+LinkParameters bondParameters(Bond *bond);
+
+// Handshake data the receiver sent back, the same on every link (see llhandshake).
+int bondHandshake(Bond *bond, unsigned char *data);
+
+// Counters of all the links added up.
+LinkStatistics bondStatistics(Bond *bond);
+
+// Queues a data packet made of header and size bytes of data on one of the links.
+// The header is copied, data is not and must stay valid until bondClose.
+// Return size, or "-1" if every link has failed.
+int bondWriteData(Bond *bond, const unsigned char *header, const unsigned char *data, int size);
+
+// Same, for data that may change as soon as it returns (a stream): the packet keeps a copy.
+int bondWriteDataCopy(Bond *bond, const unsigned char *header, const unsigned char *data, int size);
+
+// Waits until every data packet sent so far is acknowledged, resending any that got lost.
+// Return "0" on success or "-1" if every link has failed.
+int bondFlush(Bond *bond);
+
+// Sends a control packet on every link, once every data packet before it was acknowledged.
+// Return size, or "-1" if every link has failed.
+int bondWriteControl(Bond *bond, const unsigned char *packet, int size);
+
+// Next packet in order: each control packet in turn, with the data packets sent between
+// them by sequence number.
+// Return the packet size.
+int bondRead(Bond *bond, unsigned char *packet, int *sizeOfPacket);
+
+// Disconnects every link still up and frees the bond.
+// Return "1" on success or "-1" if some link failed along the way.
+int bondClose(Bond *bond, int showStatistics);
+
+#endif // BOND_H
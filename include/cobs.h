@@ -0,0 +1,50 @@
+#ifndef COBS_H
+#define COBS_H
+
+#include "crc.h"
+
+// Consistent Overhead Byte Stuffing of the I-frame data field, with FLAG as the byte taken out.
+// The data is cut into blocks at every FLAG byte; each block is a code byte giving its length
+// followed by the block itself, and the FLAG that ended it is implied. Blocks longer than
+// COBS_MAX_RUN are split without an implied FLAG. So the overhead is one byte every
+// COBS_MAX_RUN bytes plus one, whatever the data, instead of up to double with 0x7D escapes.
+// Code bytes skip the value of FLAG, so it never shows up inside a frame.
+// Runs are found with memchr and moved with memcpy, which the C library vectorizes.
+
+#define COBS_MAX_RUN 254
+
+// Worst case encoded size of size bytes
+#define COBS_MAX_SIZE(size) ((size) + (size) / COBS_MAX_RUN + 1)
+
+typedef struct {
+    unsigned char *out;
+    int size; // bytes written to out so far
+    int code; // where the code byte of the open block goes
+    int run;  // bytes in the open block
+} CobsEncoder;
+
+typedef struct {
+    int remaining; // bytes left in the current block, 0 if a code byte comes next
+    int pending;   // a FLAG is implied before the next block
+} CobsDecoder;
+
+// Starts encoding into out.
+void cobsBegin(CobsEncoder *encoder, unsigned char *out);
+
+// Encodes bufSize more bytes of buf. If fcs isn't NULL it is updated with buf in the same pass.
+void cobsEncode(CobsEncoder *encoder, const unsigned char *buf, int bufSize, Fcs *fcs);
+
+// Closes the last block, returns the encoded size.
+int cobsEnd(CobsEncoder *encoder);
+
+void cobsDecoderInit(CobsDecoder *decoder);
+
+// Decodes in until a FLAG byte or the end of the input, appending to out at *outSize (out must
+// have room for inSize more bytes). The decoder carries the block state between calls.
+// Returns the number of input bytes consumed; the FLAG that stopped it, if any, is not consumed.
+int cobsDecode(const unsigned char *in, int inSize, unsigned char *out, int *outSize, CobsDecoder *decoder);
+
+// Whether the data decoded so far ends on a block boundary, as a whole frame must.
+int cobsComplete(const CobsDecoder *decoder);
+
+#endif // COBS_H
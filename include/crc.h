@@ -0,0 +1,36 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+
+// Frame check sequence types
+#define FCS_XOR 0
+#define FCS_CRC16 1
+#define FCS_CRC32 2
+
+// Running frame check sequence, so it can be computed in the same pass as (de)stuffing
+typedef struct {
+    int type;
+    uint32_t value;
+} Fcs;
+
+// CRC-16-CCITT as used by the HDLC frame check sequence (X.25: reflected, init and final XOR 0xFFFF).
+uint16_t crc16(const unsigned char *buf, int size);
+
+// CRC-32 (IEEE 802.3: reflected, init and final XOR 0xFFFFFFFF).
+uint32_t crc32(const unsigned char *buf, int size);
+
+// Raw register updates, without the initial/final XOR.
+uint16_t crc16Update(uint16_t crc, const unsigned char *buf, int size);
+uint32_t crc32Update(uint32_t crc, const unsigned char *buf, int size);
+
+int fcsSizeOf(int type);
+
+void fcsInit(Fcs *fcs, int type);
+
+void fcsUpdate(Fcs *fcs, const unsigned char *buf, int size);
+
+// Writes the FCS least significant byte first, returns its size.
+int fcsFinal(const Fcs *fcs, unsigned char *out);
+
+#endif // CRC_H
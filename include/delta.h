@@ -0,0 +1,48 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// rsync style delta encoding. The end that has an older copy of a file (the basis) cuts it
+// into blocks and describes each one by a weak checksum, which can be rolled along a byte
+// at a time, and an XXH64. The end with the new version slides a block sized window over
+// it looking for those blocks, and describes it as copies of basis blocks and literal data.
+//
+// A delta is a sequence of instructions, with big endian numbers:
+//   DELTA_LITERAL, 4 byte length, that many bytes of data
+//   DELTA_COPY, 4 byte first block, 4 byte number of blocks
+// A copy may end with the last block of the basis, which can be short.
+
+#define DELTA_LITERAL 0x00
+#define DELTA_COPY 0x01
+#define DELTA_LITERAL_HEADER 5
+#define DELTA_COPY_HEADER 9
+
+#define DELTA_MIN_BLOCK 256
+#define DELTA_MAX_BLOCK 65536
+#define DELTA_SIGNATURE 12 // weak checksum and XXH64 of a block, as sent
+
+typedef struct {
+    uint32_t weak;
+    uint64_t strong;
+} BlockSignature;
+
+// Block size for a basis of size bytes: a power of two close to its square root, so the
+// signatures and the data around each change stay small together.
+int deltaBlockSize(long size);
+
+// Signature of the size bytes of a block.
+BlockSignature deltaSignature(const unsigned char *block, int size);
+
+void encodeSignature(const BlockSignature *signature, unsigned char *out);
+
+void decodeSignature(const unsigned char *in, BlockSignature *signature);
+
+// Delta of the size bytes of contents against a basis of basisSize bytes, whose blocks of
+// blockSize bytes have the given signatures.
+// Return the delta, to be freed, with its size in *deltaSize, or NULL if out of memory.
+unsigned char *deltaEncode(const unsigned char *contents, size_t size, const BlockSignature *signatures,
+                           long basisSize, int blockSize, size_t *deltaSize);
+
+#endif // DELTA_H
@@ -0,0 +1,278 @@
+// Link layer extensions: settings negotiated in llopen, statistics, and connection handles so
+// one process can drive several links. link_layer.h keeps the original interface.
+
+#ifndef LINK_CONNECTION_H
+#define LINK_CONNECTION_H
+
+#include <sys/uio.h>
+
+#include "link_layer.h"
+#include "crc.h"
+#include "spsc.h"
+
+#define C_RR 0x05
+#define C_REJ 0x01
+#define C_SREJ 0x0D
+#define C_FEC 0x0F
+
+// ARQ
+#define ARQ_STOP_AND_WAIT 0
+#define ARQ_GO_BACK_N 1
+#define ARQ_SELECTIVE_REPEAT 2
+
+// Settings this end asks for in llopen. The SET/UA handshake settles on the best ones both
+// ends support (see LinkParameters). The transmitter's last try is a plain SET, and a peer
+// that answers it or sends one itself gets the original stop-and-wait format with a 1-bit
+// sequence number and XOR BCC2.
+#ifndef ARQ_MODE
+#define ARQ_MODE ARQ_GO_BACK_N
+#endif
+
+// Sequence numbers use up to MAX_SEQ_BITS bits of the control byte (modulo 2^MAX_SEQ_BITS).
+// Stop-and-wait keeps the original 1-bit format.
+#define MAX_SEQ_BITS 3
+#define MAX_SEQ_MODULUS (1 << MAX_SEQ_BITS)
+
+// Number of I-frames that may be outstanding (unacknowledged) at once.
+// Selective repeat can use at most half of the sequence space.
+#ifndef WINDOW_SIZE
+#if ARQ_MODE == ARQ_SELECTIVE_REPEAT
+#define WINDOW_SIZE (MAX_SEQ_MODULUS / 2)
+#elif ARQ_MODE == ARQ_STOP_AND_WAIT
+#define WINDOW_SIZE 1
+#else
+#define WINDOW_SIZE (MAX_SEQ_MODULUS - 1)
+#endif
+#endif
+
+#if WINDOW_SIZE < 1 || WINDOW_SIZE >= MAX_SEQ_MODULUS
+#error "WINDOW_SIZE must be between 1 and MAX_SEQ_MODULUS - 1"
+#endif
+
+#if ARQ_MODE == ARQ_SELECTIVE_REPEAT && WINDOW_SIZE > MAX_SEQ_MODULUS / 2
+#error "Selective repeat needs WINDOW_SIZE <= MAX_SEQ_MODULUS / 2"
+#endif
+
+// Strongest frame check sequence of I-frames this end offers (FCS_XOR, FCS_CRC16 or
+// FCS_CRC32, see crc.h); it also offers the weaker ones
+#ifndef FCS_TYPE
+#define FCS_TYPE FCS_CRC16
+#endif
+
+#define MAX_FCS_SIZE 4
+
+// Forward error correction: after every group of up to FEC_GROUP I-frames the transmitter
+// sends a parity frame, the XOR of their payloads, so the receiver can rebuild one frame of
+// the group lost or corrupted without a retransmission. The group size is agreed in llopen
+// and then follows the retransmissions seen (see LinkParameters.fecGroup).
+// It needs selective repeat to keep the frames after a lost one; 0 turns it off.
+#ifndef FEC_GROUP
+#define FEC_GROUP 0
+#endif
+
+#define FEC_HEADER 4 // parity frame: first N(S), number of frames and XOR of their sizes
+
+// Framing of I-frames
+#define FRAMING_HDLC 0 // FLAG delimited, 0x7D byte stuffing
+#define FRAMING_COBS 1 // FLAG delimited, consistent overhead byte stuffing (see cobs.h)
+
+#ifndef FRAMING_MODE
+#define FRAMING_MODE FRAMING_HDLC
+#endif
+
+// Compression of data packets done by the application layer
+#define COMPRESSION_NONE 0
+#define COMPRESSION_LZ 1 // LZ compressed blocks, raw where that doesn't help
+
+#ifndef COMPRESSION
+#define COMPRESSION COMPRESSION_LZ
+#endif
+
+// Format of the application's packets
+#define PACKET_FORMAT_V0 0 // the original packets, of a peer that doesn't negotiate: START and END carry only the file size and name
+#define PACKET_FORMAT_V1 1 // data packets numbered modulo 255, sizes in as few bytes as they take
+#define PACKET_FORMAT_V2 2 // data packets numbered with 32 bits, sizes and offsets in 8 bytes
+
+#ifndef PACKET_FORMAT
+#define PACKET_FORMAT PACKET_FORMAT_V2
+#endif
+
+// Largest packet a peer that doesn't negotiate takes: the original implementation keeps a
+// whole frame, every byte of the packet and BCC2 stuffed, in 600 bytes
+#define LEGACY_PAYLOAD_SIZE 296
+
+// Worst case I-frame: every payload/FCS byte stuffed, plus FLAG, A, C, BCC1 and FLAG
+#define MAX_FRAME_SIZE (2 * (MAX_PAYLOAD_SIZE + MAX_FCS_SIZE) + 5)
+
+// Capability TLVs carried in the SET/UA info field: type, length, big-endian value
+#define TLV_MAX_PAYLOAD 0x01
+#define TLV_WINDOW_SIZE 0x02
+#define TLV_FCS_TYPES 0x03 // a bit (1 << type) for each FCS type offered
+#define TLV_ARQ_MODE 0x04
+#define TLV_COMPRESSION 0x05
+#define TLV_FRAMING 0x06
+#define TLV_FEC_GROUP 0x07
+#define TLV_HANDSHAKE_DATA 0x08 // UA only: the receiver's HandshakeData
+#define TLV_PACKET_FORMAT 0x09
+
+// Bytes the receiver's application can hand the transmitter's in its UA
+#define MAX_HANDSHAKE_DATA 32
+
+typedef struct {
+    unsigned char data[MAX_HANDSHAKE_DATA];
+    int size;
+} HandshakeData;
+
+// Link settings agreed in llopen
+typedef struct {
+    int arqMode;
+    int windowSize;
+    int maxPayloadSize;
+    int fcsType;
+    int fcsTypes; // FCS types offered, a bit (1 << type) each
+    int framing;
+    int compression;
+    int fecGroup; // I-frames per parity frame at most, 0 without FEC
+    int packetFormat;
+} LinkParameters;
+
+// Round trip time histogram: bucket 0 counts samples under 1 ms, bucket i those from
+// 2^(i-1) to 2^i ms, and the last one everything longer
+#define RTT_BUCKETS 12
+
+// Link layer counters, updated as frames go through
+typedef struct {
+    long framesSent;      // I-frames sent for the first time
+    long retransmissions; // I-frames sent again
+    long rejReceived;     // REJ and SREJ received
+    long timeouts;        // retransmission timer expirations
+    long parityFrames;    // FEC parity frames sent
+    long framesRebuilt;   // I-frames rebuilt from a parity frame
+    long framesReceived;  // I-frames delivered
+    long duplicates;      // I-frames received again and dropped
+    long fcsErrors;       // I-frames dropped for a bad FCS
+    long rejSent;         // REJ and SREJ sent
+    long payloadSent, payloadReceived; // packet bytes carried by I-frames, first transmissions only
+    long wireSent, wireReceived;       // bytes written to and read from the port, everything included
+    long stuffingBytes;   // added to the I-frames sent by stuffing or COBS, first transmissions only
+    long rttHistogram[RTT_BUCKETS];
+    long rttTotal;        // ms, sum of the samples in rttHistogram
+    long elapsed;         // ms since the connection was opened
+} LinkStatistics;
+
+// An I-frame as it goes out, in the three pieces handed to writev(): header, stuffed
+// payload and trailer (stuffed FCS and closing flag). With COBS framing the payload piece
+// holds the encoded payload and FCS, and the trailer just the closing flag. The header is only filled in when
+// the frame gets its sequence number in llsend.
+typedef struct {
+    unsigned char header[4]; // FLAG, A, C, BCC1
+    unsigned char payload[2 * (MAX_PAYLOAD_SIZE + FEC_HEADER)];
+    unsigned char trailer[2 * MAX_FCS_SIZE + 1];
+    int payloadSize, trailerSize;
+    int dataSize;   // payload size before stuffing
+    SpscRing *pool; // where the frame goes once acknowledged, NULL if it isn't pooled
+} TxFrame;
+
+// State of one connection. Every function taking a LinkConnection only touches that
+// connection, so separate connections can be driven from separate threads.
+typedef struct LinkConnection LinkConnection;
+
+////////////////////////////////////////////////
+// CONNECTION HANDLE API
+////////////////////////////////////////////////
+
+// Opens a connection using the "port" parameters defined in struct linkLayer. A receiver
+// sends handshake back in its UA if the transmitter negotiates (NULL for none).
+// Return the new connection, or NULL on error.
+LinkConnection *llopen_r(LinkLayer connectionParameters, const HandshakeData *handshake);
+
+LinkParameters llparameters_r(LinkConnection *conn);
+
+LinkStatistics llstatistics_r(LinkConnection *conn);
+
+// Prints statistics as text, then as one line of JSON, with the efficiency they come to on a
+// line of baudRate bits/s and the most the ARQ mode and window allow at their round trip time.
+void llprintstatistics(const LinkStatistics *statistics, LinkParameters parameters, int baudRate);
+
+int llhandshake_r(LinkConnection *conn, unsigned char *data);
+
+int llwrite_r(LinkConnection *conn, const unsigned char *buf, int bufSize);
+
+int llwritev_r(LinkConnection *conn, const struct iovec *iov, int iovcnt);
+
+int llframe_r(LinkConnection *conn, const struct iovec *iov, int iovcnt, TxFrame *frame);
+
+int llsend_r(LinkConnection *conn, TxFrame *frame);
+
+int llread_r(LinkConnection *conn, unsigned char *packet, int *sizeOfPacket);
+
+int llreadview_r(LinkConnection *conn, const unsigned char **packet);
+
+// Waits until every frame sent so far is acknowledged.
+// Return "0" on success or "-1" if the retransmission limit was reached.
+int llflush_r(LinkConnection *conn);
+
+// Turns the line around (see llturn).
+// Return "0" on success or "-1" if the retransmission limit was reached.
+int llturn_r(LinkConnection *conn);
+
+// Frees the connection without the disconnection handshake, e.g. after it failed.
+void llabort_r(LinkConnection *conn);
+
+// Closes the connection and frees it, whether or not the disconnection succeeds.
+// Return "1" on success or "-1" on error.
+int llclose_r(LinkConnection *conn, int showStatistics, float runTime);
+
+////////////////////////////////////////////////
+// SINGLE CONNECTION API
+////////////////////////////////////////////////
+// More of the single connection API of link_layer.h, on the same connection.
+
+// Same as llopen; a receiver sends handshake back in its UA if the transmitter negotiates.
+// Return "1" on success or "-1" on error.
+int llopenhandshake(LinkLayer connectionParameters, const HandshakeData *handshake);
+
+// Settings agreed with the peer by the last llopen.
+LinkParameters llparameters();
+
+// Counters of the current connection.
+LinkStatistics llstatistics();
+
+// Transmitter: copies the handshake data the receiver sent in its UA to data, which has
+// room for MAX_HANDSHAKE_DATA bytes. Return its size, 0 if there was none.
+int llhandshake(unsigned char *data);
+
+// Same as llwrite, with the data gathered from iovcnt pieces (e.g. a packet header and
+// the file contents) so the caller doesn't have to copy them together first.
+// Return number of chars written, or "-1" on error.
+int llwritev(const struct iovec *iov, int iovcnt);
+
+// llwritev split in two, for the pipelined transmitter.
+// llframe stuffs the data into frame and computes its FCS; it only reads the negotiated
+// parameters, so it may run on another thread. Return the data size, or "-1" if it doesn't fit.
+int llframe(const struct iovec *iov, int iovcnt, TxFrame *frame);
+
+// llsend transmits a frame built by llframe. The link layer keeps it until it is
+// acknowledged and then pushes it to frame->pool, if set.
+// Return number of chars written, or "-1" on error.
+int llsend(TxFrame *frame);
+
+// Waits until every frame sent so far is acknowledged.
+// Return "0" on success or "-1" if the retransmission limit was reached.
+int llflush();
+
+// Turns the line around: the transmitter becomes the receiver and the other way round,
+// both starting again from sequence number 0. The transmitter calls it after its last
+// packet (it waits for that to be acknowledged), the receiver after reading that packet.
+// Return "0" on success or "-1" if the retransmission limit was reached.
+int llturn();
+
+// Same as llread without copying: points *packet at the payload where it was destuffed,
+// inside the link layer. It stays valid until the next call on the connection.
+// Return number of chars read, or "-1" on error.
+int llreadview(const unsigned char **packet);
+
+// llclose prints the statistics of llprintstatistics, timed by the link layer's own clock;
+// runTime is the caller's, shown alongside.
+
+#endif // LINK_CONNECTION_H
@@ -0,0 +1,16 @@
+#ifndef LZ_H
+#define LZ_H
+
+// Fast LZ77 compression of independent blocks, in the LZ4 block format: a sequence of
+// token (literal and match length nibbles), literals, 2 byte little endian match offset,
+// with lengths of 15 and over continued in extra bytes. Made for speed, not ratio.
+
+// Compresses inSize bytes of in into out, which has room for capacity bytes.
+// Return the compressed size, or "-1" if it doesn't fit (the block is better sent raw).
+int lzCompress(const unsigned char *in, int inSize, unsigned char *out, int capacity);
+
+// Decompresses inSize bytes of in into out, which has room for capacity bytes.
+// Return the decompressed size, or "-1" if the block is corrupted or too big.
+int lzDecompress(const unsigned char *in, int inSize, unsigned char *out, int capacity);
+
+#endif // LZ_H
@@ -0,0 +1,43 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+// Application packets added to the original data and control packets of
+// application_layer.h, and the functions that build and read them.
+
+// C field of the control packets. A batch session sends the manifest of the files to come
+// first, then each file between its START and END, and BATCH_END after the last one.
+#define CONTROL_START 0x02
+#define CONTROL_END 0x03
+#define CONTROL_MANIFEST 0x05
+#define CONTROL_BATCH_END 0x06
+
+#define DATA_PACKET_HEADER 4 // C, N, L2, L1
+
+// Data packet of PACKET_FORMAT_V2, whose sequence number doesn't go round in a long transfer
+#define WIDE_DATA_PACKET 0x07
+#define WIDE_DATA_PACKET_HEADER 7 // C, N (32 bits), L2, L1
+#define MAX_DATA_PACKET_HEADER WIDE_DATA_PACKET_HEADER
+
+// Compressed data packets (COMPRESSION_LZ): the file is cut into blocks of LZ_BLOCK_SIZE
+// bytes, each compressed on its own or kept raw if that doesn't make it smaller, and the
+// data packets carry the stream of blocks, each after a BLOCK_HEADER with its stored size
+// (big endian, top bit set for a raw block), cut anywhere.
+#define LZ_BLOCK_SIZE 65536
+#define BLOCK_HEADER 4
+#define BLOCK_RAW 0x80000000u
+
+// Reads the file size TLV of a START/END control packet, -1 if there is none.
+long getControlFileSize(const unsigned char *packet, int size);
+
+// Writes the data packet header for nBytes of data in the packet format agreed on the link
+// (DATA_PACKET_HEADER or WIDE_DATA_PACKET_HEADER bytes), returns its size.
+int getDataPacketHeader(unsigned char *packet, int nSequence, int nBytes);
+
+// Header size of a data packet, from its C field.
+int getDataPacketHeaderSize(const unsigned char *packet);
+
+// Writes size bytes of contents (LZ_BLOCK_SIZE at most) as the next block of the stream,
+// header included, into out (BLOCK_HEADER + LZ_BLOCK_SIZE bytes). Returns the size written.
+int encodeBlock(const unsigned char *contents, int size, unsigned char *out);
+
+#endif // PACKET_H
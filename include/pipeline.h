@@ -0,0 +1,67 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "link_connection.h"
+
+// Pipelined transfer engine, off unless built with -DPIPELINE=1.
+// Transmitter: a reader thread faults the mapped file in, or compresses it a block at a
+// time, and cuts it into data packets, a framing thread stuffs them and computes their FCS
+// (llframe), and the calling thread only does serial I/O (llsend and the acknowledgements).
+// Receiver: the calling thread reads and acknowledges frames while a writer thread does
+// the disk writes. Destuffing, the FCS check and parsing the packet stay on the calling
+// thread: the ARQ may only acknowledge a frame once its FCS checks out, so a later stage
+// can't take them, and llread already destuffs and checks the FCS in one pass over the
+// bytes as they are read. Handing them to another thread would add a copy for nothing.
+// The stages pass pooled buffers to each other through SpscRings, and the buffers go back
+// to the first stage through another ring once they are done with.
+#ifndef PIPELINE
+#define PIPELINE FALSE
+#endif
+
+#define PIPELINE_FRAMES 32 // pooled tx frames, at most SPSC_CAPACITY - 1
+#define PIPELINE_BATCHES 8 // pooled rx write batches, at most SPSC_CAPACITY - 1
+
+#if PIPELINE_FRAMES >= SPSC_CAPACITY || PIPELINE_BATCHES >= SPSC_CAPACITY
+#error "pipeline pools must fit in a ring, with room for the end marker"
+#endif
+
+// size bytes of file data that belong at offset
+typedef struct {
+    unsigned char *data;
+    int size;
+    long offset;
+} WriteBatch;
+
+// Writes a batch with pwrite, or write where fd can't seek. Return "0" on success or "-1" on error.
+int writeBatch(int fd, const WriteBatch *batch);
+
+// Starts the reader and framing threads on the size bytes of contents, cut into packets
+// of packetSize data bytes, or with compressed the stream of its compressed blocks (see
+// packet.h). Return "0" on success or "-1" on error.
+int pipelineStartTx(const unsigned char *contents, size_t size, int packetSize, int compressed);
+
+// Next frame ready for llsend, or NULL once the whole file was sent.
+TxFrame *pipelineNextFrame();
+
+// Changes the data size of the packets that haven't been cut yet.
+void pipelineSetPacketSize(int packetSize);
+
+// Stops the threads, whether or not they reached the end of the file.
+// Returns the data bytes cut into packets.
+size_t pipelineStopTx();
+
+// Starts the writer thread on fd with batches of batchSize bytes.
+// Returns the first empty batch, or NULL on error.
+WriteBatch *pipelineStartWriter(int fd, int batchSize);
+
+// Queues a full batch for writing and returns an empty one in exchange.
+WriteBatch *pipelineWrite(WriteBatch *batch);
+
+// Where the data written so far ends, as the batches are written in the order they are queued.
+long pipelineWritten();
+
+// Waits for the queued batches to be written and stops the writer thread.
+// Return "0" on success or "-1" if any write failed.
+int pipelineStopWriter();
+
+#endif // PIPELINE_H
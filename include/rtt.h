@@ -0,0 +1,22 @@
+#ifndef RTT_H
+#define RTT_H
+
+// Retransmission timeout estimator (Jacobson/Karels, RFC 6298), in milliseconds.
+// Callers must follow Karn's rule: only frames that were sent once may give a sample.
+typedef struct {
+    long long srtt;   // smoothed round trip time, scaled by 8
+    long long rttvar; // round trip time variation, scaled by 4
+    long long rto;    // current retransmission timeout
+    long long minRto, maxRto;
+    int samples;
+} RttEstimator;
+
+void rttInit(RttEstimator *rtt, long long minRto, long long maxRto);
+
+// Feeds a round trip time measurement and recomputes the timeout, clearing any backoff.
+void rttSample(RttEstimator *rtt, long long sampleMs);
+
+// Doubles the timeout after a retransmission, up to maxRto.
+void rttBackoff(RttEstimator *rtt);
+
+#endif // RTT_H
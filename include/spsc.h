@@ -0,0 +1,35 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define SPSC_CAPACITY 64 // must be a power of two
+
+// Bounded single-producer/single-consumer ring of pointers.
+// Pushing and popping are lock-free; the mutex and condition variable are only touched
+// when one side has to sleep because the ring is full or empty. NULL is a valid item
+// (the pipeline uses it to mark the end of a stream).
+typedef struct {
+    void *items[SPSC_CAPACITY];
+    atomic_uint head, tail; // free-running: head is written by the producer, tail by the consumer
+    atomic_int sleepers;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} SpscRing;
+
+void spscInit(SpscRing *ring);
+
+void spscDestroy(SpscRing *ring);
+
+// Non-blocking. Return "1" on success or "0" if the ring is full / empty.
+int spscTryPush(SpscRing *ring, void *item);
+
+int spscTryPop(SpscRing *ring, void **item);
+
+// Blocking versions, for threads that have nothing else to do meanwhile.
+void spscPush(SpscRing *ring, void *item);
+
+void *spscPop(SpscRing *ring);
+
+#endif // SPSC_H
@@ -0,0 +1,22 @@
+#ifndef STUFFING_H
+#define STUFFING_H
+
+#include "crc.h"
+
+// Byte stuffing kernels for the framing hot path.
+// The SSE2/AVX2 versions are picked at runtime and produce exactly the same output as the
+// scalar one: every FLAG/ESC byte becomes ESC followed by the byte XOR 0x20.
+
+// Stuffs bufSize bytes of buf into out (which must have room for 2 * bufSize bytes) and
+// returns the number of bytes written. If fcs isn't NULL it is updated with buf in the same pass.
+int stuffBytes(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs);
+
+// Destuffs in until a FLAG byte or the end of the input, appending to out at *outSize
+// (out must have room for inSize more bytes). *escaped carries a pending ESC between calls.
+// Returns the number of input bytes consumed; the FLAG that stopped it, if any, is not consumed.
+int destuffBytes(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped);
+
+// Name of the kernel selected for this CPU ("avx2", "sse2" or "scalar").
+const char *stuffingKernel();
+
+#endif // STUFFING_H
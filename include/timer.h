@@ -0,0 +1,39 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+// Timers and waiting for the link layer, in place of the SIGALRM alarm of alarm.h.
+
+#include "alarm.h"
+
+// A one-shot alarm, one per connection. enabled is cleared and count incremented
+// every time it fires.
+typedef struct {
+    int fd; // timerfd, created on first use
+    int enabled;
+    int count;
+} Alarm;
+
+void initAlarm(Alarm *alarm);
+
+// Arms the alarm to fire once after timeout seconds.
+int armAlarm(Alarm *alarm, int timeout);
+
+// Arms the alarm to fire once after timeoutMs milliseconds.
+int armAlarmMs(Alarm *alarm, long long timeoutMs);
+
+void stopAlarm(Alarm *alarm);
+
+// Releases the timerfd.
+void closeAlarm(Alarm *alarm);
+
+// Monotonic clock in milliseconds.
+long long currentTimeMs();
+
+// Sleeps until fd has data to read, the alarm fires or the clock reaches deadlineMs
+// (-1 waits without a deadline). alarm may be NULL. Returns TRUE if fd is readable, FALSE otherwise.
+int waitReadable(int fd, Alarm *alarm, long long deadlineMs);
+
+// Sleeps until fd can take more output.
+void waitWritable(int fd);
+
+#endif // TIMER_H
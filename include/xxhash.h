@@ -0,0 +1,29 @@
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64, a fast non-cryptographic 64 bit hash: four lanes of 8 bytes mixed in parallel,
+// several GB/s, good enough to tell two versions of a file apart.
+// It can be computed in one call or fed piece by piece, with the same result.
+
+typedef struct {
+    uint64_t lanes[4];
+    uint64_t total;           // bytes hashed so far
+    unsigned char buffer[32]; // input that doesn't fill a stripe yet
+    int buffered;
+} Xxh64State;
+
+void xxh64Init(Xxh64State *state, uint64_t seed);
+
+// Hashes size more bytes of data.
+void xxh64Update(Xxh64State *state, const void *data, size_t size);
+
+// Hash of everything fed so far; more can still be fed afterwards.
+uint64_t xxh64Digest(const Xxh64State *state);
+
+// Hash of size bytes of data in one call.
+uint64_t xxh64(const void *data, size_t size, uint64_t seed);
+
+#endif // XXHASH_H
@@ -1,6 +1,1128 @@
 // Application layer protocol implementation
 
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "application_layer.h"
+#include "link_connection.h"
+#include "packet.h"
+#include "pipeline.h"
+#include "bond.h"
+#include "lz.h"
+#include "xxhash.h"
+#include "delta.h"
+#include "timer.h"
+
+#define INITIAL_DATA_SIZE 200 // bytes of file data per data packet before any adjustment
+#define MIN_DATA_SIZE 32
+#define ADAPT_INTERVAL 8      // data packets between adjustments
+#define SINK_BATCH_SIZE 65536 // bytes of received data gathered before each pwrite
+#define CHECKPOINT_INTERVAL 1000 // ms between journal updates at most, on a slow line
+
+// Compression (COMPRESSION_LZ agreed by the link layer): the data packets carry the stream of
+// compressed blocks (see packet.h), each block compressed as its packets are cut, and START
+// says so in a TLV.
+#define CONTROL_COMPRESSION 0x02 // START TLV: compression of the data packets
+
+// Resumable transfers: the receiver keeps a journal next to the file it writes, with the
+// identity of the file (size and XXH64, from START) and how much of it is known to be on disk.
+// It offers that checkpoint to the transmitter in its UA, the only way back before the data
+// flows. A transmitter with the same file sends only the rest, and START says where it starts
+// (on a block boundary when compressing).
+#define CONTROL_FILE_HASH 0x03 // START and END TLV: XXH64 of the whole file
+#define CONTROL_RESUME 0x04    // START TLV: file offset of the first data packet
+#define JOURNAL_SUFFIX ".journal"
+#define CHECKPOINT_SIZE 24
+
+// Streams (a pipe, a FIFO or "-" for stdin): the length isn't known until the input ends, so
+// START has no size TLV and END carries the final one. A data packet goes out once it is
+// full or STREAM_FLUSH_INTERVAL after its first byte came in, and the receiver writes each
+// one as it arrives. Streams go uncompressed and can't be resumed.
+#define STREAM_FLUSH_INTERVAL 20 // ms
+
+// Delta transfers: a receiver that has an older version of the file (and no journal for it)
+// offers its size in its UA, BASIS_OFFER_SIZE bytes where a checkpoint would go. A transmitter
+// that takes it up says so in START and turns the line around: the receiver sends back the
+// signatures of the blocks of its copy, then DELTA_SIGNATURES_END with the sizes they cover,
+// and turns it back. The data packets then carry the delta (see delta.h), which the receiver
+// applies into a new file that replaces the old one once END's hash checks out.
+// Single links only, and uncompressed.
+#define CONTROL_DELTA 0x05 // START TLV: the data packets carry a delta; in DELTA_SIGNATURES_END, the block size
+#define DELTA_SIGNATURES 0x08
+#define DELTA_SIGNATURES_END 0x09
+#define BASIS_OFFER_SIZE 8
+#define DELTA_SUFFIX ".delta"
+
+typedef struct {
+    long size;
+    uint64_t hash;
+    long offset; // bytes from the start of the file on disk
+} Checkpoint;
+
+// Sizes data packets from the rate of REJs and timeouts seen by the link layer:
+// a clean line gets bigger packets (less header and turnaround overhead per byte),
+// a noisy one smaller packets (less to resend per error).
+typedef struct {
+    int size, minSize, maxSize, smallest, largest;
+    int errorRate; // errors per 1000 I-frames, moving average
+    int packets;
+    LinkStatistics last;
+} PayloadController;
+
+// The transfer goes over one link, or over a bond of several when more than one serial
+// port is given (comma separated)
+Bond *bond = NULL;
+
+// Packet format agreed on the link, PACKET_FORMAT_V1 until it is open
+int packetFormat = PACKET_FORMAT_V1;
+
+LinkParameters linkParameters() {
+    return bond != NULL ? bondParameters(bond) : llparameters();
+}
+
+LinkStatistics linkStatistics() {
+    return bond != NULL ? bondStatistics(bond) : llstatistics();
+}
+
+// Handshake data the receiver sent back in its UA
+int linkHandshake(unsigned char *data) {
+    return bond != NULL ? bondHandshake(bond, data) : llhandshake(data);
+}
+
+int writeControlPacket(const unsigned char *packet, int size) {
+    return bond != NULL ? bondWriteControl(bond, packet, size) : llwrite(packet, size);
+}
+
+int writeDataPacket(const unsigned char *header, const unsigned char *data, int size) {
+    if (bond != NULL) return bondWriteData(bond, header, data, size);
+
+    struct iovec iov[2] = {{(void *) header, getDataPacketHeaderSize(header)}, {(void *) data, size}};
+    return llwritev(iov, 2);
+}
+
+// Same for data that is reused as soon as it returns, which a bond has to copy
+int writeStreamPacket(const unsigned char *header, const unsigned char *data, int size) {
+    return bond != NULL ? bondWriteDataCopy(bond, header, data, size) : writeDataPacket(header, data, size);
+}
+
+// Waits until every packet written so far is acknowledged
+int flushPackets() {
+    return bond != NULL ? bondFlush(bond) : llflush();
+}
+
+// Points *packet at the next packet, valid until the following call. A single link hands
+// it over where it was destuffed, the bond copies it out of its reorder buffer.
+int readPacket(const unsigned char **packet) {
+    static unsigned char bondPacket[MAX_PAYLOAD_SIZE];
+    int size;
+
+    if (bond == NULL) return llreadview(packet);
+
+    *packet = bondPacket;
+    return bondRead(bond, bondPacket, &size);
+}
+
+void initPayloadController(PayloadController *controller) {
+    int headerSize = packetFormat == PACKET_FORMAT_V2 ? WIDE_DATA_PACKET_HEADER : DATA_PACKET_HEADER;
+
+    controller->maxSize = linkParameters().maxPayloadSize - headerSize;
+    controller->minSize = MIN_DATA_SIZE < controller->maxSize ? MIN_DATA_SIZE : controller->maxSize;
+    controller->size = INITIAL_DATA_SIZE < controller->maxSize ? INITIAL_DATA_SIZE : controller->maxSize;
+    controller->smallest = controller->largest = controller->size;
+    controller->errorRate = 0;
+    controller->packets = 0;
+    controller->last = linkStatistics();
+}
+
+// Called after every data packet sent
+void adaptPayloadSize(PayloadController *controller) {
+    if (++controller->packets % ADAPT_INTERVAL != 0) return;
+
+    LinkStatistics now = linkStatistics();
+    long frames = now.framesSent - controller->last.framesSent;
+    long errors = (now.rejReceived - controller->last.rejReceived) + (now.timeouts - controller->last.timeouts);
+
+    controller->last = now;
+    if (frames <= 0) return;
+
+    controller->errorRate = (3 * controller->errorRate + (int) (errors * 1000 / frames)) / 4;
+
+    if (controller->errorRate < 20) {
+        controller->size += controller->size / 4 + 1;
+    } else if (controller->errorRate > 100) {
+        controller->size /= 2;
+    }
+
+    if (controller->size > controller->maxSize) controller->size = controller->maxSize;
+    if (controller->size < controller->minSize) controller->size = controller->minSize;
+
+    if (controller->size < controller->smallest) controller->smallest = controller->size;
+    if (controller->size > controller->largest) controller->largest = controller->size;
+}
+
+// Receiver side file: preallocated from the size announced in START, written at
+// explicit offsets in batches of contiguous data, synced once at END.
+// With PIPELINE the batches are written by the pipeline's writer thread.
+// If START gave the file's identity, the journal follows what was written.
+typedef struct {
+    int fd;
+    long size;         // announced size, -1 if unknown
+    long offset;       // where the next data packet goes
+    WriteBatch *batch; // being filled
+    int regular;       // a regular file, not a pipe or a device: it can be trimmed and synced
+    int journalFd;     // -1 without a journal
+    Checkpoint checkpoint;
+    long long savedAt; // time of the last journal update
+    Xxh64State hash;   // of the contents from the start of the file, checked against END
+} FileSink;
+
+unsigned char sinkBuffer[SINK_BATCH_SIZE];
+WriteBatch sinkBatch = {sinkBuffer, 0, 0};
+
+// Finds a TLV of a control packet: return its value, with its size in *length, or NULL if there is none
+const unsigned char *getControlField(const unsigned char *packet, int size, int type, int *length) {
+    int index = 1;
+
+    while (index + 2 <= size) {
+        *length = packet[index + 1];
+
+        if (index + 2 + *length > size) break;
+        if (packet[index] == type) return packet + index + 2;
+
+        index += 2 + *length;
+    }
+
+    return NULL;
+}
+
+// Reads a numeric TLV of a START/END control packet, -1 if there is none
+long getControlValue(const unsigned char *packet, int size, int type) {
+    int length;
+    const unsigned char *field = getControlField(packet, size, type, &length);
+    unsigned long value = 0;
+
+    if (field == NULL) return -1;
+
+    for (int i = 0; i < length; i++) value = (value << 8) | field[i];
+
+    return value;
+}
+
+// Reads the file size TLV (type 0) of a START/END control packet, -1 if there is none
+long getControlFileSize(const unsigned char *packet, int size) {
+    return getControlValue(packet, size, 0x00);
+}
+
+// Appends a numeric TLV of length bytes to a control packet, returns its new size
+int addControlValue(unsigned char *packet, int size, int type, int length, uint64_t value) {
+    packet[size++] = type;
+    packet[size++] = length;
+
+    for (int i = length - 1; i >= 0; i--) {
+        packet[size++] = value >> (8 * i);
+    }
+
+    return size;
+}
+
+void encodeCheckpoint(const Checkpoint *checkpoint, unsigned char *out) {
+    uint64_t fields[3] = {checkpoint->size, checkpoint->hash, checkpoint->offset};
+
+    for (int i = 0; i < CHECKPOINT_SIZE; i++) out[i] = fields[i / 8] >> (8 * (7 - i % 8));
+}
+
+// Return "0" on success or "-1" if in isn't a checkpoint
+int decodeCheckpoint(const unsigned char *in, int size, Checkpoint *checkpoint) {
+    uint64_t fields[3] = {0, 0, 0};
+
+    if (size != CHECKPOINT_SIZE) return -1;
+
+    for (int i = 0; i < CHECKPOINT_SIZE; i++) fields[i / 8] = (fields[i / 8] << 8) | in[i];
+
+    checkpoint->size = fields[0];
+    checkpoint->hash = fields[1];
+    checkpoint->offset = fields[2];
+
+    return checkpoint->offset >= 0 && checkpoint->offset <= checkpoint->size ? 0 : -1;
+}
+
+void journalPath(const char *filename, char *path) {
+    snprintf(path, PATH_MAX, "%s" JOURNAL_SUFFIX, filename);
+}
+
+// Reads the journal left by an interrupted transfer to filename.
+// Return "0" on success or "-1" if there is none, or the file it speaks of is gone.
+int loadJournal(const char *filename, Checkpoint *checkpoint) {
+    unsigned char data[CHECKPOINT_SIZE];
+    char path[PATH_MAX];
+    struct stat file;
+
+    journalPath(filename, path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    int size = read(fd, data, CHECKPOINT_SIZE);
+    close(fd);
+
+    if (decodeCheckpoint(data, size, checkpoint) == -1) return -1;
+
+    return stat(filename, &file) == 0 && file.st_size >= checkpoint->offset ? 0 : -1;
+}
+
+// Records that the file is on disk up to offset: the data is synced before the journal says so
+void saveJournal(FileSink *sink, long offset) {
+    unsigned char data[CHECKPOINT_SIZE];
+
+    // the writer thread may not have caught up yet, the next update will tell
+    sink->savedAt = currentTimeMs();
+    if (sink->journalFd == -1 || offset <= sink->checkpoint.offset) return;
+
+    if (fdatasync(sink->fd) == -1) {
+        perror("fdatasync");
+        return;
+    }
+
+    sink->checkpoint.offset = offset;
+    encodeCheckpoint(&sink->checkpoint, data);
+
+    if (pwrite(sink->journalFd, data, CHECKPOINT_SIZE, 0) != CHECKPOINT_SIZE || fdatasync(sink->journalFd) == -1) {
+        perror("journal");
+    }
+}
+
+// Starts the journal of a transfer of the file identified by checkpoint, from its offset
+void openJournal(FileSink *sink, const char *filename, const Checkpoint *checkpoint) {
+    unsigned char data[CHECKPOINT_SIZE];
+    char path[PATH_MAX];
+
+    journalPath(filename, path);
+
+    sink->checkpoint = *checkpoint;
+    sink->savedAt = currentTimeMs();
+    sink->journalFd = open(path, O_RDWR | O_CREAT, 0666);
+
+    if (sink->journalFd == -1) {
+        perror(path);
+        return;
+    }
+
+    encodeCheckpoint(&sink->checkpoint, data);
+
+    if (pwrite(sink->journalFd, data, CHECKPOINT_SIZE, 0) != CHECKPOINT_SIZE) perror(path);
+}
+
+void removeJournal(const char *filename) {
+    char path[PATH_MAX];
+
+    journalPath(filename, path);
+    unlink(path);
+}
+
+int encodeBlock(const unsigned char *contents, int size, unsigned char *out) {
+    // anything that doesn't come out smaller goes raw
+    int stored = lzCompress(contents, size, out + BLOCK_HEADER, size - 1);
+    uint32_t word = stored;
+
+    if (stored == -1) {
+        memcpy(out + BLOCK_HEADER, contents, size);
+        stored = size;
+        word = size | BLOCK_RAW;
+    }
+
+    for (int i = 0; i < BLOCK_HEADER; i++) out[i] = word >> (8 * (BLOCK_HEADER - 1 - i));
+
+    return BLOCK_HEADER + stored;
+}
+
+// Opens the file to be written from offset on. With keep, what it holds stays: the part a
+// resumed transfer already has, or the room a manifest reserved.
+int openFileSink(FileSink *sink, const char *filename, long size, long offset, int keep) {
+    // what is already there from a resumed transfer is read back for the hash
+    sink->fd = open(filename, (offset > 0 ? O_RDWR : O_WRONLY) | O_CREAT | (keep ? 0 : O_TRUNC), 0666);
+    sink->size = size;
+    sink->offset = offset;
+    sink->journalFd = -1;
+
+    if (sink->fd == -1) {
+        perror(filename);
+        return -1;
+    }
+
+    struct stat file;
+    sink->regular = fstat(sink->fd, &file) == 0 && S_ISREG(file.st_mode);
+
+    sink->batch = PIPELINE ? pipelineStartWriter(sink->fd, SINK_BATCH_SIZE) : &sinkBatch;
+
+    if (sink->batch == NULL) {
+        printf("\nCouldn't start the writer thread\n");
+        close(sink->fd);
+        return -1;
+    }
+
+    sink->batch->offset = offset;
+    sink->batch->size = 0;
+
+    // the batch is still empty, so its buffer serves to read back the first offset bytes
+    xxh64Init(&sink->hash, 0);
+
+    for (long done = 0; done < offset;) {
+        ssize_t bytes = pread(sink->fd, sink->batch->data, offset - done < SINK_BATCH_SIZE ? offset - done : SINK_BATCH_SIZE, done);
+
+        if (bytes <= 0) {
+            printf("\nCouldn't read back the first %ld bytes of %s\n", offset, filename);
+            if (PIPELINE) pipelineStopWriter();
+            close(sink->fd);
+            return -1;
+        }
+
+        xxh64Update(&sink->hash, sink->batch->data, bytes);
+        done += bytes;
+    }
+
+    // reserve the whole file up front so it is laid out in one piece; not fatal if the
+    // filesystem can't
+    if (size > 0) {
+        int error = posix_fallocate(sink->fd, 0, size);
+        if (error != 0) printf("\nCouldn't preallocate %ld bytes: %s\n", size, strerror(error));
+    }
+
+    return 0;
+}
+
+int flushFileSink(FileSink *sink) {
+    long next = sink->batch->offset + sink->batch->size;
+
+    if (sink->batch->size == 0) return 0;
+
+    if (PIPELINE) {
+        sink->batch = pipelineWrite(sink->batch);
+    } else if (writeBatch(sink->fd, sink->batch) == -1) {
+        return -1;
+    }
+
+    sink->batch->offset = next;
+    sink->batch->size = 0;
+
+    saveJournal(sink, PIPELINE ? pipelineWritten() : next);
+
+    return 0;
+}
+
+// Stores size bytes that belong at offset. Contiguous data is gathered into one batch;
+// anything else flushes the batch first, and so does a journal update that is due.
+int writeFileSink(FileSink *sink, long offset, const unsigned char *data, int size) {
+    WriteBatch *batch = sink->batch;
+    int checkpointDue = sink->journalFd != -1 && currentTimeMs() - sink->savedAt >= CHECKPOINT_INTERVAL;
+
+    if (offset != batch->offset + batch->size || batch->size + size > SINK_BATCH_SIZE || checkpointDue) {
+        if (flushFileSink(sink) == -1) return -1;
+
+        batch = sink->batch;
+        batch->offset = offset;
+    }
+
+    memcpy(batch->data + batch->size, data, size);
+    batch->size += size;
+    xxh64Update(&sink->hash, data, size);
+
+    // a stream is written as it comes, someone may be reading the other end
+    return sink->size == -1 ? flushFileSink(sink) : 0;
+}
+
+// Where a file of a batch goes: under its own name (whatever path the transmitter had
+// it under is dropped) in directory. Return "0" on success or "-1" if the name isn't usable.
+int batchPath(const char *directory, const unsigned char *name, int length, char *path) {
+    for (int i = length - 1; i >= 0; i--) {
+        if (name[i] == '/') {
+            name += i + 1;
+            length -= i + 1;
+            break;
+        }
+    }
+
+    if (length == 0 || memchr(name, '\0', length) != NULL || (length == 1 && name[0] == '.') ||
+        (length == 2 && name[0] == '.' && name[1] == '.')) {
+        printf("\nBad file name in the batch\n");
+        return -1;
+    }
+
+    snprintf(path, PATH_MAX, "%s/%.*s", directory, length, (const char *) name);
+    return 0;
+}
+
+// Creates the files listed by a manifest packet in directory, each with its room reserved,
+// so a disk that is too small for the batch shows up before its data is sent.
+// Return "0" on success or "-1" on error.
+int reserveFiles(const char *directory, const unsigned char *packet, int size) {
+    char path[PATH_MAX];
+    long fileSize = 0;
+    int index = 1;
+
+    if (mkdir(directory, 0777) == -1 && errno != EEXIST) {
+        perror(directory);
+        return -1;
+    }
+
+    // entries are a size TLV followed by a name TLV
+    while (index + 2 <= size) {
+        int type = packet[index], length = packet[index + 1];
+        const unsigned char *value = packet + index + 2;
+
+        if (index + 2 + length > size) break;
+        index += 2 + length;
+
+        if (type == 0x00) {
+            fileSize = 0;
+            for (int i = 0; i < length; i++) fileSize = (fileSize << 8) | value[i];
+        }
+
+        if (type != 0x01 || batchPath(directory, value, length, path) == -1) continue;
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+        if (fd == -1) {
+            perror(path);
+            return -1;
+        }
+
+        int error = fileSize > 0 ? posix_fallocate(fd, 0, fileSize) : 0;
+        close(fd);
+
+        if (error == ENOSPC) {
+            printf("\nNo room for %s (%ld bytes)\n", path, fileSize);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Receiver side of compression: the stream of blocks, cut into data packets anywhere
+typedef struct {
+    int compressed; // START announced compressed data packets
+    unsigned char header[BLOCK_HEADER];
+    int headerSize; // header bytes of the current block received
+    int blockSize, raw, received;
+} BlockReader;
+
+unsigned char blockData[LZ_BLOCK_SIZE], blockContents[LZ_BLOCK_SIZE];
+
+// Takes the contents of a data packet. Raw blocks go to the sink as they come, compressed
+// ones once they are complete. Return "0" on success or "-1" if the stream is corrupted.
+int readBlocks(BlockReader *reader, FileSink *sink, const unsigned char *data, int size) {
+    while (size > 0) {
+        if (reader->headerSize < BLOCK_HEADER) {
+            reader->header[reader->headerSize++] = *data++;
+            size--;
+
+            if (reader->headerSize == BLOCK_HEADER) {
+                uint32_t word = 0;
+                for (int i = 0; i < BLOCK_HEADER; i++) word = (word << 8) | reader->header[i];
+
+                reader->raw = (word & BLOCK_RAW) != 0;
+                reader->blockSize = word & ~BLOCK_RAW;
+                reader->received = 0;
+
+                if (reader->blockSize > LZ_BLOCK_SIZE) return -1;
+                if (reader->blockSize == 0) reader->headerSize = 0;
+            }
+            continue;
+        }
+
+        int count = size < reader->blockSize - reader->received ? size : reader->blockSize - reader->received;
+
+        if (reader->raw) {
+            if (writeFileSink(sink, sink->offset, data, count) == -1) return -1;
+            sink->offset += count;
+        } else {
+            memcpy(blockData + reader->received, data, count);
+        }
+
+        reader->received += count;
+        data += count;
+        size -= count;
+
+        if (reader->received < reader->blockSize) continue;
+
+        if (!reader->raw) {
+            int contentsSize = lzDecompress(blockData, reader->blockSize, blockContents, LZ_BLOCK_SIZE);
+
+            if (contentsSize == -1 || writeFileSink(sink, sink->offset, blockContents, contentsSize) == -1) return -1;
+            sink->offset += contentsSize;
+        }
+
+        reader->headerSize = 0;
+    }
+
+    return 0;
+}
+
+// Receiver side of a delta: its instructions, cut into data packets anywhere, applied to the
+// basis into the sink
+typedef struct {
+    int active;      // START asked for a delta
+    int basisFd;     // the older version, copies are read from it
+    long basisSize;  // covered by the signatures
+    int blockSize;
+    unsigned char header[DELTA_COPY_HEADER];
+    int headerSize;  // header bytes of the current instruction received
+    long literal;    // bytes of the current literal still to come
+} DeltaReader;
+
+unsigned char basisData[DELTA_MAX_BLOCK];
+
+// Writes count blocks of the basis from first. Return "0" on success or "-1" on error.
+int copyBasis(DeltaReader *reader, FileSink *sink, uint32_t first, uint32_t count) {
+    long start = (long) first * reader->blockSize, end = (long) (first + (uint64_t) count) * reader->blockSize;
+
+    if (start >= reader->basisSize || end - reader->blockSize >= reader->basisSize) return -1;
+    if (end > reader->basisSize) end = reader->basisSize;
+
+    while (start < end) {
+        ssize_t bytes = pread(reader->basisFd, basisData, end - start < DELTA_MAX_BLOCK ? end - start : DELTA_MAX_BLOCK, start);
+
+        if (bytes <= 0 || writeFileSink(sink, sink->offset, basisData, bytes) == -1) return -1;
+
+        sink->offset += bytes;
+        start += bytes;
+    }
+
+    return 0;
+}
+
+// Takes the contents of a data packet. Return "0" on success or "-1" if the delta is corrupted.
+int readDelta(DeltaReader *reader, FileSink *sink, const unsigned char *data, int size) {
+    while (size > 0) {
+        if (reader->literal > 0) {
+            int count = size < reader->literal ? size : reader->literal;
+
+            if (writeFileSink(sink, sink->offset, data, count) == -1) return -1;
+
+            sink->offset += count;
+            reader->literal -= count;
+            data += count;
+            size -= count;
+            continue;
+        }
+
+        reader->header[reader->headerSize++] = *data++;
+        size--;
+
+        int headerSize = reader->header[0] == DELTA_LITERAL ? DELTA_LITERAL_HEADER
+                       : reader->header[0] == DELTA_COPY    ? DELTA_COPY_HEADER
+                                                            : -1;
+
+        if (headerSize == -1) return -1;
+        if (reader->headerSize < headerSize) continue;
+
+        uint32_t words[2] = {0, 0};
+        for (int i = 1; i < headerSize; i++) words[(i - 1) / 4] = (words[(i - 1) / 4] << 8) | reader->header[i];
+
+        reader->headerSize = 0;
+
+        if (reader->header[0] == DELTA_LITERAL) reader->literal = words[0];
+        else if (copyBasis(reader, sink, words[0], words[1]) == -1) return -1;
+    }
+
+    return 0;
+}
+
+void deltaPath(const char *filename, char *path) {
+    snprintf(path, PATH_MAX, "%s" DELTA_SUFFIX, filename);
+}
+
+// Receiver side of a delta: sends the signatures of the first size bytes of the basis over
+// the turned line, in packets sized like data packets would be.
+// Return the size they cover (less if it couldn't all be read), or -1 on error.
+long sendSignatures(int fd, long size, int blockSize, PayloadController *controller) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int sizePacket = 1;
+    long covered = 0;
+
+    packet[0] = DELTA_SIGNATURES;
+
+    while (fd != -1 && covered < size) {
+        ssize_t bytes = pread(fd, basisData, size - covered < blockSize ? size - covered : blockSize, covered);
+
+        if (bytes <= 0) break;
+
+        if (sizePacket > 1 && sizePacket + DELTA_SIGNATURE > 1 + controller->size) {
+            if (writeControlPacket(packet, sizePacket) == -1) return -1;
+            sizePacket = 1;
+            adaptPayloadSize(controller);
+        }
+
+        BlockSignature signature = deltaSignature(basisData, bytes);
+        encodeSignature(&signature, packet + sizePacket);
+        sizePacket += DELTA_SIGNATURE;
+        covered += bytes;
+
+        // only the last block can be short
+        if (bytes < blockSize) break;
+    }
+
+    if (sizePacket > 1 && writeControlPacket(packet, sizePacket) == -1) return -1;
+
+    packet[0] = DELTA_SIGNATURES_END;
+    sizePacket = addControlValue(packet, 1, 0x00, 8, covered);
+    sizePacket = addControlValue(packet, sizePacket, CONTROL_DELTA, 4, blockSize);
+
+    return writeControlPacket(packet, sizePacket) == -1 ? -1 : covered;
+}
+
+// Transmitter side of a delta: reads the signatures the receiver sends over the turned line
+// into *signatures, to be freed. A basis that doesn't add up is taken as none.
+// Return "0" on success or "-1" on error.
+int receiveSignatures(BlockSignature **signatures, long *basisSize, int *blockSize) {
+    const unsigned char *packet;
+    int count = 0, capacity = 0;
+
+    *signatures = NULL;
+
+    while (TRUE) {
+        int size = readPacket(&packet);
+
+        if (size <= 0) continue;
+
+        if (packet[0] == DELTA_SIGNATURES_END) {
+            *basisSize = getControlFileSize(packet, size);
+            *blockSize = getControlValue(packet, size, CONTROL_DELTA);
+            break;
+        }
+
+        if (packet[0] != DELTA_SIGNATURES) continue;
+
+        for (int index = 1; index + DELTA_SIGNATURE <= size; index += DELTA_SIGNATURE) {
+            if (count == capacity) {
+                capacity = capacity > 0 ? 2 * capacity : 1024;
+                BlockSignature *grown = realloc(*signatures, capacity * sizeof(BlockSignature));
+
+                if (grown == NULL) {
+                    printf("\nOut of memory for the signatures\n");
+                    free(*signatures);
+                    *signatures = NULL;
+                    return -1;
+                }
+
+                *signatures = grown;
+            }
+
+            decodeSignature(packet + index, &(*signatures)[count++]);
+        }
+    }
+
+    if (*blockSize < DELTA_MIN_BLOCK || *blockSize > DELTA_MAX_BLOCK || *basisSize < 0 ||
+        (*basisSize + *blockSize - 1) / *blockSize != count) {
+        printf("\nThe receiver's signatures don't add up, sending the whole file\n");
+        *basisSize = 0;
+        *blockSize = DELTA_MIN_BLOCK;
+    }
+
+    return 0;
+}
+
+// Flushes what is left, trims the preallocation to what was actually received and syncs
+int closeFileSink(FileSink *sink, long size) {
+    int result = flushFileSink(sink);
+
+    if (PIPELINE && pipelineStopWriter() == -1) result = -1;
+
+    if (sink->regular && size != sink->size && ftruncate(sink->fd, size) == -1) {
+        perror("ftruncate");
+        result = -1;
+    }
+
+    if (sink->regular && fsync(sink->fd) == -1) {
+        perror("fsync");
+        result = -1;
+    }
+
+    close(sink->fd);
+    if (sink->journalFd != -1) close(sink->journalFd);
+
+    return result;
+}
+
+// Stops a transfer the data packets can't complete: the file keeps only what was written in
+// order, and its journal, so a later transfer resumes from there. A delta is dropped.
+void abortTransfer(FileSink *sink, DeltaReader *delta, const char *filename) {
+    char path[PATH_MAX];
+
+    closeFileSink(sink, sink->offset);
+
+    if (delta->active) {
+        if (delta->basisFd != -1) close(delta->basisFd);
+        deltaPath(filename, path);
+        unlink(path);
+    }
+}
+
+// Checks the file against the hash END carries, if it has one.
+// Return "0" if it matches or can't be checked, "-1" if the file isn't what was sent.
+int verifyFileSink(FileSink *sink, const unsigned char *packet, int size) {
+    int length;
+    const unsigned char *field = getControlField(packet, size, CONTROL_FILE_HASH, &length);
+    uint64_t expected = 0, hash = xxh64Digest(&sink->hash);
+
+    if (field == NULL || length != 8) return 0;
+
+    for (int i = 0; i < length; i++) expected = (expected << 8) | field[i];
+
+    if (hash != expected) {
+        printf("\nThe file received doesn't match the one sent (XXH64 %016llx, sent %016llx)\n",
+               (unsigned long long) hash, (unsigned long long) expected);
+        return -1;
+    }
+
+    printf("\nVerified: XXH64 %016llx\n", (unsigned long long) hash);
+    return 0;
+}
+
+unsigned char encodedBlock[BLOCK_HEADER + LZ_BLOCK_SIZE];
+
+// Sends dataSize bytes of data as data packets, or with compressed the stream of its blocks,
+// each compressed just before its packets are cut. *sent is set to the bytes the packets carry.
+// Return "0" on success or "-1" on error.
+int sendDataPackets(const unsigned char *data, size_t dataSize, int compressed, PayloadController *controller,
+                    size_t *sent) {
+    unsigned char header[MAX_DATA_PACKET_HEADER];
+    size_t offset = 0;
+    int nSequence = 0;
+
+    *sent = 0;
+
+    // bonded links already run on threads of their own
+    if (PIPELINE && bond == NULL) {
+        // reading (and compressing) and framing run on their own threads, this one only
+        // feeds the line
+        TxFrame *frame;
+
+        if (pipelineStartTx(data, dataSize, controller->size, compressed) == -1) {
+            printf("\nCouldn't start the pipeline threads\n");
+            return -1;
+        }
+
+        while ((frame = pipelineNextFrame()) != NULL) {
+            if (llsend(frame) == -1) {
+                pipelineStopTx();
+                return -1;
+            }
+
+            adaptPayloadSize(controller);
+            pipelineSetPacketSize(controller->size);
+        }
+
+        // the frames go back to the pool as they are acknowledged, and the pool starts
+        // afresh with the next file of a batch
+        int flushed = llflush();
+        *sent = pipelineStopTx();
+
+        return flushed;
+    }
+
+    while (offset < dataSize) {
+        const unsigned char *chunk = data + offset;
+        size_t chunkSize = dataSize - offset;
+
+        // a block at a time, which the link copies out before it is overwritten
+        if (compressed) {
+            int blockSize = chunkSize < LZ_BLOCK_SIZE ? chunkSize : LZ_BLOCK_SIZE;
+
+            chunk = encodedBlock;
+            chunkSize = encodeBlock(data + offset, blockSize, encodedBlock);
+            offset += blockSize;
+        } else {
+            offset = dataSize;
+        }
+
+        for (size_t cut = 0; cut < chunkSize;) {
+            size_t nBytes = chunkSize - cut < (size_t) controller->size ? chunkSize - cut : (size_t) controller->size;
+
+            getDataPacketHeader(header, nSequence++, nBytes);
+
+            int written = compressed ? writeStreamPacket(header, chunk + cut, nBytes)
+                                     : writeDataPacket(header, chunk + cut, nBytes);
+            if (written == -1) {
+                return -1;
+            }
+
+            cut += nBytes;
+            *sent += nBytes;
+            adaptPayloadSize(controller);
+        }
+    }
+
+    return 0;
+}
+
+// Sends a file between its START and END. Only a resumable one may carry on from the
+// receiver's journal. Return "0" on success or "-1" on error.
+int sendFile(const char *filename, PayloadController *controller, int resumable) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int sizePacket = 0, result = 0;
+
+    // The file is mapped rather than read: data packets are sent straight from the
+    // mapping, and the link layer's stuffing pass is the only copy of the contents.
+    int filefd = open(filename, O_RDONLY);
+    struct stat file;
+
+    if (filefd == -1 || fstat(filefd, &file) == -1) {
+        printf("Couldn't find a file with that name, sorry.\n");
+        if (filefd != -1) close(filefd);
+        return -1;
+    }
+
+    size_t fileSize = file.st_size;
+    unsigned char *contents = NULL;
+
+    if (fileSize > 0) {
+        contents = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, filefd, 0);
+
+        if (contents == MAP_FAILED) {
+            perror("mmap");
+            close(filefd);
+            return -1;
+        }
+
+        madvise(contents, fileSize, MADV_SEQUENTIAL);
+    }
+
+    close(filefd);
+
+    // carry on where an interrupted transfer of the same file stopped, if the receiver has one
+    unsigned char handshake[MAX_HANDSHAKE_DATA];
+    int handshakeSize = resumable ? linkHandshake(handshake) : 0;
+
+    // The hash can't be taken while the packets go out: it is compared with the receiver's
+    // checkpoint before anything is sent, and START carries it so the receiver's journal
+    // names the file and a later transfer can resume from it.
+    uint64_t hash = xxh64(contents, fileSize, 0);
+    size_t resume = 0;
+    Checkpoint checkpoint;
+
+    if (decodeCheckpoint(handshake, handshakeSize, &checkpoint) == 0 && checkpoint.size == (long) fileSize &&
+        checkpoint.hash == hash) {
+        resume = checkpoint.offset;
+    }
+
+    // or send a delta against the older version the receiver has
+    int delta = resume == 0 && bond == NULL && handshakeSize == BASIS_OFFER_SIZE && fileSize > 0;
+
+    // the data packets carry the file, or its compressed blocks if the receiver takes them,
+    // or the delta
+    const unsigned char *data = contents + resume;
+    size_t dataSize = fileSize - resume, sent = 0;
+    int compressed = linkParameters().compression == COMPRESSION_LZ && dataSize > 0 && !delta;
+    unsigned char *encoded = NULL; // delta
+
+    // compressed blocks start where the file's blocks do
+    if (compressed) {
+        resume -= resume % LZ_BLOCK_SIZE;
+        data = contents + resume;
+        dataSize = fileSize - resume;
+    }
+
+    if (resume > 0) printf("\nResuming at byte %zu of %zu\n", resume, fileSize);
+
+    // a peer that doesn't negotiate reads only the file size and name
+    int original = packetFormat == PACKET_FORMAT_V0;
+
+    sizePacket = getControlPacket(filename, 1, (unsigned char *) &packet);
+    if (!original) sizePacket = addControlValue(packet, sizePacket, CONTROL_FILE_HASH, 8, hash);
+    if (resume > 0) sizePacket = addControlValue(packet, sizePacket, CONTROL_RESUME, 8, resume);
+    if (compressed) sizePacket = addControlValue(packet, sizePacket, CONTROL_COMPRESSION, 1, COMPRESSION_LZ);
+    if (delta) sizePacket = addControlValue(packet, sizePacket, CONTROL_DELTA, 1, 1);
+
+    // from here on everything ends up below, where the mapping and the delta are freed
+    if (writeControlPacket(packet, sizePacket) == -1) result = -1;
+
+    if (result == 0 && delta) {
+        BlockSignature *signatures;
+        long basisSize = 0;
+        int blockSize = 0;
+
+        if (llturn() == -1 || receiveSignatures(&signatures, &basisSize, &blockSize) == -1 || llturn() == -1) {
+            result = -1;
+        } else {
+            encoded = deltaEncode(contents, fileSize, signatures, basisSize, blockSize, &dataSize);
+            free(signatures);
+
+            if (encoded == NULL) {
+                printf("\nOut of memory for the delta\n");
+                result = -1;
+            } else {
+                printf("\nDelta against the receiver's %ld bytes: %zu bytes for %zu\n", basisSize, dataSize, fileSize);
+                data = encoded;
+            }
+        }
+    }
+
+    if (result == 0) result = sendDataPackets(data, dataSize, compressed, controller, &sent);
+    if (result == 0 && compressed) printf("\nCompressed %zu bytes to %zu\n", dataSize, sent);
+
+    if (result == 0) {
+        sizePacket = getControlPacket(filename, 0, (unsigned char *) &packet);
+        if (!original) sizePacket = addControlValue(packet, sizePacket, CONTROL_FILE_HASH, 8, hash);
+
+        // END waits for every data packet to be acknowledged, bonded links may resend some until then
+        if (writeControlPacket(packet, sizePacket) == -1) result = -1;
+    }
+
+    if (contents != NULL) munmap(contents, fileSize);
+    free(encoded);
+
+    return result;
+}
+
+// Sends every regular file of directory in one session: the manifest (as many packets as
+// it takes), each file between its own START and END, then BATCH_END.
+// Return "0" on success or "-1" on error.
+int sendBatch(const char *directory, PayloadController *controller) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    char path[PATH_MAX];
+    struct dirent **entries;
+    struct stat file;
+    int count = scandir(directory, &entries, NULL, alphasort), sizePacket = 1, files = 0, result = 0;
+    int maxSize = linkParameters().maxPayloadSize;
+
+    if (count == -1) {
+        perror(directory);
+        return -1;
+    }
+
+    packet[0] = CONTROL_MANIFEST;
+
+    for (int i = 0; i < count && result == 0; i++) {
+        int length = strlen(entries[i]->d_name), entrySize = 2 + 8 + 2 + length;
+
+        snprintf(path, sizeof(path), "%s/%s", directory, entries[i]->d_name);
+
+        // START carries the path, which has to fit in a TLV
+        if (stat(path, &file) == -1 || !S_ISREG(file.st_mode) || strlen(path) > 255) {
+            free(entries[i]);
+            entries[i] = NULL;
+            continue;
+        }
+
+        if (sizePacket + entrySize > maxSize) {
+            result = writeControlPacket(packet, sizePacket) == -1 ? -1 : 0;
+            sizePacket = 1;
+        }
+
+        sizePacket = addControlValue(packet, sizePacket, 0x00, 8, file.st_size);
+        packet[sizePacket++] = 0x01;
+        packet[sizePacket++] = length;
+        memcpy(packet + sizePacket, entries[i]->d_name, length);
+        sizePacket += length;
+        files++;
+    }
+
+    if (result == 0 && sizePacket > 1) result = writeControlPacket(packet, sizePacket) == -1 ? -1 : 0;
+
+    printf("\nBatch of %d files\n", files);
+
+    for (int i = 0; i < count; i++) {
+        if (entries[i] == NULL) continue;
+
+        snprintf(path, sizeof(path), "%s/%s", directory, entries[i]->d_name);
+        if (result == 0) result = sendFile(path, controller, FALSE);
+
+        free(entries[i]);
+    }
+
+    free(entries);
+
+    packet[0] = CONTROL_BATCH_END;
+    if (result == 0) result = writeControlPacket(packet, 1) == -1 ? -1 : 0;
+
+    return result;
+}
+
+// START or END of a stream: its name and, in END, the length it came to
+int getStreamControlPacket(const char *name, int start, long size, unsigned char *packet) {
+    int length = strlen(name), index = 1;
+
+    if (length > 255) {
+        printf("size of filename couldn't fit in one byte\n");
+        return -1;
+    }
+
+    packet[0] = start ? CONTROL_START : CONTROL_END;
+    if (!start) index = addControlValue(packet, index, 0x00, 8, size);
+
+    packet[index++] = 0x01;
+    packet[index++] = length;
+    memcpy(packet + index, name, length);
+
+    return index + length;
+}
+
+// Sends what fd gives until it ends, as a stream, with at most one data packet held back.
+// Return "0" on success or "-1" on error.
+int sendStream(const char *name, int fd, PayloadController *controller) {
+    static unsigned char data[MAX_PAYLOAD_SIZE];
+    unsigned char packet[MAX_PAYLOAD_SIZE], header[MAX_DATA_PACKET_HEADER];
+    int sizePacket = getStreamControlPacket(name, TRUE, 0, packet), nSequence = 0, filled = 0, ended = FALSE;
+    int unacknowledged = FALSE; // packets went out since the last flush
+    long total = 0;
+    long long firstAt = 0; // when the first byte of the packet being filled came in
+    long long sentAt = 0;  // when the last packet went out
+    Xxh64State hash;
+
+    xxh64Init(&hash, 0);
+
+    if (sizePacket == -1 || writeControlPacket(packet, sizePacket) == -1) {
+        return -1;
+    }
+
+    while (!ended) {
+        long long deadline = filled > 0 ? firstAt + STREAM_FLUSH_INTERVAL : unacknowledged ? sentAt + STREAM_FLUSH_INTERVAL : -1;
+
+        if (waitReadable(fd, NULL, deadline)) {
+            ssize_t bytes = read(fd, data + filled, controller->size - filled);
+
+            if (bytes == -1 && errno != EINTR && errno != EAGAIN) {
+                perror(name);
+                return -1;
+            }
+
+            if (bytes == 0) ended = TRUE;
+            if (bytes > 0 && filled == 0) firstAt = currentTimeMs();
+            if (bytes > 0) xxh64Update(&hash, data + filled, bytes);
+            if (bytes > 0) filled += bytes;
+        } else if (filled == 0 && unacknowledged) {
+            // the link is only serviced while writing, so while the input is quiet wait for
+            // the packets sent to be acknowledged, resending any that were lost
+            if (flushPackets() == -1) return -1;
+            unacknowledged = FALSE;
+        }
+
+        if (filled == 0) continue;
+        if (filled < controller->size && !ended && currentTimeMs() < firstAt + STREAM_FLUSH_INTERVAL) continue;
+
+        getDataPacketHeader(header, nSequence++, filled);
+
+        if (writeStreamPacket(header, data, filled) == -1) {
+            return -1;
+        }
+
+        total += filled;
+        filled = 0;
+        unacknowledged = TRUE;
+        sentAt = currentTimeMs();
+        adaptPayloadSize(controller);
+    }
+
+    printf("\nStream of %ld bytes sent\n", total);
+
+    sizePacket = getStreamControlPacket(name, FALSE, total, packet);
+    sizePacket = addControlValue(packet, sizePacket, CONTROL_FILE_HASH, 8, xxh64Digest(&hash));
+
+    return writeControlPacket(packet, sizePacket) == -1 ? -1 : 0;
+}
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate, int nTries, int timeout,
                       const char *filename) {
@@ -19,92 +1141,222 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
         return;
     }
 
-    LinkLayer ll;
-    strcpy(ll.serialPort, serialPort);
+    LinkLayer ll = {0};
     ll.baudRate = baudRate;
     ll.nRetransmissions = nTries;
     ll.timeout = timeout;
     ll.role = tr;
 
-    if (llopen(ll) == -1) { return; }
+    // sent back in the UA if the transmitter negotiates
+    HandshakeData handshake = {{0}, 0};
 
-    clock_t start, end;
-    start = clock();
+    // what an interrupted transfer to this file left, for the transmitter to carry on from
+    Checkpoint journal;
+    int hasJournal = tr == LlRx && loadJournal(filename, &journal) == 0;
 
-    if (tr == LlTx) {
-        unsigned char packet[300], bytes[200], fileNotOver = 1;
-        int sizePacket = 0;
+    if (hasJournal) {
+        printf("\nJournal: %ld of %ld bytes already received\n", journal.offset, journal.size);
+        encodeCheckpoint(&journal, handshake.data);
+        handshake.size = CHECKPOINT_SIZE;
+    }
 
-        FILE *fileptr;
+    // or an older version of it, which a new one can be sent as a delta against
+    struct stat basis;
+    long basisSize = 0;
 
-        int nBytes = 200, curByte = 0, index = 0, nSequence = 0;
+    if (tr == LlRx && !hasJournal && strchr(serialPort, ',') == NULL && stat(filename, &basis) == 0 &&
+        S_ISREG(basis.st_mode) && basis.st_size > 0) {
+        basisSize = basis.st_size;
+        handshake.size = BASIS_OFFER_SIZE;
 
-        fileptr = fopen(filename, "rb");        // Open the file in binary mode
-        if (fileptr == NULL) {
-            printf("Couldn't find a file with that name, sorry.\n");
-            return;
-        }
+        for (int i = 0; i < BASIS_OFFER_SIZE; i++) handshake.data[i] = basisSize >> (8 * (BASIS_OFFER_SIZE - 1 - i));
+        printf("\nOffering the %ld bytes of %s as a delta basis\n", basisSize, filename);
+    }
 
-        sizePacket = getControlPacket(filename, 1, (unsigned char *) &packet);
+    if (strchr(serialPort, ',') != NULL) {
+        bond = bondOpen(serialPort, ll, &handshake);
+        if (bond == NULL) return;
+    } else {
+        strcpy(ll.serialPort, serialPort);
+        if (llopenhandshake(ll, &handshake) == -1) { return; }
+    }
 
-        if (llwrite(packet, sizePacket) == -1) {
-            return;
-        }
+    packetFormat = linkParameters().packetFormat;
+
+    clock_t start, end;
+    start = clock();
 
-        while (fileNotOver) {
-            if (!fread(&curByte, (size_t) 1, (size_t) 1, fileptr)) {
-                fileNotOver = 0;
-                sizePacket = getDataPacket(bytes, (unsigned char *) &packet, nSequence++, index);
+    PayloadController controller;
 
-                if (llwrite(packet, sizePacket) == -1) {
-                    return;
-                }
-            } else if (nBytes == index) {
-                sizePacket = getDataPacket(bytes, (unsigned char *) &packet, nSequence++, index);
+    if (tr == LlTx) {
+        struct stat file;
 
-                if (llwrite(packet, sizePacket) == -1) {
-                    return;
-                }
+        initPayloadController(&controller);
 
-                memset(bytes, 0, sizeof(bytes));
-                memset(packet, 0, sizeof(packet));
-                index = 0;
-            }
-            bytes[index++] = curByte;
-        }
+        // a directory is sent as a batch of the files in it, and anything that isn't a
+        // regular file (stdin, a pipe, a device) as a stream
+        int sent;
 
-        fclose(fileptr);
+        if (strcmp(filename, "-") == 0) {
+            sent = sendStream("stdin", STDIN_FILENO, &controller);
+        } else if (stat(filename, &file) == 0 && S_ISDIR(file.st_mode)) {
+            sent = sendBatch(filename, &controller);
+        } else if (stat(filename, &file) == 0 && !S_ISREG(file.st_mode)) {
+            int fd = open(filename, O_RDONLY);
 
-        sizePacket = getControlPacket(filename, 0, (unsigned char *) &packet);
+            if (fd == -1) perror(filename);
+            sent = fd == -1 ? -1 : sendStream(filename, fd, &controller);
+            if (fd != -1) close(fd);
+        } else {
+            sent = sendFile(filename, &controller, TRUE);
+        }
 
-        if (llwrite(packet, sizePacket) == -1) {
+        if (sent == -1) {
             return;
         }
     } else {
         // 1º chamar llread
         // 2º ler o packet do llread, se for um control packet START, criar um ficheiro novo, quando receber o close fecho o ficheiro que estou a escrever e paro de chamar llread, se for 0, prox iteraçao chamar llread de novo
         // 3º escrever os dataPacket no ficheiro que criei
-        FILE *fileptr;
-        char readBytes = 1;
+        static FileSink sink;
+        BlockReader reader = {0};
+        DeltaReader delta = {0};
+        uint32_t nextSequence = 0; // of the next wide data packet
+        char readBytes = 1, opened = 0, batch = 0;
+        char path[PATH_MAX];
 
         while (readBytes) {
-            unsigned char packet[600] = {0};
-            int sizeOfPacket = 0, index = 0;
+            const unsigned char *packet;
+            int sizeOfPacket = readPacket(&packet);
 
-            if (llread((unsigned char *) &packet, &sizeOfPacket) == -1) {
+            if (sizeOfPacket <= 0) {
                 continue;
             }
 
-            if (packet[0] == 0x03) {
-                printf("\nClosed penguin\n");
-                fclose(fileptr);
+            if (packet[0] == CONTROL_MANIFEST) {
+                // a batch: the files go in the directory given, under their own names
+                batch = 1;
+                if (reserveFiles(filename, packet, sizeOfPacket) == -1) return;
+            } else if (packet[0] == CONTROL_BATCH_END) {
+                printf("\nBatch received\n");
                 readBytes = 0;
-            } else if (packet[0] == 0x02) {
+            } else if (packet[0] == CONTROL_END) {
+                printf("\nClosed penguin\n");
+                long size = getControlFileSize(packet, sizeOfPacket);
+
+                if (opened && sink.size == -1 && size != sink.offset) {
+                    printf("\nThe stream ended at %ld bytes, the transmitter sent %ld\n", sink.offset, size);
+                }
+
+                int verified = opened ? verifyFileSink(&sink, packet, sizeOfPacket) : -1;
+                int closed = opened && closeFileSink(&sink, sink.offset) == 0;
+
+                // the file is complete, nothing left to resume (a corrupted one would only
+                // be resumed into another corrupted one)
+                if (closed && !batch) removeJournal(filename);
+                opened = 0;
+
+                // the new version only replaces the old one once it is known to be right
+                if (delta.active) {
+                    deltaPath(filename, path);
+                    if (delta.basisFd != -1) close(delta.basisFd);
+
+                    if (closed && verified == 0 && rename(path, filename) == 0) {
+                        printf("\n%s rebuilt from the delta\n", filename);
+                    } else {
+                        printf("\nThe delta didn't rebuild %s, it is left as it was\n", filename);
+                        unlink(path);
+                    }
+
+                    delta.active = 0;
+                }
+                if (!batch) readBytes = 0;
+            } else if (packet[0] == CONTROL_START) {
                 printf("\nOpened penguin\n");
-                fileptr = fopen(filename, "wb");
-            } else {
-                for (int i = 4; i < sizeOfPacket; i++) {
-                    fputc(packet[i], fileptr);
+                long hash = getControlValue(packet, sizeOfPacket, CONTROL_FILE_HASH);
+                Checkpoint identity = {getControlFileSize(packet, sizeOfPacket), hash, 0};
+                long resume = getControlValue(packet, sizeOfPacket, CONTROL_RESUME);
+                int length;
+                const unsigned char *name = getControlField(packet, sizeOfPacket, 0x01, &length);
+
+                if (batch) {
+                    // into the room the manifest reserved
+                    if (name == NULL || batchPath(filename, name, length, path) == -1) return;
+                    if (openFileSink(&sink, path, identity.size, 0, TRUE) == -1) return;
+                } else if (getControlField(packet, sizeOfPacket, CONTROL_DELTA, &length) != NULL) {
+                    // the new version is put together next to the old one it copies from
+                    delta.active = 1;
+                    delta.basisFd = open(filename, O_RDONLY);
+                    delta.headerSize = 0;
+                    delta.literal = 0;
+
+                    deltaPath(filename, path);
+                    if (openFileSink(&sink, path, identity.size, 0, FALSE) == -1) return;
+                } else {
+                    if (resume > 0 && !(hasJournal && journal.size == identity.size &&
+                                        journal.hash == identity.hash && resume <= journal.offset)) {
+                        printf("\nThe transmitter resumes at byte %ld, which isn't in the journal\n", resume);
+                        return;
+                    }
+
+                    identity.offset = resume > 0 ? resume : 0;
+                    if (identity.offset == 0) removeJournal(filename);
+
+                    if (openFileSink(&sink, filename, identity.size, identity.offset, identity.offset > 0) == -1) return;
+                    if (hash != -1) openJournal(&sink, filename, &identity);
+                }
+
+                opened = 1;
+                reader.compressed = getControlValue(packet, sizeOfPacket, CONTROL_COMPRESSION) == COMPRESSION_LZ;
+                reader.headerSize = 0;
+                nextSequence = 0;
+
+                // the receiver's turn: the signatures of what it has, then back to the data
+                if (delta.active) {
+                    delta.blockSize = deltaBlockSize(basisSize);
+
+                    if (llturn() == -1) return;
+                    initPayloadController(&controller);
+                    delta.basisSize = sendSignatures(delta.basisFd, basisSize, delta.blockSize, &controller);
+                    if (delta.basisSize == -1 || llturn() == -1) return;
+                }
+            } else if (opened && sizeOfPacket >= getDataPacketHeaderSize(packet)) {
+                int headerSize = getDataPacketHeaderSize(packet), dataSize = sizeOfPacket - headerSize;
+
+                // packets come in order, so each one starts where the previous one ended.
+                // A wide sequence number tells if one didn't: one seen before is dropped, and
+                // after a gap the rest would land at the wrong offset, so the transfer stops
+                // with what came before the gap kept, and journaled to be resumed.
+                if (packet[0] == WIDE_DATA_PACKET) {
+                    uint32_t sequence = (uint32_t) packet[1] << 24 | packet[2] << 16 | packet[3] << 8 | packet[4];
+
+                    if ((int32_t) (sequence - nextSequence) < 0) {
+                        printf("\nDuplicate data packet %u dropped\n", sequence);
+                        continue;
+                    }
+
+                    if (sequence != nextSequence) {
+                        printf("\nData packets %u to %u are missing, transfer aborted\n", nextSequence, sequence - 1);
+                        abortTransfer(&sink, &delta, filename);
+                        return;
+                    }
+                    nextSequence = sequence + 1;
+                }
+
+                if (delta.active) {
+                    if (readDelta(&delta, &sink, packet + headerSize, dataSize) == -1) {
+                        printf("\nCorrupted delta\n");
+                    }
+                } else if (reader.compressed) {
+                    // nothing after a block that doesn't decode can be placed in the file
+                    if (readBlocks(&reader, &sink, packet + headerSize, dataSize) == -1) {
+                        printf("\nCorrupted compressed data, transfer aborted\n");
+                        abortTransfer(&sink, &delta, filename);
+                        return;
+                    }
+                } else {
+                    writeFileSink(&sink, sink.offset, packet + headerSize, dataSize);
+                    sink.offset += dataSize;
                 }
             }
         }
@@ -112,68 +1364,87 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
     end = clock();
     float duration = ((float) end - start) / CLOCKS_PER_SEC;
 
-    llclose(statistics, ll, duration);
+    if (bond != NULL) {
+        bondClose(bond, statistics);
+        bond = NULL;
+    } else {
+        llclose(statistics, ll, duration);
+    }
+
+    if (statistics && tr == LlTx) {
+        printf("Data packet size: settled at %d bytes (range %d-%d, error rate %d.%d%%)\n", controller.size,
+               controller.smallest, controller.largest, controller.errorRate / 10, controller.errorRate % 10);
+    }
 }
 
 int getControlPacket(char *filename, int start, unsigned char *packet) {
-    int sizeOfPacket = 0;
+    int length = strlen(filename);
 
-    if (strlen(filename) > 255) {
+    if (length > 255) {
         printf("size of filename couldn't fit in one byte: %d\n", 2);
         return -1;
     }
 
-    unsigned char hex_string[20];
-
     struct stat file;
     stat(filename, &file);
-    sprintf(hex_string, "%02lX", file.st_size);
 
-    int index = 3, fileSizeBytes = strlen(hex_string) / 2, fileSize = file.st_size;
+    // the original format gives the size in as few bytes as it takes, the wide one in 8
+    uint64_t fileSize = file.st_size;
+    int fileSizeBytes = 8;
 
-    printf("\nfilesize: %ld\n hex_string: %s", file.st_size, hex_string);
-
-    if (fileSizeBytes > 256) {
-        printf("size of file couldn't fit in one byte\n");
-        return -1;
+    while (packetFormat != PACKET_FORMAT_V2 && fileSizeBytes > 1 && fileSize >> (8 * (fileSizeBytes - 1)) == 0) {
+        fileSizeBytes--;
     }
 
+    printf("\nfilesize: %ld\n", (long) file.st_size);
+
     if (start) {
         packet[0] = 0x02;
     } else {
         packet[0] = 0x03;
     }
 
-    packet[1] = 0x00; // 0 = tamanho do ficheiro 
-    packet[2] = fileSizeBytes;
-
-    for (int i = (fileSizeBytes - 1); i > -1; i--) {
-        packet[index++] = fileSize >> (8 * i);
-    }
+    int index = addControlValue(packet, 1, 0x00, fileSizeBytes, fileSize); // 0 = tamanho do ficheiro
 
     packet[index++] = 0x01;
-    packet[index++] = strlen(filename);
+    packet[index++] = length;
+    memcpy(packet + index, filename, length);
 
-    for (int i = 0; i < strlen(filename); i++) {
-        packet[index++] = filename[i];
-    }
-
-    sizeOfPacket = index;
-
-    return sizeOfPacket;
+    return index + length;
 }
 
-int getDataPacket(unsigned char *bytes, unsigned char *packet, int nSequence, int nBytes) {
+int getDataPacketHeader(unsigned char *packet, int nSequence, int nBytes) {
     int l2 = div(nBytes, 256).quot, l1 = div(nBytes, 256).rem;
 
+    if (packetFormat == PACKET_FORMAT_V2) {
+        uint32_t sequence = nSequence;
+
+        packet[0] = WIDE_DATA_PACKET;
+        for (int i = 0; i < 4; i++) packet[1 + i] = sequence >> (8 * (3 - i));
+        packet[5] = l2;
+        packet[6] = l1;
+
+        return WIDE_DATA_PACKET_HEADER;
+    }
+
     packet[0] = 0x01;
     packet[1] = div(nSequence, 255).rem;
     packet[2] = l2;
     packet[3] = l1;
 
+    return DATA_PACKET_HEADER;
+}
+
+int getDataPacketHeaderSize(const unsigned char *packet) {
+    return packet[0] == WIDE_DATA_PACKET ? WIDE_DATA_PACKET_HEADER : DATA_PACKET_HEADER;
+}
+
+int getDataPacket(unsigned char *bytes, unsigned char *packet, int nSequence, int nBytes) {
+    int index = getDataPacketHeader(packet, nSequence, nBytes);
+
     for (int i = 0; i < nBytes; i++) {
-        packet[i + 4] = bytes[i];
+        packet[index + i] = bytes[i];
     }
 
-    return (nBytes + 4); //tamanho do data packet
+    return (nBytes + index); //tamanho do data packet
 }
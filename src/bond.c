@@ -0,0 +1,756 @@
+// Link bonding
+
+#include <pthread.h>
+#include "bond.h"
+#include "timer.h"
+
+#define INITIAL_GOODPUT 3840 // bytes per second assumed for a link before it is measured
+
+typedef struct {
+    unsigned char head[MAX_PAYLOAD_SIZE]; // data packet header or whole control packet
+    int headSize;
+    const unsigned char *data; // data packet contents, not owned
+    int dataSize;
+    int control;
+    int refs; // links still holding a control packet
+} BondPacket;
+
+typedef struct {
+    Bond *bond;
+    int index;
+    char port[50];
+    LinkConnection *conn;
+    pthread_t thread;
+    SpscRing queue; // bond -> link thread
+
+    // guarded by the bond mutex
+    int alive, opened, flushed;
+    int ended;    // receiver: the session is over on this link
+    int batch;    // receiver: a manifest said more than one file follows
+    int controls; // receiver: control packets seen
+    int queued;      // data packets in queue
+    long queuedBytes;
+    long goodput;    // bytes per second, moving average
+    long packets, bytes;
+    LinkStatistics statistics;
+
+    // packets written but maybe not acknowledged yet, owned by the link thread
+    BondPacket *history[MAX_SEQ_MODULUS];
+    int historySize;
+    long long lastDone;
+} BondLink;
+
+struct Bond {
+    LinkLayer parameters;
+    HandshakeData handshake; // receiver: sent back in the UA of every link
+    BondLink links[MAX_BOND_LINKS];
+    int count;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t progress; // any change worth looking at again
+    int failed;
+
+    // transmitter: packets of failed links waiting to go out again, data packets not released
+    BondPacket *orphans[BOND_MAX_IN_FLIGHT];
+    int orphanCount, inFlight, flushing;
+    unsigned short txSequence; // bond sequence number of the next data packet
+    unsigned short txOldest;   // and of the oldest one not released, which the receiver waits for
+    int txPending[BOND_REORDER_SIZE];
+
+    // receiver: control packets not delivered yet and data packets ahead of rxNext.
+    // Every link carries every control packet in the same order, so the n-th one seen on
+    // a link is the n-th of the session, and the data packets that come after it on that
+    // link belong after it.
+    unsigned char controls[BOND_CONTROL_QUEUE][MAX_PAYLOAD_SIZE];
+    int controlSize[BOND_CONTROL_QUEUE];
+    int controlsReceived, controlsDelivered;
+    unsigned char reorder[BOND_REORDER_SIZE][MAX_PAYLOAD_SIZE];
+    int reorderSize[BOND_REORDER_SIZE];
+    int reorderAfter[BOND_REORDER_SIZE]; // control packets to deliver before it
+    unsigned short rxNext;               // bond sequence number of the next data packet
+    int rxSlot;                          // and its reorder slot
+    long rxDataBytes;                    // data delivered since the last START
+};
+
+// Marker asking a link thread to wait for all its frames to be acknowledged
+BondPacket flushMarker;
+
+////////////////////////////////////////////////
+// TRANSMITTER
+////////////////////////////////////////////////
+
+// Drops a link's reference to a packet it is done with. Called with the mutex held.
+void releasePacket(Bond *bond, BondPacket *packet) {
+    if (packet->control) {
+        if (--packet->refs == 0) free(packet);
+    } else {
+        bond->inFlight--;
+        bond->txPending[(packet->head[1] << 8 | packet->head[2]) % BOND_REORDER_SIZE] = FALSE;
+        while (bond->txOldest != bond->txSequence && !bond->txPending[bond->txOldest % BOND_REORDER_SIZE]) bond->txOldest++;
+        free(packet);
+    }
+}
+
+// Records that a link failed: data packets it may not have delivered go back to the
+// bond to be sent on another link. Called with the mutex held.
+void failLink(BondLink *link, BondPacket *pending) {
+    Bond *bond = link->bond;
+
+    printf("\nLink %s failed, moving its packets to the other links\n", link->port);
+    link->alive = FALSE;
+    bond->failed = TRUE;
+
+    for (int i = 0; i < link->historySize; i++) {
+        if (link->history[i]->control) releasePacket(bond, link->history[i]);
+        else bond->orphans[bond->orphanCount++] = link->history[i];
+    }
+    link->historySize = 0;
+
+    if (pending != NULL) {
+        if (pending->control) releasePacket(bond, pending);
+        else bond->orphans[bond->orphanCount++] = pending;
+    }
+}
+
+void *transmitLink(void *arg) {
+    BondLink *link = arg;
+    Bond *bond = link->bond;
+    LinkLayer parameters = bond->parameters;
+    BondPacket *packet;
+
+    strcpy(parameters.serialPort, link->port);
+    link->conn = llopen_r(parameters, &bond->handshake);
+
+    pthread_mutex_lock(&bond->mutex);
+    link->opened = TRUE;
+    link->alive = link->conn != NULL;
+    link->lastDone = currentTimeMs();
+    pthread_cond_broadcast(&bond->progress);
+    pthread_mutex_unlock(&bond->mutex);
+
+    int windowSize = link->alive ? llparameters_r(link->conn).windowSize : 1;
+
+    while ((packet = spscPop(&link->queue)) != NULL) {
+        int alive = link->alive; // only this thread clears it
+        long long poppedAt = currentTimeMs();
+
+        if (packet == &flushMarker) {
+            int result = alive ? llflush_r(link->conn) : -1;
+
+            pthread_mutex_lock(&bond->mutex);
+            if (alive && result == -1) failLink(link, NULL);
+
+            // everything written is acknowledged now
+            while (link->alive && link->historySize > 0) releasePacket(bond, link->history[--link->historySize]);
+
+            link->flushed = TRUE;
+            pthread_cond_broadcast(&bond->progress);
+            pthread_mutex_unlock(&bond->mutex);
+            continue;
+        }
+
+        struct iovec iov[2] = {{packet->head, packet->headSize}, {(void *) packet->data, packet->dataSize}};
+        int result = alive ? llwritev_r(link->conn, iov, 2) : -1;
+        long long now = currentTimeMs();
+
+        pthread_mutex_lock(&bond->mutex);
+
+        if (!packet->control) {
+            link->queued--;
+            link->queuedBytes -= packet->dataSize;
+        }
+
+        if (result == -1) {
+            if (alive) failLink(link, packet);
+            else if (packet->control) releasePacket(bond, packet);
+            else bond->orphans[bond->orphanCount++] = packet;
+        } else {
+            // only frames beyond the window can be sure to have been acknowledged
+            if (link->historySize == windowSize) {
+                releasePacket(bond, link->history[0]);
+                memmove(link->history, link->history + 1, (windowSize - 1) * sizeof(BondPacket *));
+                link->historySize--;
+            }
+            link->history[link->historySize++] = packet;
+
+            if (!packet->control) {
+                long long interval = now - (link->lastDone > poppedAt ? link->lastDone : poppedAt);
+                long sample = packet->dataSize * 1000L / (interval > 0 ? interval : 1);
+
+                link->goodput = (7 * link->goodput + sample) / 8;
+                link->packets++;
+                link->bytes += packet->dataSize;
+            }
+
+            link->statistics = llstatistics_r(link->conn);
+        }
+
+        link->lastDone = now;
+        pthread_cond_broadcast(&bond->progress);
+        pthread_mutex_unlock(&bond->mutex);
+    }
+
+    // the bond flushed every data packet before closing, only control packets can be left
+    int closed = link->alive ? llclose_r(link->conn, FALSE, 0) : -1;
+    if (!link->alive && link->conn != NULL) llabort_r(link->conn);
+
+    pthread_mutex_lock(&bond->mutex);
+    if (link->alive && closed == -1) link->alive = FALSE;
+    while (link->historySize > 0) releasePacket(bond, link->history[--link->historySize]);
+    link->conn = NULL;
+    pthread_mutex_unlock(&bond->mutex);
+
+    return NULL;
+}
+
+// Link that should get a packet of size bytes through first, -1 if none can take it now.
+// Called with the mutex held.
+int pickLink(Bond *bond, int size) {
+    int best = -1;
+    double bestTime = 0;
+
+    for (int i = 0; i < bond->count; i++) {
+        BondLink *link = &bond->links[i];
+
+        if (!link->alive || link->queued >= BOND_QUEUE_DEPTH) continue;
+
+        double time = (double) (link->queuedBytes + size) / link->goodput;
+
+        if (best == -1 || time < bestTime) {
+            best = i;
+            bestTime = time;
+        }
+    }
+
+    return best;
+}
+
+int aliveLinks(Bond *bond) {
+    int alive = 0;
+    for (int i = 0; i < bond->count; i++) alive += bond->links[i].alive;
+    return alive;
+}
+
+// Puts a data packet on the best link, waiting for room if needed.
+// Called with the mutex held. Return "0" on success or "-1" if every link has failed.
+int dispatchPacket(Bond *bond, BondPacket *packet) {
+    int index;
+
+    while ((index = pickLink(bond, packet->dataSize)) == -1) {
+        if (aliveLinks(bond) == 0) return -1;
+        pthread_cond_wait(&bond->progress, &bond->mutex);
+    }
+
+    BondLink *link = &bond->links[index];
+    link->queued++;
+    link->queuedBytes += packet->dataSize;
+    spscPush(&link->queue, packet);
+
+    return 0;
+}
+
+// Sends the packets of failed links again. Called with the mutex held.
+// Return "0" on success or "-1" if every link has failed.
+int dispatchOrphans(Bond *bond) {
+    while (bond->orphanCount > 0) {
+        // oldest first, the receiver is waiting for them
+        BondPacket *packet = bond->orphans[0];
+
+        bond->orphanCount--;
+        memmove(bond->orphans, bond->orphans + 1, bond->orphanCount * sizeof(BondPacket *));
+
+        if (dispatchPacket(bond, packet) == -1) {
+            releasePacket(bond, packet);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Whether the next data packet is close enough to the oldest one not released for the
+// receiver to hold it. Called with the mutex held.
+int sequenceRoom(Bond *bond) {
+    return (unsigned short) (bond->txSequence - bond->txOldest) < BOND_REORDER_SIZE;
+}
+
+// Numbers a data packet and queues it on a link, with its data copied in after the header
+// if copy is set. Return size, or "-1" if every link has failed.
+int writeData(Bond *bond, const unsigned char *header, const unsigned char *data, int size, int copy) {
+    BondPacket *packet = malloc(sizeof(BondPacket));
+    int result;
+
+    if (packet == NULL) return -1;
+
+    packet->head[0] = BOND_DATA;
+    memcpy(packet->head + BOND_HEADER, header, getDataPacketHeaderSize(header));
+    packet->headSize = BOND_HEADER + getDataPacketHeaderSize(header);
+    packet->data = data;
+    packet->dataSize = size;
+    packet->control = FALSE;
+
+    if (copy) {
+        memcpy(packet->head + packet->headSize, data, size);
+        packet->data = packet->head + packet->headSize;
+    }
+
+    pthread_mutex_lock(&bond->mutex);
+
+    // the receiver can only hold so many packets past the oldest one it is waiting for,
+    // which may be stuck on a link that is failing
+    while ((bond->inFlight >= BOND_MAX_IN_FLIGHT || !sequenceRoom(bond)) && aliveLinks(bond) > 0) {
+        if (dispatchOrphans(bond) == -1) break;
+        if (bond->inFlight >= BOND_MAX_IN_FLIGHT || !sequenceRoom(bond)) pthread_cond_wait(&bond->progress, &bond->mutex);
+    }
+
+    // numbered here, so packets sent again after a failure keep their place
+    packet->head[1] = bond->txSequence >> 8;
+    packet->head[2] = bond->txSequence & 0xFF;
+    bond->txPending[bond->txSequence % BOND_REORDER_SIZE] = TRUE;
+    bond->txSequence++;
+
+    bond->inFlight++;
+    result = dispatchOrphans(bond) == -1 ? -1 : dispatchPacket(bond, packet);
+    if (result == -1) releasePacket(bond, packet);
+
+    pthread_mutex_unlock(&bond->mutex);
+
+    return result == -1 ? -1 : size;
+}
+
+int bondWriteData(Bond *bond, const unsigned char *header, const unsigned char *data, int size) {
+    return writeData(bond, header, data, size, FALSE);
+}
+
+int bondWriteDataCopy(Bond *bond, const unsigned char *header, const unsigned char *data, int size) {
+    return writeData(bond, header, data, size, TRUE);
+}
+
+// Waits until every data packet sent so far is acknowledged on a link that is still up.
+// Called with the mutex held. Return "0" on success or "-1" if every link has failed.
+int flushLinks(Bond *bond) {
+    while (bond->inFlight > 0) {
+        if (dispatchOrphans(bond) == -1) return -1;
+
+        for (int i = 0; i < bond->count; i++) {
+            bond->links[i].flushed = !bond->links[i].alive;
+            if (bond->links[i].alive) spscPush(&bond->links[i].queue, &flushMarker);
+        }
+
+        int done = FALSE;
+        while (!done) {
+            done = TRUE;
+            for (int i = 0; i < bond->count; i++) done &= bond->links[i].flushed;
+            if (!done) pthread_cond_wait(&bond->progress, &bond->mutex);
+        }
+
+        if (aliveLinks(bond) == 0) return -1;
+    }
+
+    return 0;
+}
+
+int bondFlush(Bond *bond) {
+    pthread_mutex_lock(&bond->mutex);
+    int result = flushLinks(bond);
+    pthread_mutex_unlock(&bond->mutex);
+
+    return result;
+}
+
+int bondWriteControl(Bond *bond, const unsigned char *packet, int size) {
+    pthread_mutex_lock(&bond->mutex);
+
+    if (flushLinks(bond) == -1) {
+        pthread_mutex_unlock(&bond->mutex);
+        return -1;
+    }
+
+    BondPacket *control = malloc(sizeof(BondPacket));
+
+    if (control == NULL) {
+        pthread_mutex_unlock(&bond->mutex);
+        return -1;
+    }
+
+    memcpy(control->head, packet, size);
+    control->headSize = size;
+
+    // END says where the data before it ends, so the receiver doesn't have to guess
+    if (packet[0] == CONTROL_END && size + 4 <= MAX_PAYLOAD_SIZE) {
+        control->head[control->headSize++] = TLV_BOND_SEQUENCE;
+        control->head[control->headSize++] = 2;
+        control->head[control->headSize++] = bond->txSequence >> 8;
+        control->head[control->headSize++] = bond->txSequence & 0xFF;
+    }
+    control->data = NULL;
+    control->dataSize = 0;
+    control->control = TRUE;
+    control->refs = aliveLinks(bond);
+
+    for (int i = 0; i < bond->count; i++) {
+        if (bond->links[i].alive) spscPush(&bond->links[i].queue, control);
+    }
+
+    pthread_mutex_unlock(&bond->mutex);
+
+    return size;
+}
+
+////////////////////////////////////////////////
+// RECEIVER
+////////////////////////////////////////////////
+
+// Takes a packet read on any link. Called with the mutex held; waits for bondRead to make
+// room when a packet is too far ahead, holding up the link it came from.
+void reassemblePacket(Bond *bond, BondLink *link, const unsigned char *packet, int size) {
+    if (packet[0] == CONTROL_START || packet[0] == CONTROL_END || packet[0] == CONTROL_MANIFEST || packet[0] == CONTROL_BATCH_END) {
+        // the first link to get it keeps it, once there is room
+        while (link->controls == bond->controlsReceived &&
+               bond->controlsReceived - bond->controlsDelivered >= BOND_CONTROL_QUEUE) {
+            pthread_cond_wait(&bond->progress, &bond->mutex);
+        }
+
+        if (link->controls == bond->controlsReceived) {
+            int slot = bond->controlsReceived++ % BOND_CONTROL_QUEUE;
+            memcpy(bond->controls[slot], packet, size);
+            bond->controlSize[slot] = size;
+        }
+
+        link->controls++;
+
+        if (packet[0] == CONTROL_MANIFEST) link->batch = TRUE;
+        if ((packet[0] == CONTROL_END && !link->batch) || packet[0] == CONTROL_BATCH_END) link->ended = TRUE;
+    } else if (packet[0] == BOND_DATA && size >= BOND_HEADER + DATA_PACKET_HEADER) {
+        unsigned short sequence = packet[1] << 8 | packet[2];
+        unsigned short distance;
+
+        // anything more than half the sequence numbers ahead is a duplicate from the past
+        while ((distance = sequence - bond->rxNext) >= BOND_REORDER_SIZE && distance < 0x8000) {
+            pthread_cond_wait(&bond->progress, &bond->mutex);
+        }
+        if (distance >= 0x8000) return;
+
+        int slot = (bond->rxSlot + distance) % BOND_REORDER_SIZE;
+
+        if (bond->reorderSize[slot] == 0) {
+            memcpy(bond->reorder[slot], packet + BOND_HEADER, size - BOND_HEADER);
+            bond->reorderSize[slot] = size - BOND_HEADER;
+            bond->reorderAfter[slot] = link->controls;
+        }
+    }
+}
+
+void *receiveLink(void *arg) {
+    BondLink *link = arg;
+    Bond *bond = link->bond;
+    LinkLayer parameters = bond->parameters;
+    const unsigned char *packet;
+    int size;
+
+    strcpy(parameters.serialPort, link->port);
+    link->conn = llopen_r(parameters, &bond->handshake);
+
+    pthread_mutex_lock(&bond->mutex);
+    link->opened = TRUE;
+    link->alive = link->conn != NULL;
+    pthread_cond_broadcast(&bond->progress);
+    pthread_mutex_unlock(&bond->mutex);
+
+    if (link->conn == NULL) return NULL;
+
+    while (!link->ended) {
+        // straight from the link layer into the reorder buffer
+        if ((size = llreadview_r(link->conn, &packet)) <= 0) continue;
+
+        pthread_mutex_lock(&bond->mutex);
+        reassemblePacket(bond, link, packet, size);
+        link->packets++;
+        link->bytes += size;
+        link->statistics = llstatistics_r(link->conn);
+        pthread_cond_broadcast(&bond->progress);
+        pthread_mutex_unlock(&bond->mutex);
+    }
+
+    int closed = llclose_r(link->conn, FALSE, 0);
+
+    pthread_mutex_lock(&bond->mutex);
+    if (closed == -1) link->alive = FALSE;
+    link->conn = NULL;
+    pthread_mutex_unlock(&bond->mutex);
+
+    return NULL;
+}
+
+// Bond sequence number of the first data packet after an END, -1 if it doesn't say
+int endSequence(const unsigned char *packet, int size) {
+    int index = 1;
+
+    while (index + 2 <= size && index + 2 + packet[index + 1] <= size) {
+        if (packet[index] == TLV_BOND_SEQUENCE && packet[index + 1] == 2) {
+            return packet[index + 2] << 8 | packet[index + 3];
+        }
+
+        index += 2 + packet[index + 1];
+    }
+
+    return -1;
+}
+
+// Whether the next data packet may be handed over: it is there and so are the control
+// packets sent before it
+int dataReady(Bond *bond) {
+    int slot = bond->rxSlot;
+    return bond->reorderSize[slot] != 0 && bond->reorderAfter[slot] <= bond->controlsDelivered;
+}
+
+// The next control packet is handed over right away, except END which waits for the data
+// before it: up to the sequence number it carries or, from a transmitter that doesn't
+// send one, until every link that is still up has seen END or the data received adds up
+// to the size it announces (a link can die without ever getting its copy).
+int controlReady(Bond *bond) {
+    if (bond->controlsDelivered == bond->controlsReceived) return FALSE;
+
+    int slot = bond->controlsDelivered % BOND_CONTROL_QUEUE;
+    const unsigned char *control = bond->controls[slot];
+    int sequence = endSequence(control, bond->controlSize[slot]);
+
+    if (control[0] != CONTROL_END) return TRUE;
+    if (sequence != -1) return bond->rxNext == sequence;
+    if (dataReady(bond)) return FALSE;
+
+    int allSeen = TRUE;
+    for (int i = 0; i < bond->count; i++) {
+        if (bond->links[i].alive && bond->links[i].controls <= bond->controlsDelivered) allSeen = FALSE;
+    }
+
+    return allSeen || bond->rxDataBytes >= getControlFileSize(control, bond->controlSize[slot]);
+}
+
+int bondRead(Bond *bond, unsigned char *packet, int *sizeOfPacket) {
+    pthread_mutex_lock(&bond->mutex);
+
+    while (TRUE) {
+        int slot = bond->rxSlot;
+
+        if (dataReady(bond)) {
+            *sizeOfPacket = bond->reorderSize[slot];
+            memcpy(packet, bond->reorder[slot], *sizeOfPacket);
+            bond->reorderSize[slot] = 0;
+            bond->rxNext++;
+            bond->rxSlot = (bond->rxSlot + 1) % BOND_REORDER_SIZE;
+            bond->rxDataBytes += *sizeOfPacket - getDataPacketHeaderSize(packet);
+            pthread_cond_broadcast(&bond->progress);
+            break;
+        }
+
+        if (controlReady(bond)) {
+            slot = bond->controlsDelivered++ % BOND_CONTROL_QUEUE;
+            *sizeOfPacket = bond->controlSize[slot];
+            memcpy(packet, bond->controls[slot], *sizeOfPacket);
+            if (packet[0] == CONTROL_START) bond->rxDataBytes = 0;
+            pthread_cond_broadcast(&bond->progress);
+            break;
+        }
+
+        pthread_cond_wait(&bond->progress, &bond->mutex);
+    }
+
+    pthread_mutex_unlock(&bond->mutex);
+
+    return *sizeOfPacket;
+}
+
+////////////////////////////////////////////////
+// BOND
+////////////////////////////////////////////////
+
+Bond *bondOpen(const char *serialPorts, LinkLayer connectionParameters, const HandshakeData *handshake) {
+    Bond *bond = calloc(1, sizeof(Bond));
+    const char *port = serialPorts;
+
+    if (bond == NULL) return NULL;
+
+    bond->parameters = connectionParameters;
+    if (handshake != NULL) bond->handshake = *handshake;
+    pthread_mutex_init(&bond->mutex, NULL);
+    pthread_cond_init(&bond->progress, NULL);
+
+    while (*port != '\0' && bond->count < MAX_BOND_LINKS) {
+        BondLink *link = &bond->links[bond->count];
+        int length = strcspn(port, ",");
+
+        if (length > 0 && length < (int) sizeof(link->port)) {
+            memcpy(link->port, port, length);
+            link->port[length] = '\0';
+            link->bond = bond;
+            link->index = bond->count;
+            link->goodput = INITIAL_GOODPUT;
+            spscInit(&link->queue);
+            bond->count++;
+        }
+
+        port += length;
+        if (*port == ',') port++;
+    }
+
+    for (int i = 0; i < bond->count; i++) {
+        BondLink *link = &bond->links[i];
+        pthread_create(&link->thread, NULL, connectionParameters.role == LlTx ? transmitLink : receiveLink, link);
+    }
+
+    // the links are opened concurrently, wait for all of them
+    pthread_mutex_lock(&bond->mutex);
+    for (int i = 0; i < bond->count; i++) {
+        while (!bond->links[i].opened) pthread_cond_wait(&bond->progress, &bond->mutex);
+    }
+    int alive = aliveLinks(bond);
+    pthread_mutex_unlock(&bond->mutex);
+
+    printf("\nBonded %d of %d links\n", alive, bond->count);
+
+    if (alive == 0) {
+        bondClose(bond, FALSE);
+        return NULL;
+    }
+
+    return bond;
+}
+
+LinkParameters bondParameters(Bond *bond) {
+    LinkParameters params = {0};
+    int first = TRUE;
+
+    pthread_mutex_lock(&bond->mutex);
+    for (int i = 0; i < bond->count; i++) {
+        BondLink *link = &bond->links[i];
+        if (!link->alive || link->conn == NULL) continue;
+
+        LinkParameters linkParams = llparameters_r(link->conn);
+        if (first || linkParams.maxPayloadSize < params.maxPayloadSize) params = linkParams;
+        first = FALSE;
+    }
+    pthread_mutex_unlock(&bond->mutex);
+
+    params.maxPayloadSize -= BOND_HEADER;
+
+    return params;
+}
+
+int bondHandshake(Bond *bond, unsigned char *data) {
+    int size = 0;
+
+    pthread_mutex_lock(&bond->mutex);
+    for (int i = 0; i < bond->count; i++) {
+        BondLink *link = &bond->links[i];
+
+        if (link->alive && link->conn != NULL) {
+            size = llhandshake_r(link->conn, data);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bond->mutex);
+
+    return size;
+}
+
+LinkStatistics bondStatistics(Bond *bond) {
+    LinkStatistics total = {0};
+
+    pthread_mutex_lock(&bond->mutex);
+    for (int i = 0; i < bond->count; i++) {
+        total.framesSent += bond->links[i].statistics.framesSent;
+        total.retransmissions += bond->links[i].statistics.retransmissions;
+        total.rejReceived += bond->links[i].statistics.rejReceived;
+        total.timeouts += bond->links[i].statistics.timeouts;
+        total.parityFrames += bond->links[i].statistics.parityFrames;
+        total.framesRebuilt += bond->links[i].statistics.framesRebuilt;
+        total.framesReceived += bond->links[i].statistics.framesReceived;
+        total.duplicates += bond->links[i].statistics.duplicates;
+        total.fcsErrors += bond->links[i].statistics.fcsErrors;
+        total.rejSent += bond->links[i].statistics.rejSent;
+        total.payloadSent += bond->links[i].statistics.payloadSent;
+        total.payloadReceived += bond->links[i].statistics.payloadReceived;
+        total.wireSent += bond->links[i].statistics.wireSent;
+        total.wireReceived += bond->links[i].statistics.wireReceived;
+        total.stuffingBytes += bond->links[i].statistics.stuffingBytes;
+        total.rttTotal += bond->links[i].statistics.rttTotal;
+
+        for (int j = 0; j < RTT_BUCKETS; j++) total.rttHistogram[j] += bond->links[i].statistics.rttHistogram[j];
+
+        // the links run side by side
+        if (bond->links[i].statistics.elapsed > total.elapsed) total.elapsed = bond->links[i].statistics.elapsed;
+    }
+    pthread_mutex_unlock(&bond->mutex);
+
+    return total;
+}
+
+int bondClose(Bond *bond, int showStatistics) {
+    int result = 1, detached = FALSE;
+    LinkParameters parameters = bondParameters(bond); // while the links are still open
+
+    if (bond->parameters.role == LlTx) {
+        pthread_mutex_lock(&bond->mutex);
+        if (flushLinks(bond) == -1) result = -1;
+        pthread_mutex_unlock(&bond->mutex);
+
+        for (int i = 0; i < bond->count; i++) {
+            spscPush(&bond->links[i].queue, NULL);
+            pthread_join(bond->links[i].thread, NULL);
+        }
+    } else {
+        // a link whose transmitter died never gets to the end of the session and stays
+        // blocked reading; leave it be
+        for (int i = 0; i < bond->count; i++) {
+            BondLink *link = &bond->links[i];
+
+            pthread_mutex_lock(&bond->mutex);
+            int finishing = link->ended || !link->alive;
+            pthread_mutex_unlock(&bond->mutex);
+
+            if (finishing) {
+                pthread_join(link->thread, NULL);
+            } else {
+                printf("\nLink %s never got to the end, giving up on it\n", link->port);
+                pthread_detach(link->thread);
+                detached = TRUE;
+                bond->failed = TRUE;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&bond->mutex);
+
+    if (bond->failed) result = -1;
+
+    if (showStatistics) {
+        printf("\n------------------------------BONDED LINKS------------------------------\n\n");
+
+        for (int i = 0; i < bond->count; i++) {
+            BondLink *link = &bond->links[i];
+            printf("%s: %s, %ld packets, %ld bytes", link->port, link->alive ? "up" : "failed", link->packets, link->bytes);
+            if (bond->parameters.role == LlTx) printf(", goodput %ld bytes/s", link->goodput);
+            printf("\n");
+        }
+
+        // each link against its own line
+        for (int i = 0; i < bond->count; i++) {
+            printf("\n%s:\n", bond->links[i].port);
+            llprintstatistics(&bond->links[i].statistics, parameters, bond->parameters.baudRate);
+        }
+    }
+
+    pthread_mutex_unlock(&bond->mutex);
+
+    // detached receiver threads still use the bond
+    if (detached) return result;
+
+    for (int i = 0; i < bond->count; i++) spscDestroy(&bond->links[i].queue);
+
+    pthread_mutex_destroy(&bond->mutex);
+    pthread_cond_destroy(&bond->progress);
+    free(bond);
+
+    return result;
+}
@@ -0,0 +1,100 @@
+// Consistent Overhead Byte Stuffing
+
+#include "cobs.h"
+#include "link_layer.h"
+
+// Code byte of a block of run bytes, skipping the value of FLAG
+static inline unsigned char codeByte(int run) {
+    return run < FLAG ? run : run + 1;
+}
+
+static inline int blockLength(unsigned char code) {
+    return code < FLAG ? code : code - 1;
+}
+
+// Writes the code byte of the open block and opens the next one
+static inline void closeBlock(CobsEncoder *encoder) {
+    encoder->out[encoder->code] = codeByte(encoder->run);
+    encoder->code = encoder->size++;
+    encoder->run = 0;
+}
+
+void cobsBegin(CobsEncoder *encoder, unsigned char *out) {
+    encoder->out = out;
+    encoder->code = 0;
+    encoder->size = 1;
+    encoder->run = 0;
+}
+
+void cobsEncode(CobsEncoder *encoder, const unsigned char *buf, int bufSize, Fcs *fcs) {
+    if (fcs != NULL) fcsUpdate(fcs, buf, bufSize);
+
+    while (bufSize > 0) {
+        int count = COBS_MAX_RUN - encoder->run;
+        if (count > bufSize) count = bufSize;
+
+        const unsigned char *flag = memchr(buf, FLAG, count);
+        if (flag != NULL) count = flag - buf;
+
+        memcpy(encoder->out + encoder->size, buf, count);
+        encoder->size += count;
+        encoder->run += count;
+        buf += count;
+        bufSize -= count;
+
+        if (flag != NULL) {
+            // the FLAG ends the block and is left out
+            closeBlock(encoder);
+            buf++;
+            bufSize--;
+        } else if (encoder->run == COBS_MAX_RUN) {
+            closeBlock(encoder);
+        }
+    }
+}
+
+int cobsEnd(CobsEncoder *encoder) {
+    encoder->out[encoder->code] = codeByte(encoder->run);
+    return encoder->size;
+}
+
+void cobsDecoderInit(CobsDecoder *decoder) {
+    decoder->remaining = 0;
+    decoder->pending = FALSE;
+}
+
+int cobsDecode(const unsigned char *in, int inSize, unsigned char *out, int *outSize, CobsDecoder *decoder) {
+    int i = 0, index = *outSize;
+
+    while (i < inSize) {
+        if (decoder->remaining == 0) {
+            if (in[i] == FLAG) break;
+
+            // a new block: the FLAG implied by the one before goes out first
+            if (decoder->pending) out[index++] = FLAG;
+
+            decoder->remaining = blockLength(in[i++]);
+            decoder->pending = decoder->remaining < COBS_MAX_RUN;
+            continue;
+        }
+
+        int count = inSize - i < decoder->remaining ? inSize - i : decoder->remaining;
+
+        const unsigned char *flag = memchr(in + i, FLAG, count);
+        if (flag != NULL) count = flag - (in + i);
+
+        memcpy(out + index, in + i, count);
+        index += count;
+        i += count;
+        decoder->remaining -= count;
+
+        if (flag != NULL) break; // the frame ended inside a block
+    }
+
+    *outSize = index;
+    return i;
+}
+
+int cobsComplete(const CobsDecoder *decoder) {
+    return decoder->remaining == 0;
+}
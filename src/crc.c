@@ -0,0 +1,132 @@
+// Frame check sequence kernels.
+// Both CRCs are reflected, so they share the same slice-by-8 scheme: table[k][i] is the
+// CRC of byte i followed by k zero bytes, which lets 8 input bytes be folded per step.
+
+#include <pthread.h>
+#include "crc.h"
+
+#define CRC16_POLY 0x8408     // 0x1021 reflected
+#define CRC32_POLY 0xEDB88320 // 0x04C11DB7 reflected
+
+uint16_t crc16Table[8][256];
+uint32_t crc32Table[8][256];
+pthread_once_t crcTablesOnce = PTHREAD_ONCE_INIT; // tables are built on first use
+
+void initCrcTables() {
+    for (int i = 0; i < 256; i++) {
+        uint16_t c16 = i;
+        uint32_t c32 = i;
+
+        for (int bit = 0; bit < 8; bit++) {
+            c16 = (c16 & 1) ? (c16 >> 1) ^ CRC16_POLY : c16 >> 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32_POLY : c32 >> 1;
+        }
+
+        crc16Table[0][i] = c16;
+        crc32Table[0][i] = c32;
+    }
+
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            crc16Table[k][i] = (crc16Table[k - 1][i] >> 8) ^ crc16Table[0][crc16Table[k - 1][i] & 0xFF];
+            crc32Table[k][i] = (crc32Table[k - 1][i] >> 8) ^ crc32Table[0][crc32Table[k - 1][i] & 0xFF];
+        }
+    }
+}
+
+uint16_t crc16Update(uint16_t crc, const unsigned char *buf, int size) {
+    pthread_once(&crcTablesOnce, initCrcTables);
+
+    while (size >= 8) {
+        uint16_t x = crc ^ (buf[0] | (buf[1] << 8));
+
+        crc = crc16Table[7][x & 0xFF] ^ crc16Table[6][x >> 8] ^
+              crc16Table[5][buf[2]] ^ crc16Table[4][buf[3]] ^
+              crc16Table[3][buf[4]] ^ crc16Table[2][buf[5]] ^
+              crc16Table[1][buf[6]] ^ crc16Table[0][buf[7]];
+
+        buf += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ crc16Table[0][(crc ^ *buf++) & 0xFF];
+    }
+
+    return crc;
+}
+
+uint32_t crc32Update(uint32_t crc, const unsigned char *buf, int size) {
+    pthread_once(&crcTablesOnce, initCrcTables);
+
+    while (size >= 8) {
+        uint32_t x = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24));
+
+        crc = crc32Table[7][x & 0xFF] ^ crc32Table[6][(x >> 8) & 0xFF] ^
+              crc32Table[5][(x >> 16) & 0xFF] ^ crc32Table[4][x >> 24] ^
+              crc32Table[3][buf[4]] ^ crc32Table[2][buf[5]] ^
+              crc32Table[1][buf[6]] ^ crc32Table[0][buf[7]];
+
+        buf += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ crc32Table[0][(crc ^ *buf++) & 0xFF];
+    }
+
+    return crc;
+}
+
+uint16_t crc16(const unsigned char *buf, int size) {
+    return crc16Update(0xFFFF, buf, size) ^ 0xFFFF;
+}
+
+uint32_t crc32(const unsigned char *buf, int size) {
+    return crc32Update(0xFFFFFFFF, buf, size) ^ 0xFFFFFFFF;
+}
+
+int fcsSizeOf(int type) {
+    switch (type) {
+        case FCS_CRC16:
+            return 2;
+        case FCS_CRC32:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+void fcsInit(Fcs *fcs, int type) {
+    fcs->type = type;
+
+    if (type == FCS_CRC16) fcs->value = 0xFFFF;
+    else if (type == FCS_CRC32) fcs->value = 0xFFFFFFFF;
+    else fcs->value = 0;
+}
+
+void fcsUpdate(Fcs *fcs, const unsigned char *buf, int size) {
+    if (fcs->type == FCS_CRC16) {
+        fcs->value = crc16Update(fcs->value, buf, size);
+    } else if (fcs->type == FCS_CRC32) {
+        fcs->value = crc32Update(fcs->value, buf, size);
+    } else {
+        for (int i = 0; i < size; i++) {
+            fcs->value ^= buf[i];
+        }
+    }
+}
+
+int fcsFinal(const Fcs *fcs, unsigned char *out) {
+    uint32_t value = fcs->value;
+    int size = fcsSizeOf(fcs->type);
+
+    if (fcs->type == FCS_CRC16) value ^= 0xFFFF;
+    else if (fcs->type == FCS_CRC32) value ^= 0xFFFFFFFF;
+
+    for (int i = 0; i < size; i++) {
+        out[i] = value >> (8 * i);
+    }
+
+    return size;
+}
@@ -0,0 +1,201 @@
+// rsync style delta encoding
+
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+#include "xxhash.h"
+
+#define MAX_LITERAL (1 << 30) // longer literal runs are split
+
+// The rsync checksum: a is the sum of the bytes, b the sum of a after each one, both mod 2^16
+static uint32_t checksum(const unsigned char *data, int size, uint32_t *a, uint32_t *b) {
+    uint32_t sumA = 0, sumB = 0;
+
+    for (int i = 0; i < size; i++) {
+        sumA += data[i];
+        sumB += sumA;
+    }
+
+    *a = sumA & 0xFFFF;
+    *b = sumB & 0xFFFF;
+
+    return *a | *b << 16;
+}
+
+// Slides a window of size bytes one byte forward, from out to in
+static inline uint32_t roll(uint32_t *a, uint32_t *b, int size, unsigned char out, unsigned char in) {
+    *a = (*a - out + in) & 0xFFFF;
+    *b = (*b - (uint32_t) size * out + *a) & 0xFFFF;
+
+    return *a | *b << 16;
+}
+
+int deltaBlockSize(long size) {
+    int blockSize = DELTA_MIN_BLOCK;
+
+    while (blockSize < DELTA_MAX_BLOCK && (long) blockSize * blockSize * 2 < size) blockSize <<= 1;
+
+    return blockSize;
+}
+
+BlockSignature deltaSignature(const unsigned char *block, int size) {
+    BlockSignature signature;
+    uint32_t a, b;
+
+    signature.weak = checksum(block, size, &a, &b);
+    signature.strong = xxh64(block, size, 0);
+
+    return signature;
+}
+
+void encodeSignature(const BlockSignature *signature, unsigned char *out) {
+    for (int i = 0; i < 4; i++) out[i] = signature->weak >> (24 - 8 * i);
+    for (int i = 0; i < 8; i++) out[4 + i] = signature->strong >> (56 - 8 * i);
+}
+
+void decodeSignature(const unsigned char *in, BlockSignature *signature) {
+    signature->weak = 0;
+    signature->strong = 0;
+
+    for (int i = 0; i < 4; i++) signature->weak = signature->weak << 8 | in[i];
+    for (int i = 0; i < 8; i++) signature->strong = signature->strong << 8 | in[4 + i];
+}
+
+static inline size_t put32(unsigned char *out, size_t index, uint32_t value) {
+    for (int i = 0; i < 4; i++) out[index++] = value >> (24 - 8 * i);
+    return index;
+}
+
+static size_t putLiteral(unsigned char *out, size_t index, const unsigned char *data, size_t size) {
+    while (size > 0) {
+        size_t length = size < MAX_LITERAL ? size : MAX_LITERAL;
+
+        out[index++] = DELTA_LITERAL;
+        index = put32(out, index, length);
+        memcpy(out + index, data, length);
+
+        index += length;
+        data += length;
+        size -= length;
+    }
+
+    return index;
+}
+
+static size_t putCopy(unsigned char *out, size_t index, uint32_t first, uint32_t count) {
+    if (count == 0) return index;
+
+    out[index++] = DELTA_COPY;
+    index = put32(out, index, first);
+    return put32(out, index, count);
+}
+
+static inline int matches(const BlockSignature *signature, uint32_t weak, const unsigned char *data, int size) {
+    return signature->weak == weak && signature->strong == xxh64(data, size, 0);
+}
+
+unsigned char *deltaEncode(const unsigned char *contents, size_t size, const BlockSignature *signatures,
+                           long basisSize, int blockSize, size_t *deltaSize) {
+    int blocks = (basisSize + blockSize - 1) / blockSize;
+    int lastSize = blocks > 0 ? basisSize - (long) (blocks - 1) * blockSize : 0;
+    int full = lastSize == blockSize ? blocks : blocks - 1; // a short last block only matches at the end
+
+    // full blocks by weak checksum, chained in order so the earliest of equal blocks is found first
+    int bits = 4;
+    while (bits < 24 && (1 << bits) < 2 * full) bits++;
+
+    int *heads = malloc(sizeof(int) << bits);
+    int *next = malloc(sizeof(int) * (full > 0 ? full : 1));
+    unsigned char *out = malloc(size + 2 * DELTA_COPY_HEADER * (size / blockSize + 2));
+
+    if (heads == NULL || next == NULL || out == NULL) {
+        free(heads);
+        free(next);
+        free(out);
+        return NULL;
+    }
+
+    uint32_t mask = (1u << bits) - 1;
+    memset(heads, 0xFF, sizeof(int) << bits);
+
+    for (int k = full - 1; k >= 0; k--) {
+        uint32_t slot = (signatures[k].weak * 2654435761u) >> (32 - bits) & mask;
+        next[k] = heads[slot];
+        heads[slot] = k;
+    }
+
+    size_t index = 0, literal = 0, i = 0;
+    uint32_t first = 0, count = 0; // run of copies not written yet, always right before literal
+    uint32_t a = 0, b = 0, weak = 0;
+
+    if (size >= (size_t) blockSize && full > 0) weak = checksum(contents, blockSize, &a, &b);
+
+    while (full > 0 && i + blockSize <= size) {
+        int match = -1;
+
+        // the block after the run is the likeliest, then anything with the same checksum
+        if (count > 0 && first + count < (uint32_t) full &&
+            matches(&signatures[first + count], weak, contents + i, blockSize))
+            match = first + count;
+
+        for (int k = heads[(weak * 2654435761u) >> (32 - bits) & mask]; match == -1 && k != -1; k = next[k]) {
+            if (matches(&signatures[k], weak, contents + i, blockSize)) match = k;
+        }
+
+        if (match == -1) {
+            if (i + blockSize < size) weak = roll(&a, &b, blockSize, contents[i], contents[i + blockSize]);
+            i++;
+            continue;
+        }
+
+        if (i > literal) {
+            index = putCopy(out, index, first, count);
+            index = putLiteral(out, index, contents + literal, i - literal);
+            count = 0;
+        }
+
+        if (count > 0 && first + count == (uint32_t) match) count++;
+        else {
+            index = putCopy(out, index, first, count);
+            first = match;
+            count = 1;
+        }
+
+        i += blockSize;
+        literal = i;
+        if (i + blockSize <= size) weak = checksum(contents + i, blockSize, &a, &b);
+    }
+
+    // the short last block of the basis, where the file ends the same way
+    if (lastSize > 0 && lastSize < blockSize && size - literal >= (size_t) lastSize) {
+        size_t at = size - lastSize;
+        uint32_t tailA, tailB;
+
+        if (matches(&signatures[blocks - 1], checksum(contents + at, lastSize, &tailA, &tailB), contents + at,
+                    lastSize)) {
+            if (at > literal) {
+                index = putCopy(out, index, first, count);
+                index = putLiteral(out, index, contents + literal, at - literal);
+                count = 0;
+            }
+
+            if (count > 0 && first + count == (uint32_t) blocks - 1) count++;
+            else {
+                index = putCopy(out, index, first, count);
+                first = blocks - 1;
+                count = 1;
+            }
+
+            literal = size;
+        }
+    }
+
+    index = putCopy(out, index, first, count);
+    index = putLiteral(out, index, contents + literal, size - literal);
+
+    free(heads);
+    free(next);
+
+    *deltaSize = index;
+    return out;
+}
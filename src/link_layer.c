@@ -1,34 +1,122 @@
 // Link layer protocol implementation
 
+#include <errno.h>
 #include <unistd.h>
 #include "link_layer.h"
-#include "alarm.h"
+#include "link_connection.h"
+#include "timer.h"
+#include "crc.h"
+#include "stuffing.h"
+#include "cobs.h"
+#include "rtt.h"
+#include "spsc.h"
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
-int alarmEnabled = FALSE;
-int alarmCount = 1;
-int senderNumber = 0, receiverNumber = 1;
-int nTries, timeout, fd, lastFrameNumber = -1;
-
-void config(LinkLayer connectionParameters) {
-    fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY | O_NONBLOCK);
-
-    alarmCount = 0;
-
-    if (fd < 0) {
+#define RX_RING_SIZE 4096 // must be a power of two
+#define MIN_RTO_MS 50      // floor of the adaptive retransmission timeout
+#define FEC_EPOCH 32       // I-frames between adjustments of the FEC group size
+
+typedef struct {
+    unsigned char A, C;
+    unsigned char data[FEC_HEADER + MAX_PAYLOAD_SIZE + MAX_FCS_SIZE + 1]; // payload, FCS, a byte to spot overlong frames
+    int dataSize;
+    Fcs fcs;         // running FCS of I-frames, computed as they are destuffed
+    int fcsChecked;  // payload bytes already in fcs
+} Frame;
+
+// Everything a connection needs, so one process can drive any number of links
+struct LinkConnection {
+    int fd;
+    LinkLayerRole role;
+    int nTries, timeout;
+    Alarm alarm;
+
+    // Settings agreed in llopen, and whether the transmitter sent a capability block at all
+    LinkParameters linkParams;
+    int peerNegotiates;
+
+    // Application data carried by the UA: sent by the receiver, kept by the transmitter
+    unsigned char handshakeData[MAX_HANDSHAKE_DATA];
+    int handshakeSize;
+
+    // Sequence numbers are modulo 2^seqBits (1 bit in stop-and-wait)
+    int seqBits, seqModulus;
+
+    // Frame reception state, kept across calls so a partially read frame is not lost.
+    // Frames are destuffed straight into rxFrame, which llread hands out without copying.
+    LinkLayerState rxState;
+    Frame rxFrame;
+    int rxEscaped;
+    int rxCobs; // the data field of this frame is COBS encoded
+    CobsDecoder rxDecoder;
+    int rxLimit; // longest data field accepted, from the agreed maximum payload
+
+    // Receive ring filled by bulk reads; rxHead/rxTail are free-running byte counters
+    unsigned char rxRing[RX_RING_SIZE];
+    unsigned int rxHead, rxTail;
+
+    // Transmitter window: frames [txBase, txBase + txOutstanding) are waiting for an RR.
+    // Each one keeps its own retransmission deadline and number of transmissions.
+    // llwritev() builds its frames in txSlots; llsend() puts the caller's frames in the window.
+    TxFrame txSlots[MAX_SEQ_MODULUS];
+    TxFrame *txFrames[MAX_SEQ_MODULUS];
+    int txAttempts[MAX_SEQ_MODULUS];
+    long long txDeadline[MAX_SEQ_MODULUS], txFirstSent[MAX_SEQ_MODULUS];
+    int txBase, txNext, txOutstanding;
+
+    // Adaptive retransmission timeout; LinkLayer.timeout is only its ceiling
+    RttEstimator rtt;
+
+    // FEC parity of the I-frames sent since the last parity frame: fecCount frames from
+    // N(S) fecFirst, XOR of their payloads (fecLongest bytes) and of their sizes.
+    // fecGroup is the current group size; it is retuned every FEC_EPOCH frames.
+    TxFrame fecFrame;
+    unsigned char fecParity[MAX_PAYLOAD_SIZE];
+    int fecFirst, fecCount, fecLongest, fecSizes, fecGroup;
+    long fecEpochFrames, fecEpochRejects;
+
+    LinkStatistics statistics;
+    int baudRate;
+    long long openedAt;
+
+    // Receiver: next sequence number to deliver and whether a REJ is pending for it
+    int rxExpected, rejSent;
+
+    // Go-back-n receiver: size (-1 for none) and FCS of the frame last delivered under each
+    // sequence number, to tell a repeated frame from one after a lost frame
+    int rxDeliveredSize[MAX_SEQ_MODULUS];
+    uint32_t rxDeliveredFcs[MAX_SEQ_MODULUS];
+
+    // After the line turned, the RR this end sent last as the receiver (-1 if it never was):
+    // the peer may have missed it and be sending its last I-frame again
+    int turnAck;
+
+    // Selective repeat reorder buffer for frames that arrived ahead of rxExpected
+    unsigned char rxBuffer[MAX_SEQ_MODULUS][MAX_PAYLOAD_SIZE];
+    int rxBufferSize[MAX_SEQ_MODULUS], rxReceived[MAX_SEQ_MODULUS], srejSent[MAX_SEQ_MODULUS];
+};
+
+// Opens and configures the serial port of conn. Return "0" on success or "-1" on error.
+int configPort(LinkConnection *conn, LinkLayer connectionParameters) {
+    conn->fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+    conn->alarm.count = 0;
+
+    if (conn->fd < 0) {
         perror(connectionParameters.serialPort);
-        exit(-1);
+        return -1;
     }
 
     struct termios oldtio;
     struct termios newtio;
 
     // Save current port settings
-    if (tcgetattr(fd, &oldtio) == -1) {
+    if (tcgetattr(conn->fd, &oldtio) == -1) {
         perror("tcgetattr");
-        exit(-1);
+        close(conn->fd);
+        return -1;
     }
 
     // Clear struct for new port settings
@@ -51,558 +139,1481 @@ void config(LinkLayer connectionParameters) {
     // by fd but not transmitted, or data received but not read,
     // depending on the value of queue_selector:
     //   TCIFLUSH - flushes data received but not read.
-    tcflush(fd, TCIOFLUSH);
+    tcflush(conn->fd, TCIOFLUSH);
 
     // Set new port settings
-    if (tcsetattr(fd, TCSANOW, &newtio) == -1) {
+    if (tcsetattr(conn->fd, TCSANOW, &newtio) == -1) {
         perror("tcsetattr");
-        exit(-1);
+        close(conn->fd);
+        return -1;
     }
 
     printf("New termios structure set\n");
+
+    return 0;
 }
 
-int sendSupervisionFrame(int fd, unsigned char A, unsigned char C) {
-    unsigned char FRAME[5] = {FLAG, A, C, A ^ C, FLAG};
-    return write(fd, FRAME, 5);
+// Writes the whole buffer to the port, which is non-blocking: when the driver's output
+// queue is full (e.g. a window of long frames) write() only takes part of it.
+// Returns the number of bytes written or -1 on error.
+int writeAll(int fd, const unsigned char *buf, int size) {
+    int written = 0;
+
+    while (written < size) {
+        int bytes = write(fd, buf + written, size - written);
+
+        if (bytes > 0) {
+            written += bytes;
+        } else if (bytes == -1 && (errno == EAGAIN || errno == EINTR)) {
+            waitWritable(fd);
+        } else {
+            return -1;
+        }
+    }
+
+    return written;
+}
+
+// Same as writeAll() for a gather list; iov is advanced past whatever was written.
+// Returns the number of bytes written or -1 on error.
+int writevAll(int fd, struct iovec *iov, int iovcnt) {
+    int written = 0;
+
+    while (iovcnt > 0) {
+        ssize_t bytes = writev(fd, iov, iovcnt);
+
+        if (bytes == -1) {
+            if (errno != EAGAIN && errno != EINTR) return -1;
+            waitWritable(fd);
+            continue;
+        }
+
+        written += bytes;
+
+        // skip the pieces that went out whole, trim the one that went out in part
+        while (iovcnt > 0 && (size_t) bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (unsigned char *) iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+
+    return written;
+}
+
+// Closes the serial port, once: another connection may get the same fd number afterwards
+void closePort(LinkConnection *conn) {
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
 }
 
 ////////////////////////////////////////////////
-// LLOPEN
+// FRAMING
 ////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters) {
-    config(connectionParameters);
-    printf("\n------------------------------LLOPEN------------------------------\n\n");
 
-    nTries = connectionParameters.nRetransmissions;
-    timeout = connectionParameters.timeout;
+// I-frame control byte: N(S) in the seqBits bits below bit 7 (0x00/0x40 in stop-and-wait)
+unsigned char infoControl(LinkConnection *conn, int ns) {
+    return ns << (7 - conn->seqBits);
+}
 
-    if (connectionParameters.role == LlTx) {
-        unsigned char buf[5] = {0}, parcels[5] = {0};
+// RR/REJ control byte: N(R) in the top seqBits bits (0x05/0x85 for RR in stop-and-wait)
+unsigned char supervisionControl(LinkConnection *conn, unsigned char type, int nr) {
+    return type | (nr << (8 - conn->seqBits));
+}
 
-        buf[0] = 0x7E;
-        buf[1] = 0x03;
-        buf[2] = 0x03;
-        buf[3] = 0x00;
-        buf[4] = 0x7E;
+int isInfoFrame(unsigned char C) {
+    return (C & 0x8F) == 0;
+}
 
-        while (alarmCount < nTries) {
-            if (!alarmEnabled) {
-                int bytes = write(fd, buf, sizeof(buf));
-                printf("\nSET message sent, %d bytes written\n", bytes);
-                startAlarm(timeout);
-            }
+int isSupervisionFrame(unsigned char C, unsigned char type) {
+    return (C & 0x1F) == type;
+}
+
+int frameNumber(LinkConnection *conn, unsigned char C) {
+    if (isInfoFrame(C)) return (C >> (7 - conn->seqBits)) & (conn->seqModulus - 1);
+    return C >> (8 - conn->seqBits);
+}
+
+// I-frames and FEC parity frames carry data protected by the FCS, in the agreed framing
+int carriesData(unsigned char C) {
+    return isInfoFrame(C) || C == C_FEC;
+}
+
+int sendSupervisionFrame(int fd, unsigned char A, unsigned char C) {
+    unsigned char FRAME[5] = {FLAG, A, C, A ^ C, FLAG};
+    return writeAll(fd, FRAME, 5);
+}
+
+// Sends a supervision frame on conn and counts it
+int sendSupervision(LinkConnection *conn, unsigned char A, unsigned char C) {
+    if (isSupervisionFrame(C, C_REJ) || isSupervisionFrame(C, C_SREJ)) conn->statistics.rejSent++;
+    conn->statistics.wireSent += 5;
+
+    return sendSupervisionFrame(conn->fd, A, C);
+}
+
+int fcsSize(LinkConnection *conn) {
+    return fcsSizeOf(conn->linkParams.fcsType);
+}
+
+// Fills in the header of an I-frame with sequence number ns
+void setInfoHeader(LinkConnection *conn, TxFrame *frame, int ns) {
+    frame->header[0] = FLAG;
+    frame->header[1] = A_ER;
+    frame->header[2] = infoControl(conn, ns);
+    frame->header[3] = frame->header[1] ^ frame->header[2];
+}
+
+// Stuffs (or COBS encodes) the data of a frame and its FCS into frame, whatever its size
+void encodeFrame(LinkConnection *conn, const struct iovec *iov, int iovcnt, TxFrame *frame) {
+    unsigned char fcsBytes[MAX_FCS_SIZE];
+    Fcs fcs;
+
+    fcsInit(&fcs, conn->linkParams.fcsType);
+    frame->payloadSize = 0;
 
-            int result = read(fd, parcels, 5);
-            if (result != -1 && parcels != 0 && parcels[0] == 0x7E) {
-                //se o UA estiver errado 
-                if (parcels[2] != 0x07 || (parcels[3] != (parcels[1] ^ parcels[2]))) {
-                    printf("\nUA not correct: 0x%02x%02x%02x%02x%02x\n", parcels[0], parcels[1], parcels[2], parcels[3],
-                           parcels[4]);
-                    alarmEnabled = FALSE;
+    if (conn->linkParams.framing == FRAMING_COBS) {
+        CobsEncoder encoder;
+
+        cobsBegin(&encoder, frame->payload);
+        for (int i = 0; i < iovcnt; i++) cobsEncode(&encoder, iov[i].iov_base, iov[i].iov_len, &fcs);
+
+        int fcsLength = fcsFinal(&fcs, fcsBytes);
+        cobsEncode(&encoder, fcsBytes, fcsLength, NULL);
+
+        frame->payloadSize = cobsEnd(&encoder);
+        frame->trailer[0] = FLAG;
+        frame->trailerSize = 1;
+        return;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        frame->payloadSize += stuffBytes(iov[i].iov_base, iov[i].iov_len, frame->payload + frame->payloadSize, &fcs);
+    }
+
+    int fcsLength = fcsFinal(&fcs, fcsBytes);
+    frame->trailerSize = stuffBytes(fcsBytes, fcsLength, frame->trailer, NULL);
+    frame->trailer[frame->trailerSize++] = FLAG;
+}
+
+// Refills the receive ring with as much as the port has, returns the number of bytes read
+int fillRxRing(LinkConnection *conn) {
+    int total = 0;
+
+    while (conn->rxHead - conn->rxTail < RX_RING_SIZE) {
+        unsigned int start = conn->rxHead % RX_RING_SIZE;
+        unsigned int space = RX_RING_SIZE - (conn->rxHead - conn->rxTail);
+
+        if (space > RX_RING_SIZE - start) space = RX_RING_SIZE - start;
+
+        int bytes = read(conn->fd, conn->rxRing + start, space);
+        if (bytes <= 0) break;
+
+        conn->rxHead += bytes;
+        conn->statistics.wireReceived += bytes;
+        total += bytes;
+
+        if (bytes < (int) space) break;
+    }
+
+    return total;
+}
+
+// Runs the bytes in the receive ring through the frame state machine.
+// Returns the frame once a complete frame with a valid BCC1 is read, NULL if there are no
+// more bytes to read for now. The frame is only valid until the next call; bytes after it
+// stay in the ring for the next call.
+Frame *receiveFrame(LinkConnection *conn) {
+    Frame *frame = &conn->rxFrame;
+
+    while (TRUE) {
+        if (conn->rxHead == conn->rxTail && fillRxRing(conn) == 0) return NULL;
+
+        const unsigned char *chunk = conn->rxRing + conn->rxTail % RX_RING_SIZE;
+        int available = conn->rxHead - conn->rxTail, i = 0;
+
+        if (available > RX_RING_SIZE - (int) (conn->rxTail % RX_RING_SIZE)) available = RX_RING_SIZE - conn->rxTail % RX_RING_SIZE;
+
+        while (i < available) {
+            if (conn->rxState == READING_DATA) {
+                // destuff the whole run up to the next flag at once, up to one byte past the
+                // limit: a COBS frame of the longest size may still end on a code byte that
+                // decodes to nothing, so the frame is only too long once that byte is written
+                int room = conn->rxLimit + 1 - frame->dataSize;
+                int count = available - i < room ? available - i : room;
+
+                if (conn->rxCobs) i += cobsDecode(chunk + i, count, frame->data, &frame->dataSize, &conn->rxDecoder);
+                else i += destuffBytes(chunk + i, count, frame->data, &frame->dataSize, &conn->rxEscaped);
+
+                // the FCS follows the bytes just destuffed while they are still in cache,
+                // staying behind by the size of the FCS that ends the frame
+                int settled = frame->dataSize - fcsSize(conn);
+                if (carriesData(frame->C) && settled > frame->fcsChecked) {
+                    fcsUpdate(&frame->fcs, frame->data + frame->fcsChecked, settled - frame->fcsChecked);
+                    frame->fcsChecked = settled;
+                }
+
+                if (i == available) break;
+
+                if (chunk[i] != FLAG) {
+                    // escapes shrink the output, so a short run only means there is still room
+                    if (frame->dataSize > conn->rxLimit) conn->rxState = START; // too long, drop it
                     continue;
-                } else {
-                    printf("\nUA correctly received: 0x%02x%02x%02x%02x%02x\n", parcels[0], parcels[1], parcels[2],
-                           parcels[3], parcels[4]);
-                    alarmEnabled = FALSE;
-                    break;
                 }
+
+                i++;
+                conn->rxState = FLAG_RCV; // the closing flag may also open the next frame
+
+                // escape right before a flag or block cut short, frame is corrupted
+                if (conn->rxCobs ? !cobsComplete(&conn->rxDecoder) : conn->rxEscaped) continue;
+                if (frame->dataSize > conn->rxLimit) continue;
+
+                conn->rxTail += i;
+                return frame;
+            }
+
+            unsigned char byte = chunk[i++];
+
+            switch (conn->rxState) {
+                case START:
+                    if (byte == FLAG) conn->rxState = FLAG_RCV;
+                    break;
+                case FLAG_RCV:
+                    if (byte != FLAG) {
+                        frame->A = byte;
+                        conn->rxState = A_RCV;
+                    }
+                    break;
+                case A_RCV:
+                    if (byte == FLAG) conn->rxState = FLAG_RCV;
+                    else {
+                        frame->C = byte;
+                        conn->rxState = C_RCV;
+                    }
+                    break;
+                case C_RCV:
+                    if (byte == (frame->A ^ frame->C)) {
+                        frame->dataSize = 0;
+                        frame->fcsChecked = 0;
+                        fcsInit(&frame->fcs, conn->linkParams.fcsType);
+                        conn->rxEscaped = FALSE;
+                        conn->rxCobs = carriesData(frame->C) && conn->linkParams.framing == FRAMING_COBS;
+                        cobsDecoderInit(&conn->rxDecoder);
+                        conn->rxState = READING_DATA;
+                    } else if (byte == FLAG) conn->rxState = FLAG_RCV;
+                    else conn->rxState = START;
+                    break;
+                default:
+                    conn->rxState = START;
+                    break;
             }
         }
 
-        if (alarmCount >= nTries) {
-            printf("\nAlarm limit reached, SET message not sent\n");
-            return -1;
+        conn->rxTail += i;
+    }
+}
+
+// Returns the next frame like receiveFrame, but if none is buffered sleeps until the port has
+// data, the alarm fires or deadlineMs passes (-1 for no deadline) before trying again.
+Frame *nextFrame(LinkConnection *conn, long long deadlineMs) {
+    Frame *frame = receiveFrame(conn);
+    if (frame != NULL) return frame;
+
+    waitReadable(conn->fd, &conn->alarm, deadlineMs);
+
+    return receiveFrame(conn);
+}
+
+// Checks the FCS at the end of the data field of an I-frame, against the one computed
+// while it was destuffed
+int checkFCS(LinkConnection *conn, const Frame *frame) {
+    unsigned char fcs[MAX_FCS_SIZE];
+    int payloadSize = frame->dataSize - fcsSize(conn);
+
+    if (payloadSize < 0 || frame->fcsChecked != payloadSize) return FALSE;
+
+    fcsFinal(&frame->fcs, fcs);
+
+    return memcmp(fcs, frame->data + payloadSize, fcsSize(conn)) == 0;
+}
+
+// Sends a SET/UA carrying link parameters, protected by a CRC-16 of their own
+int sendParameterFrame(LinkConnection *conn, unsigned char A, unsigned char C, const unsigned char *params, int size) {
+    unsigned char frame[2 * (BUF_SIZE + 2) + 5], crc[2];
+    uint16_t value = crc16(params, size);
+    int index = 4;
+
+    crc[0] = value & 0xFF;
+    crc[1] = value >> 8;
+
+    frame[0] = FLAG;
+    frame[1] = A;
+    frame[2] = C;
+    frame[3] = A ^ C;
+
+    index += stuffBytes(params, size, frame + index, NULL);
+    index += stuffBytes(crc, 2, frame + index, NULL);
+
+    frame[index++] = FLAG;
+    conn->statistics.wireSent += index;
+
+    return writeAll(conn->fd, frame, index);
+}
+
+// Returns the size of the parameters carried by a SET/UA, 0 if it is a plain one or -1 if they are corrupted
+int readParameters(const Frame *frame) {
+    if (frame->dataSize == 0) return 0;
+    if (frame->dataSize < 3) return -1;
+
+    int size = frame->dataSize - 2;
+    uint16_t value = crc16(frame->data, size);
+
+    if (frame->data[size] != (value & 0xFF) || frame->data[size + 1] != (value >> 8)) return -1;
+
+    return size;
+}
+
+// Settings this end asks for, from the compile time configuration
+LinkParameters localParameters() {
+    LinkParameters params = {ARQ_MODE, WINDOW_SIZE, MAX_PAYLOAD_SIZE, FCS_TYPE, (2 << FCS_TYPE) - 1, FRAMING_MODE,
+                             COMPRESSION, FEC_GROUP, PACKET_FORMAT};
+    return params;
+}
+
+// Settings of a peer that doesn't negotiate: the original stop-and-wait protocol
+LinkParameters legacyParameters() {
+    LinkParameters params = {ARQ_STOP_AND_WAIT, 1, LEGACY_PAYLOAD_SIZE, FCS_XOR, 1 << FCS_XOR, FRAMING_HDLC,
+                             COMPRESSION_NONE, 0, PACKET_FORMAT_V0};
+    return params;
+}
+
+int appendTLV(unsigned char *out, int index, unsigned char type, int length, unsigned int value) {
+    out[index++] = type;
+    out[index++] = length;
+
+    for (int i = length - 1; i >= 0; i--) {
+        out[index++] = value >> (8 * i);
+    }
+
+    return index;
+}
+
+// Writes params as a TLV capability block, returns its size
+int encodeParameters(const LinkParameters *params, unsigned char *out) {
+    int index = 0;
+
+    index = appendTLV(out, index, TLV_MAX_PAYLOAD, 2, params->maxPayloadSize);
+    index = appendTLV(out, index, TLV_WINDOW_SIZE, 1, params->windowSize);
+    index = appendTLV(out, index, TLV_FCS_TYPES, 1, params->fcsTypes);
+    index = appendTLV(out, index, TLV_ARQ_MODE, 1, params->arqMode);
+    index = appendTLV(out, index, TLV_COMPRESSION, 1, params->compression);
+    index = appendTLV(out, index, TLV_FRAMING, 1, params->framing);
+    index = appendTLV(out, index, TLV_FEC_GROUP, 1, params->fecGroup);
+    index = appendTLV(out, index, TLV_PACKET_FORMAT, 1, params->packetFormat);
+
+    return index;
+}
+
+// Reads a capability block. Settings the peer doesn't mention keep their legacy value and
+// unknown TLVs are skipped, so either end can add new ones without breaking the other.
+// Return "0" on success or "-1" if the block is malformed.
+int decodeParameters(const unsigned char *in, int size, LinkParameters *params) {
+    *params = legacyParameters();
+
+    int index = 0;
+
+    while (index + 2 <= size) {
+        unsigned char type = in[index], length = in[index + 1];
+        unsigned int value = 0;
+
+        index += 2;
+        if (index + length > size) return -1;
+
+        for (int i = 0; i < length; i++) {
+            value = (value << 8) | in[index++];
         }
-    } else {
-        unsigned char parcels[5] = {0}; // +1: Save space for the final '\0' char
-
-        LinkLayerState state = START;
-        unsigned char byte;
-
-        switch (connectionParameters.role) {
-            case LlTx: {
-                (void) signal(SIGALRM, alarmHandler);
-                while (connectionParameters.nRetransmissions != 0 && state != STOP_R) {
-
-                    sendSupervisionFrame(fd, A_ER, C_SET);
-                    alarm(connectionParameters.timeout);
-                    alarmEnabled = FALSE;
-
-                    while (alarmEnabled == FALSE && state != STOP_R) {
-                        if (read(fd, &byte, 1) > 0) {
-                            switch (state) {
-                                case START:
-                                    if (byte == FLAG) state = FLAG_RCV;
-                                    break;
-                                case FLAG_RCV:
-                                    if (byte == A_RE) state = A_RCV;
-                                    else if (byte != FLAG) state = START;
-                                    break;
-                                case A_RCV:
-                                    if (byte == C_UA) state = C_RCV;
-                                    else if (byte == FLAG) state = FLAG_RCV;
-                                    else state = START;
-                                    break;
-                                case C_RCV:
-                                    if (byte == (A_RE ^ C_UA)) state = BCC1_OK;
-                                    else if (byte == FLAG) state = FLAG_RCV;
-                                    else state = START;
-                                    break;
-                                case BCC1_OK:
-                                    if (byte == FLAG) state = STOP_R;
-                                    else state = START;
-                                    break;
-                                default:
-                                    break;
-                            }
-                        }
-                    }
-                    connectionParameters.nRetransmissions--;
-                }
-                if (state != STOP_R) return -1;
+
+        switch (type) {
+            case TLV_MAX_PAYLOAD:
+                params->maxPayloadSize = value;
+                break;
+            case TLV_WINDOW_SIZE:
+                params->windowSize = value;
+                break;
+            case TLV_FCS_TYPES:
+                params->fcsTypes = value;
+                break;
+            case TLV_ARQ_MODE:
+                params->arqMode = value;
+                break;
+            case TLV_COMPRESSION:
+                params->compression = value;
+                break;
+            case TLV_FRAMING:
+                params->framing = value;
                 break;
+            case TLV_FEC_GROUP:
+                params->fecGroup = value;
+                break;
+            case TLV_PACKET_FORMAT:
+                params->packetFormat = value;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return index == size ? 0 : -1;
+}
+
+// Finds the handshake data TLV of a UA capability block and keeps it in the connection
+void readHandshakeData(LinkConnection *conn, const unsigned char *in, int size) {
+    int index = 0;
+
+    conn->handshakeSize = 0;
+
+    while (index + 2 <= size) {
+        unsigned char type = in[index], length = in[index + 1];
+
+        if (index + 2 + length > size) return;
+
+        if (type == TLV_HANDSHAKE_DATA && length <= MAX_HANDSHAKE_DATA) {
+            memcpy(conn->handshakeData, in + index + 2, length);
+            conn->handshakeSize = length;
+            return;
+        }
+
+        index += 2 + length;
+    }
+}
+
+// Best settings both ends support
+LinkParameters combineParameters(const LinkParameters *a, const LinkParameters *b) {
+    LinkParameters params;
+
+    // the simpler ARQ and the smaller window/frame win
+    params.arqMode = a->arqMode < b->arqMode ? a->arqMode : b->arqMode;
+    params.windowSize = a->windowSize < b->windowSize ? a->windowSize : b->windowSize;
+    params.maxPayloadSize = a->maxPayloadSize < b->maxPayloadSize ? a->maxPayloadSize : b->maxPayloadSize;
+
+    // the strongest FCS both ends offer; every end can do XOR BCC2
+    params.fcsType = FCS_XOR;
+    for (int type = FCS_CRC16; type <= FCS_CRC32; type++) {
+        if (a->fcsTypes & b->fcsTypes & (1 << type)) params.fcsType = type;
+    }
+    params.fcsTypes = 1 << params.fcsType;
+
+    // framing and compression are used only if both ends chose the same one
+    params.framing = a->framing == b->framing ? a->framing : FRAMING_HDLC;
+    params.compression = a->compression == b->compression ? a->compression : COMPRESSION_NONE;
+
+    if (params.arqMode < ARQ_STOP_AND_WAIT || params.arqMode > ARQ_SELECTIVE_REPEAT) params.arqMode = ARQ_STOP_AND_WAIT;
+    if (params.maxPayloadSize < 1 || params.maxPayloadSize > MAX_PAYLOAD_SIZE) params.maxPayloadSize = MAX_PAYLOAD_SIZE;
+    if (params.framing < FRAMING_HDLC || params.framing > FRAMING_COBS) params.framing = FRAMING_HDLC;
+    if (params.compression < COMPRESSION_NONE || params.compression > COMPRESSION_LZ) params.compression = COMPRESSION_NONE;
+
+    if (params.arqMode == ARQ_STOP_AND_WAIT) params.windowSize = 1;
+    else if (params.arqMode == ARQ_SELECTIVE_REPEAT && params.windowSize > MAX_SEQ_MODULUS / 2) params.windowSize = MAX_SEQ_MODULUS / 2;
+    else if (params.windowSize >= MAX_SEQ_MODULUS) params.windowSize = MAX_SEQ_MODULUS - 1;
+    if (params.windowSize < 1) params.windowSize = 1;
+
+    // FEC if both ends want it, in the smaller group; a group must fit in the window so
+    // its parity goes out even when the first frame of the group is lost
+    params.fecGroup = a->fecGroup < b->fecGroup ? a->fecGroup : b->fecGroup;
+    if (params.arqMode != ARQ_SELECTIVE_REPEAT || params.fecGroup < 0) params.fecGroup = 0;
+    if (params.fecGroup > params.windowSize) params.fecGroup = params.windowSize;
+
+    // the older format of the two, which the newer end still speaks
+    params.packetFormat = a->packetFormat < b->packetFormat ? a->packetFormat : b->packetFormat;
+    if (params.packetFormat < PACKET_FORMAT_V1 || params.packetFormat > PACKET_FORMAT_V2) params.packetFormat = PACKET_FORMAT_V1;
+
+    return params;
+}
+
+void applyParameters(LinkConnection *conn, const LinkParameters *params) {
+    conn->linkParams = *params;
+    conn->rxLimit = params->maxPayloadSize + fcsSize(conn) + (params->fecGroup > 0 ? FEC_HEADER : 0);
+    conn->fecGroup = params->fecGroup;
+    conn->seqBits = params->arqMode == ARQ_STOP_AND_WAIT ? 1 : MAX_SEQ_BITS;
+    conn->seqModulus = 1 << conn->seqBits;
+
+    printf("\nLink parameters: ARQ mode %d, window %d, max payload %d, FCS type %d, framing %d, compression %d, FEC group %d, "
+           "packet format %d\n",
+           conn->linkParams.arqMode, conn->linkParams.windowSize, conn->linkParams.maxPayloadSize, conn->linkParams.fcsType,
+           conn->linkParams.framing, conn->linkParams.compression, conn->linkParams.fecGroup, conn->linkParams.packetFormat);
+}
+
+// Answers a SET, with the agreed settings if the transmitter sent its capabilities
+int sendUA(LinkConnection *conn) {
+    if (!conn->peerNegotiates) return sendSupervision(conn, A_ER, C_UA);
+
+    unsigned char params[BUF_SIZE];
+    int size = encodeParameters(&conn->linkParams, params);
+
+    if (conn->handshakeSize > 0) {
+        params[size++] = TLV_HANDSHAKE_DATA;
+        params[size++] = conn->handshakeSize;
+        memcpy(params + size, conn->handshakeData, conn->handshakeSize);
+        size += conn->handshakeSize;
+    }
+
+    return sendParameterFrame(conn, A_ER, C_UA, params, size);
+}
+
+LinkParameters llparameters_r(LinkConnection *conn) {
+    return conn->linkParams;
+}
+
+// Feeds the retransmission timeout and the round trip time histogram
+void sampleRtt(LinkConnection *conn, long long sampleMs) {
+    int bucket = 0;
+
+    while (bucket < RTT_BUCKETS - 1 && sampleMs >= 1LL << bucket) bucket++;
+
+    rttSample(&conn->rtt, sampleMs);
+    conn->statistics.rttHistogram[bucket]++;
+    conn->statistics.rttTotal += sampleMs;
+}
+
+LinkStatistics llstatistics_r(LinkConnection *conn) {
+    conn->statistics.elapsed = currentTimeMs() - conn->openedAt;
+    return conn->statistics;
+}
+
+int llhandshake_r(LinkConnection *conn, unsigned char *data) {
+    memcpy(data, conn->handshakeData, conn->handshakeSize);
+    return conn->handshakeSize;
+}
+
+////////////////////////////////////////////////
+// LLOPEN
+////////////////////////////////////////////////
+// Handshake of llopen on an allocated connection. Return "1" on success or "-1" on error.
+int openConnection(LinkConnection *conn, LinkLayer connectionParameters, const HandshakeData *handshake) {
+    if (configPort(conn, connectionParameters) == -1) return -1;
+
+    printf("\n------------------------------LLOPEN------------------------------\n\n");
+    printf("Stuffing kernel: %s\n", stuffingKernel());
+
+    conn->role = connectionParameters.role;
+    conn->nTries = connectionParameters.nRetransmissions;
+    conn->timeout = connectionParameters.timeout;
+    conn->baudRate = connectionParameters.baudRate;
+    conn->openedAt = currentTimeMs();
+
+    conn->rxState = START;
+    conn->rxLimit = sizeof(conn->rxFrame.data) - 1; // until the payload size is agreed
+    conn->rxHead = conn->rxTail = 0;
+    rttInit(&conn->rtt, MIN_RTO_MS, conn->timeout * 1000LL);
+    memset(&conn->statistics, 0, sizeof(conn->statistics));
+    conn->peerNegotiates = FALSE;
+    conn->linkParams = legacyParameters();
+    conn->handshakeSize = 0;
+
+    if (connectionParameters.role == LlRx && handshake != NULL && handshake->size > 0) {
+        conn->handshakeSize = handshake->size;
+        if (conn->handshakeSize > MAX_HANDSHAKE_DATA) conn->handshakeSize = MAX_HANDSHAKE_DATA;
+        memcpy(conn->handshakeData, handshake->data, conn->handshakeSize);
+    }
+    conn->seqBits = 1;
+    conn->seqModulus = 2;
+    conn->txBase = conn->txNext = conn->txOutstanding = 0;
+    conn->fecCount = conn->fecLongest = conn->fecSizes = 0;
+    conn->fecEpochFrames = conn->fecEpochRejects = 0;
+    conn->rxExpected = 0;
+    conn->rejSent = FALSE;
+    memset(conn->rxDeliveredSize, 0xFF, sizeof(conn->rxDeliveredSize));
+    memset(conn->rxReceived, 0, sizeof(conn->rxReceived));
+    memset(conn->srejSent, 0, sizeof(conn->srejSent));
+    conn->turnAck = -1;
+
+    Frame *frame;
+    LinkParameters local = localParameters(), peer;
+
+    if (connectionParameters.role == LlTx) {
+        conn->alarm.count = 0;
+        conn->alarm.enabled = FALSE;
+
+        unsigned char params[BUF_SIZE];
+        int paramsSize = encodeParameters(&local, params);
+        long long sentAt = 0;
+
+        while (conn->alarm.count < conn->nTries) {
+            if (!conn->alarm.enabled) {
+                // a receiver that doesn't negotiate drops a SET with an info field, so the last
+                // try is a plain SET it can answer
+                int plain = conn->alarm.count > 0 && conn->alarm.count == conn->nTries - 1;
+                int bytes = plain ? sendSupervision(conn, A_ER, C_SET)
+                                  : sendParameterFrame(conn, A_ER, C_SET, params, paramsSize);
+                printf("\nSET message sent, %d bytes written\n", bytes);
+                armAlarm(&conn->alarm, conn->timeout);
+                sentAt = currentTimeMs();
             }
 
-            case LlRx: {
-                while (state != STOP_R) {
-                    if (read(fd, &byte, 1) > 0) {
-                        switch (state) {
-                            case START:
-                                if (byte == FLAG) state = FLAG_RCV;
-                                break;
-                            case FLAG_RCV:
-                                if (byte == A_ER) state = A_RCV;
-                                else if (byte != FLAG) state = START;
-                                break;
-                            case A_RCV:
-                                if (byte == C_SET) state = C_RCV;
-                                else if (byte == FLAG) state = FLAG_RCV;
-                                else state = START;
-                                break;
-                            case C_RCV:
-                                if (byte == (A_ER ^ C_SET)) state = BCC1_OK;
-                                else if (byte == FLAG) state = FLAG_RCV;
-                                else state = START;
-                                break;
-                            case BCC1_OK:
-                                if (byte == FLAG) state = STOP_R;
-                                else state = START;
-                                break;
-                            default:
-                                break;
-                        }
-                    }
-                }
-                sendSupervisionFrame(fd, A_RE, C_UA);
-                break;
+            if ((frame = nextFrame(conn, -1)) != NULL && frame->C == C_UA) {
+                int size = readParameters(frame);
+                if (size < 0 || decodeParameters(frame->data, size, &peer) == -1) continue;
+
+                stopAlarm(&conn->alarm);
+
+                // the handshake is the first round trip sample, if SET went out only once
+                if (conn->alarm.count == 0) sampleRtt(conn, currentTimeMs() - sentAt);
+
+                readHandshakeData(conn, frame->data, size);
+
+                printf("\nUA correctly received\n");
+
+                // a plain UA, from a receiver that doesn't negotiate or that got the plain SET,
+                // means the legacy settings as they are
+                LinkParameters agreed = size == 0 ? legacyParameters() : combineParameters(&local, &peer);
+                applyParameters(conn, &agreed);
+                return 1;
+            }
+        }
+
+        printf("\nAlarm limit reached, SET message not sent\n");
+        closePort(conn);
+        return -1;
+    } else {
+        int size = -1;
+
+        while (size < 0) {
+            if ((frame = nextFrame(conn, -1)) != NULL && frame->C == C_SET) {
+                size = readParameters(frame);
+                if (size > 0 && decodeParameters(frame->data, size, &peer) == -1) size = -1;
             }
-            default:
-                return -1;
         }
 
-        parcels[2] = 0x07;
-        parcels[3] = parcels[1] ^ parcels[2];
+        printf("\nSET correctly received\n");
 
-        int bytes = write(fd, parcels, sizeof(parcels));
+        conn->peerNegotiates = size > 0;
+
+        LinkParameters agreed = conn->peerNegotiates ? combineParameters(&local, &peer) : legacyParameters();
+        applyParameters(conn, &agreed);
+
+        int bytes = sendUA(conn);
         printf("UA message sent, %d bytes written\n", bytes);
+    }
+
+    return 1;
+}
+
+LinkConnection *llopen_r(LinkLayer connectionParameters, const HandshakeData *handshake) {
+    LinkConnection *conn = malloc(sizeof(LinkConnection));
 
-        return fd;
+    if (conn == NULL) {
+        perror("malloc");
+        return NULL;
     }
 
-    alarmEnabled = FALSE;
+    initAlarm(&conn->alarm);
 
-    /*if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
-    {
-        perror("tcsetattr");
-        exit(-1);
-    }*/
+    if (openConnection(conn, connectionParameters, handshake) == -1) {
+        closeAlarm(&conn->alarm);
+        free(conn);
+        return NULL;
+    }
 
-    //close(fd);
+    return conn;
+}
 
-    return 1;
+////////////////////////////////////////////////
+// FEC
+////////////////////////////////////////////////
+
+// XORs size bytes of data into parity, which is zero past its first *longest bytes
+void xorParity(unsigned char *parity, int *longest, const unsigned char *data, int size) {
+    int common = size < *longest ? size : *longest;
+
+    for (int i = 0; i < common; i++) parity[i] ^= data[i];
+
+    if (size > *longest) {
+        memcpy(parity + common, data + common, size - common);
+        *longest = size;
+    }
+}
+
+// Sends the parity frame of the I-frames added since the last one, if any
+void sendParity(LinkConnection *conn) {
+    if (conn->fecCount == 0) return;
+
+    unsigned char header[FEC_HEADER] = {conn->fecFirst, conn->fecCount, conn->fecSizes >> 8, conn->fecSizes & 0xFF};
+    struct iovec data[2] = {{header, FEC_HEADER}, {conn->fecParity, conn->fecLongest}};
+    TxFrame *frame = &conn->fecFrame;
+
+    encodeFrame(conn, data, 2, frame);
+    frame->header[0] = FLAG;
+    frame->header[1] = A_ER;
+    frame->header[2] = C_FEC;
+    frame->header[3] = frame->header[1] ^ frame->header[2];
+
+    struct iovec iov[3] = {
+            {frame->header, sizeof(frame->header)},
+            {frame->payload, frame->payloadSize},
+            {frame->trailer, frame->trailerSize},
+    };
+    writevAll(conn->fd, iov, 3);
+    conn->statistics.wireSent += sizeof(frame->header) + frame->payloadSize + frame->trailerSize;
+
+    printf("\nParity frame sent for %d frames from NS=%d\n", conn->fecCount, conn->fecFirst);
+    conn->statistics.parityFrames++;
+    conn->fecCount = conn->fecLongest = conn->fecSizes = 0;
+}
+
+// Adds an I-frame sent for the first time to the parity, which goes out once the group is full.
+// Every FEC_EPOCH frames the group size is retuned from the SREJs received, as with FEC the
+// receiver only sends them for losses the parity couldn't cover: if there were any, groups
+// get smaller; if not, larger, up to the window size. Timeouts are no guide, most of them
+// come from a late acknowledgement rather than a loss.
+void addToParity(LinkConnection *conn, const TxFrame *frame, int ns) {
+    unsigned char data[sizeof(frame->payload)];
+    int size = 0;
+
+    // the frame is only kept stuffed
+    if (conn->linkParams.framing == FRAMING_COBS) {
+        CobsDecoder decoder;
+        cobsDecoderInit(&decoder);
+        cobsDecode(frame->payload, frame->payloadSize, data, &size, &decoder);
+    } else {
+        int escaped = FALSE;
+        destuffBytes(frame->payload, frame->payloadSize, data, &size, &escaped);
+    }
+
+    if (conn->fecCount == 0) conn->fecFirst = ns;
+
+    xorParity(conn->fecParity, &conn->fecLongest, data, frame->dataSize);
+    conn->fecSizes ^= frame->dataSize;
+    conn->fecCount++;
+
+    if (conn->fecCount < conn->fecGroup) return;
+
+    sendParity(conn);
+
+    if (conn->statistics.framesSent - conn->fecEpochFrames >= FEC_EPOCH) {
+        long rejects = conn->statistics.rejReceived - conn->fecEpochRejects;
+
+        if (rejects > 0 && conn->fecGroup > 1) conn->fecGroup--;
+        else if (rejects == 0 && conn->fecGroup < conn->linkParams.windowSize) conn->fecGroup++;
+
+        conn->fecEpochFrames = conn->statistics.framesSent;
+        conn->fecEpochRejects = conn->statistics.rejReceived;
+    }
 }
 
 ////////////////////////////////////////////////
 // LLWRITE
 ////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize) {
 
-    //1º criar o BCC para o dataPacket
-    //2º fazer byte stuffing
-    //3º criar a nova infoFrame com o dataPacket (ja stuffed) la dentro
-    //4º enviar a infoFrame e contar o alarme
-    //5º factCheck a frame recebida do llread (ver se tem erros ou assim)
-    //6º llwrite so termina quando recebe mensagem de sucesso ou quando o limite de tentativas é excedido
+// (Re)sends the frame in slot ns and arms its retransmission deadline
+void transmitFrame(LinkConnection *conn, int ns) {
+    long long now = currentTimeMs();
+
+    TxFrame *frame = conn->txFrames[ns];
+    struct iovec iov[3] = {
+            {frame->header, sizeof(frame->header)},
+            {frame->payload, frame->payloadSize},
+            {frame->trailer, frame->trailerSize},
+    };
+
+    writevAll(conn->fd, iov, 3);
+    conn->txAttempts[ns]++;
+    conn->txDeadline[ns] = now + conn->rtt.rto;
+    conn->statistics.wireSent += sizeof(frame->header) + frame->payloadSize + frame->trailerSize;
+
+    if (conn->txAttempts[ns] == 1) {
+        conn->txFirstSent[ns] = now;
+        conn->statistics.framesSent++;
+        conn->statistics.payloadSent += frame->dataSize;
+        conn->statistics.stuffingBytes += frame->payloadSize + frame->trailerSize - 1 - frame->dataSize - fcsSize(conn);
+    } else {
+        conn->statistics.retransmissions++;
+    }
+
+    if (conn->txAttempts[ns] == 1) printf("\nInfoFrame sent NS=%d\n", ns);
+    else printf("\nInfoFrame resent NS=%d\n", ns);
+}
 
-    printf("\n------------------------------LLWRITE------------------------------\n\n");
+// Resends every outstanding frame, starting at txBase
+void retransmitWindow(LinkConnection *conn) {
+    for (int i = 0; i < conn->txOutstanding; i++) {
+        transmitFrame(conn, (conn->txBase + i) % conn->seqModulus);
+    }
+}
+
+// Slides the window up to nr (cumulative acknowledgement), returns the number of frames acknowledged
+int acknowledgeFrames(LinkConnection *conn, int nr) {
+    int count = (nr - conn->txBase + conn->seqModulus) % conn->seqModulus;
 
-    alarmCount = 0;
+    if (count == 0 || count > conn->txOutstanding) return 0;
 
-    unsigned char BCC = 0x00, infoFrame[600] = {0}, parcels[5] = {0};
-    int index = 4, STOP = 0, controlReceiver = (!senderNumber << 7) | 0x05;
+    // Karn's rule: a frame that was retransmitted gives an ambiguous round trip time
+    int newest = (nr - 1 + conn->seqModulus) % conn->seqModulus;
+    if (conn->txAttempts[newest] == 1) sampleRtt(conn, currentTimeMs() - conn->txFirstSent[newest]);
 
-    //BCC working correctly
-    for (int i = 0; i < bufSize; i++) {
-        BCC = (BCC ^ buf[i]);
+    // frames from a pool go back to it
+    for (int i = 0; i < count; i++) {
+        TxFrame *frame = conn->txFrames[(conn->txBase + i) % conn->seqModulus];
+        if (frame->pool != NULL) spscPush(frame->pool, frame);
     }
 
-    infoFrame[0] = 0x7E; //Flag
-    infoFrame[1] = 0x03; //Address
-    infoFrame[2] = (senderNumber << 6); //Control
-    infoFrame[3] = infoFrame[1] ^ infoFrame[2];
+    conn->txBase = nr;
+    conn->txOutstanding -= count;
 
-    for (int i = 0; i < bufSize; i++) {
-        if (buf[i] == 0x7E) {
-            infoFrame[index++] = 0x7D;
-            infoFrame[index++] = 0x5e;
-            continue;
-        } else if (buf[i] == 0x7D) {
-            infoFrame[index++] = 0x7D;
-            infoFrame[index++] = 0x5D;
-            continue;
-        }
+    return count;
+}
 
-        infoFrame[index++] = buf[i];
+// Handles an RR/REJ/SREJ received by the transmitter
+void handleResponse(LinkConnection *conn, const Frame *frame) {
+    int nr = frameNumber(conn, frame->C);
+
+    if (isSupervisionFrame(frame->C, C_RR)) {
+        printf("\nRR correctly received NR=%d\n", nr);
+        acknowledgeFrames(conn, nr);
+    } else if (isSupervisionFrame(frame->C, C_REJ)) {
+        printf("\nREJ received NR=%d\n", nr);
+        conn->statistics.rejReceived++;
+        acknowledgeFrames(conn, nr);
+
+        // go back to the rejected frame and resend everything after it
+        if (conn->txOutstanding > 0 && nr == conn->txBase) retransmitWindow(conn);
+    } else if (isSupervisionFrame(frame->C, C_SREJ)) {
+        printf("\nSREJ received NR=%d\n", nr);
+        conn->statistics.rejReceived++;
+
+        // resend only the rejected frame, if it is still in the window
+        if ((nr - conn->txBase + conn->seqModulus) % conn->seqModulus < conn->txOutstanding) transmitFrame(conn, nr);
     }
+}
 
-    if (BCC == 0x7E) {
-        infoFrame[index++] = 0x7D;
-        infoFrame[index++] = 0x5e;
-    } else if (BCC == 0x7D) {
-        infoFrame[index++] = 0x7D;
-        infoFrame[index++] = 0x5D;
-    } else { infoFrame[index++] = BCC; }
+// Resends the frames whose deadline has passed, backing the timeout off once per call.
+// Return "0" on success or "-1" if a frame was sent nTries times and has been waiting for
+// longer than nTries * timeout (the patience of the original fixed timer).
+int handleTimeouts(LinkConnection *conn) {
+    long long now = currentTimeMs();
+    int backedOff = FALSE;
 
-    infoFrame[index++] = 0x7E;
+    for (int i = 0; i < conn->txOutstanding; i++) {
+        int ns = (conn->txBase + i) % conn->seqModulus;
 
-    while (!STOP) {
-        if (!alarmEnabled) {
-            write(fd, infoFrame, index);
-            printf("\nInfoFrame sent NS=%d\n", senderNumber);
-            startAlarm(timeout);
+        if (now < conn->txDeadline[ns]) continue;
+
+        if (conn->txAttempts[ns] >= conn->nTries && now - conn->txFirstSent[ns] >= conn->nTries * conn->timeout * 1000LL) {
+            printf("\nllwrite error: Exceeded number of tries when sending frame NS=%d\n", ns);
+            return -1;
         }
 
-        int result = read(fd, parcels, 5);
+        conn->statistics.timeouts++;
+
+        if (!backedOff) {
+            rttBackoff(&conn->rtt);
+            backedOff = TRUE;
+        }
+
+        printf("\nTimeout on NS=%d, RTO now %lld ms\n", ns, conn->rtt.rto);
+
+        if (conn->linkParams.arqMode == ARQ_SELECTIVE_REPEAT) {
+            transmitFrame(conn, ns);
+        } else {
+            // go-back-n only times the oldest frame, everything after it goes again
+            retransmitWindow(conn);
+            break;
+        }
+    }
+
+    return 0;
+}
 
-        if (result != -1 && parcels != 0) {
-            if (parcels[2] != (controlReceiver) || (parcels[3] != (parcels[1] ^ parcels[2]))) {
-                printf("\nRR not correct: 0x%02x%02x%02x%02x%02x\n", parcels[0], parcels[1], parcels[2], parcels[3],
-                       parcels[4]);
-                alarmEnabled = FALSE;
+// Earliest retransmission deadline in the window, -1 if nothing is outstanding
+long long nextDeadline(LinkConnection *conn) {
+    long long deadline = -1;
+
+    for (int i = 0; i < conn->txOutstanding; i++) {
+        int ns = (conn->txBase + i) % conn->seqModulus;
+        if (deadline < 0 || conn->txDeadline[ns] < deadline) deadline = conn->txDeadline[ns];
+    }
+
+    return deadline;
+}
+
+// Processes responses until at most maxOutstanding frames are unacknowledged.
+// Return "0" on success or "-1" if the retransmission limit was reached.
+int waitForAcknowledgements(LinkConnection *conn, int maxOutstanding) {
+    Frame *frame;
+
+    while (conn->txOutstanding > maxOutstanding) {
+        if ((frame = nextFrame(conn, nextDeadline(conn))) != NULL) {
+            if (isInfoFrame(frame->C) && conn->turnAck != -1) {
+                // the line turned before the peer got our last RR
+                sendSupervision(conn, A_ER, conn->turnAck);
                 continue;
-            } else {
-                printf("\nRR correctly received: 0x%02x%02x%02x%02x%02x\n", parcels[0], parcels[1], parcels[2],
-                       parcels[3], parcels[4]);
-                alarmEnabled = FALSE;
-                STOP = 1;
             }
-        }
 
-        if (alarmCount >= nTries) {
-            printf("\nllwrite error: Exceeded number of tries when sending frame\n");
-            STOP = 1;
-            close(fd);
+            handleResponse(conn, frame);
+        } else if (handleTimeouts(conn) == -1) {
             return -1;
         }
     }
 
-    if (senderNumber) {
-        senderNumber = 0;
-    } else { senderNumber = 1; }
-
     return 0;
 }
 
-////////////////////////////////////////////////
-// LLREAD
-////////////////////////////////////////////////
-int llread(unsigned char *packet, int *sizeOfPacket) {
-    printf("\n------------------------------LLREAD------------------------------\n\n");
+int llwrite_r(LinkConnection *conn, const unsigned char *buf, int bufSize) {
+    struct iovec iov = {(void *) buf, bufSize};
+    return llwritev_r(conn, &iov, 1);
+}
 
-    unsigned char infoFrame[600] = {0}, supFrame[5] = {0}, BCC2 = 0x00, aux[400] = {0}, STOP = FALSE;
-    int control = (!receiverNumber) << 6, index = 0, sizeInfo = 0;
+int llwritev_r(LinkConnection *conn, const struct iovec *iov, int iovcnt) {
+    // txNext is never in the window, so its slot is free
+    TxFrame *frame = &conn->txSlots[conn->txNext];
 
-    unsigned char buf[1] = {0}; // +1: Save space for the final '\0' char
+    frame->pool = NULL;
 
-    LinkLayerState state = START;
-    unsigned char readByte = TRUE;
+    if (llframe_r(conn, iov, iovcnt, frame) == -1) {
+        printf("\nllwrite error: %d bytes don't fit in one frame\n", frame->dataSize);
+        return -1;
+    }
 
-    // Loop for input
-    while (!STOP) {
-        if (readByte) {
-            int bytes = read(fd, buf, 1); //ler byte a byte
-            if (bytes == -1 || bytes == 0)
-                continue; // se der erro a leitura ou se tiver lido 0 bytes continuo para a próxima iteraçao
+    return llsend_r(conn, frame);
+}
 
-        }
+int llframe_r(LinkConnection *conn, const struct iovec *iov, int iovcnt, TxFrame *frame) {
+    frame->dataSize = 0;
+    for (int i = 0; i < iovcnt; i++) frame->dataSize += iov[i].iov_len;
 
-        switch (state) {
-            case START:
-                if (buf[0] == 0x7E) {
-                    state = FLAG_RCV;
-                    infoFrame[sizeInfo++] = buf[0];
-                }
-                break;
+    if (frame->dataSize > conn->linkParams.maxPayloadSize) return -1;
 
-            case FLAG_RCV:
-                if (buf[0] != 0x7E) {
-                    state = A_RCV;
-                    infoFrame[sizeInfo++] = buf[0];
-                } else {
-                    memset(infoFrame, 0, 600);
-                    state = FLAG_RCV;
-                    sizeInfo = 0;
-                    infoFrame[sizeInfo++] = buf[0];
-                }
-                break;
+    encodeFrame(conn, iov, iovcnt, frame);
 
-            case A_RCV:
-                if (buf[0] != 0x7E) {
-                    infoFrame[sizeInfo++] = buf[0];
-                } else if (buf[0] == 0x7E) {
-                    STOP = TRUE;
-                    infoFrame[sizeInfo++] = buf[0];
-                    readByte = FALSE;
-                }
-                break;
+    return frame->dataSize;
+}
 
-            default:
-                break;
-        }
+int llsend_r(LinkConnection *conn, TxFrame *frame) {
+    printf("\n------------------------------LLWRITE------------------------------\n\n");
+
+    // wait for room in the window
+    if (waitForAcknowledgements(conn, conn->linkParams.windowSize - 1) == -1) {
+        closePort(conn);
+        return -1;
     }
 
-    //1º ler o pipe
-    //2º fazer de-stuff aos bytes lidos
-    //3º verificar que os BCCs estao certos
-    //4º enviar a mensagem de confirmacao de receçao, positiva se correu tudo bem, negativa se BCC ou algo correu mal
+    setInfoHeader(conn, frame, conn->txNext);
+    conn->txFrames[conn->txNext] = frame;
+    conn->txAttempts[conn->txNext] = 0;
+    transmitFrame(conn, conn->txNext);
+
+    if (conn->fecGroup > 0) addToParity(conn, frame, conn->txNext);
+
+    conn->txNext = (conn->txNext + 1) % conn->seqModulus;
+    conn->txOutstanding++;
+
+    return frame->dataSize;
+}
+
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
 
-    supFrame[0] = 0x7E;
-    supFrame[1] = 0x03;
+// Hands a good I-frame payload over in packet and moves rxExpected forward
+int deliverPacket(LinkConnection *conn, const unsigned char *data, int size, const unsigned char **packet) {
+    *packet = data;
 
-    supFrame[4] = 0x7E;
+    conn->statistics.framesReceived++;
+    conn->statistics.payloadReceived += size;
 
-    if ((infoFrame[1] ^ infoFrame[2]) != infoFrame[3] || infoFrame[2] != control) {
-        printf("\nInfoFrame not received correctly. Protocol error. Sending REJ.\n");
-        supFrame[2] = (receiverNumber << 7) | 0x01;
-        supFrame[3] = supFrame[1] ^ supFrame[2];
-        write(fd, supFrame, 5);
+    conn->rxExpected = (conn->rxExpected + 1) % conn->seqModulus;
+    conn->rejSent = FALSE;
 
-        printf("\n-----REJ-----\n");
-        printf("\nSize of REJ: %d\nREJ: 0x", 5);
+    return size;
+}
 
-        for (int i = 0; i < 5; i++) {
-            printf("%02X ", supFrame[i]);
+// Go-back-n / stop-and-wait reception. Returns the packet size, or 0 if the frame was not delivered.
+int receiveInOrder(LinkConnection *conn, const Frame *frame, const unsigned char **packet) {
+    int ns = frameNumber(conn, frame->C);
+
+    if (ns == conn->rxExpected) {
+        if (!checkFCS(conn, frame)) {
+            printf("\nInfoFrame not received correctly. Error in data packet. Sending REJ.\n");
+            conn->statistics.fcsErrors++;
+            sendSupervision(conn, A_ER, supervisionControl(conn, C_REJ, conn->rxExpected));
+            conn->rejSent = TRUE;
+            return 0;
         }
 
-        printf("\n\n");
+        conn->rxDeliveredSize[ns] = frame->dataSize;
+        conn->rxDeliveredFcs[ns] = frame->fcs.value;
 
-        return -1;
+        int size = deliverPacket(conn, frame->data, frame->dataSize - fcsSize(conn), packet);
+
+        printf("\nInfoFrame received correctly. Sending RR.\n");
+        sendSupervision(conn, A_ER, supervisionControl(conn, C_RR, conn->rxExpected));
+
+        return size;
     }
 
-    for (int i = 0; i < sizeInfo; i++) {
-        if (infoFrame[i] == 0x7D && infoFrame[i + 1] == 0x5e) {
-            packet[index++] = 0x7E;
-            i++;
-        } else if (infoFrame[i] == 0x7D && infoFrame[i + 1] == 0x5d) {
-            packet[index++] = 0x7D;
-            i++;
-        } else { packet[index++] = infoFrame[i]; }
+    // With a window of the whole modulus but one, a frame after a lost one and a frame already
+    // delivered (our RR got lost) can carry the same number: only a frame identical to the one
+    // last delivered under it is a repeat. Anything else gets one REJ for rxExpected per gap;
+    // after it, RRs keep telling the transmitter where we are in case the REJ got lost.
+    if (conn->rxDeliveredSize[ns] == frame->dataSize && checkFCS(conn, frame) &&
+        conn->rxDeliveredFcs[ns] == frame->fcs.value) {
+        printf("\nInfoFrame received correctly. Repeated Frame. Sending RR.\n");
+        conn->statistics.duplicates++;
+        sendSupervision(conn, A_ER, supervisionControl(conn, C_RR, conn->rxExpected));
+    } else if (!conn->rejSent) {
+        printf("\nInfoFrame out of sequence NS=%d. Sending REJ.\n", ns);
+        sendSupervision(conn, A_ER, supervisionControl(conn, C_REJ, conn->rxExpected));
+        conn->rejSent = TRUE;
+    } else {
+        printf("\nInfoFrame out of sequence NS=%d. Sending RR.\n", ns);
+        sendSupervision(conn, A_ER, supervisionControl(conn, C_RR, conn->rxExpected));
     }
 
-    int size = 0;
+    return 0;
+}
 
-    if (packet[4] == 0x01) {
-        size = 256 * packet[6] + packet[7] + 4 + 6; //+4 para contar com os bytes de controlo, numero de seq e tamanho
-        for (int i = 4; i < size - 2; i++) {
-            BCC2 = BCC2 ^ packet[i];
+// Asks once for every frame missing among the first missing ones from rxExpected,
+// acknowledges everything up to the first hole and hands over the frame due next if it is
+// here: from due if it wasn't buffered, else from rxBuffer.
+// Returns the packet size, or 0 if nothing can be delivered yet.
+int advanceSelective(LinkConnection *conn, int missing, const unsigned char *due, const unsigned char **packet) {
+    for (int i = 0; i < missing; i++) {
+        int ns = (conn->rxExpected + i) % conn->seqModulus;
+
+        if (!conn->rxReceived[ns] && !conn->srejSent[ns]) {
+            printf("\nInfoFrame NR=%d missing. Sending SREJ.\n", ns);
+            sendSupervision(conn, A_ER, supervisionControl(conn, C_SREJ, ns));
+            conn->srejSent[ns] = TRUE;
         }
-    } else {
-        size += packet[6] + 3 +
-                4; //+3 para contar com os bytes de C, T1 e L1 // +4 para contar com os bytes FLAG, A, C, BCC
-        size += packet[size + 1] + 2 + 2; //+2 para contar com T2 e L2 //+2 para contar com BCC2 e FLAG
+    }
+
+    // everything up to the first hole is acknowledged, even if still buffered
+    int acked = conn->rxExpected, count = 0;
+    while (count < conn->linkParams.windowSize && conn->rxReceived[acked]) {
+        acked = (acked + 1) % conn->seqModulus;
+        count++;
+    }
+
+    if (count > 0) {
+        printf("\nInfoFrame received correctly. Sending RR.\n");
+        sendSupervision(conn, A_ER, supervisionControl(conn, C_RR, acked));
+    }
+
+    if (!conn->rxReceived[conn->rxExpected]) return 0;
+
+    conn->rxReceived[conn->rxExpected] = FALSE;
+    const unsigned char *data = due != NULL ? due : conn->rxBuffer[conn->rxExpected];
+    return deliverPacket(conn, data, conn->rxBufferSize[conn->rxExpected], packet);
+}
+
+// Selective repeat reception: good frames inside the window are buffered and only
+// the missing ones are asked for again with SREJ.
+// With FEC every frame is kept, for the parity frame of its group, and missing frames are
+// only asked for once that parity frame has come (see receiveParity).
+// Returns the packet size, or 0 if nothing can be delivered yet.
+int receiveSelective(LinkConnection *conn, const Frame *frame, const unsigned char **packet) {
+    int ns = frameNumber(conn, frame->C);
+    int offset = (ns - conn->rxExpected + conn->seqModulus) % conn->seqModulus;
+    int fec = conn->linkParams.fecGroup > 0;
+
+    if (offset >= conn->linkParams.windowSize) {
+        // already delivered, our RR got lost
+        printf("\nInfoFrame received correctly. Repeated Frame. Sending RR.\n");
+        conn->statistics.duplicates++;
+        sendSupervision(conn, A_ER, supervisionControl(conn, C_RR, conn->rxExpected));
+        return 0;
+    }
+
+    if (!checkFCS(conn, frame)) {
+        conn->statistics.fcsErrors++;
 
-        for (int i = 4; i < size - 2; i++) {
-            BCC2 = BCC2 ^ packet[i];
+        if (!conn->rxReceived[ns] && !fec) {
+            printf("\nInfoFrame not received correctly. Error in data packet. Sending SREJ NR=%d.\n", ns);
+            sendSupervision(conn, A_ER, supervisionControl(conn, C_SREJ, ns));
+            conn->srejSent[ns] = TRUE;
         }
+        return 0;
     }
 
-    if (packet[size - 2] == BCC2) {
-        if (packet[4] == 0x01) {
-            if (infoFrame[5] == lastFrameNumber) {
-                printf("\nInfoFrame received correctly. Repeated Frame. Sending RR.\n");
-                supFrame[2] = (receiverNumber << 7) | 0x05;
-                supFrame[3] = supFrame[1] ^ supFrame[2];
-                write(fd, supFrame, 5);
-                return -1;
-            } else {
-                lastFrameNumber = infoFrame[5];
+    if (!conn->rxReceived[ns]) {
+        // the frame due next is handed over from rxFrame, only early ones are copied aside
+        conn->rxBufferSize[ns] = frame->dataSize - fcsSize(conn);
+        if (offset > 0 || fec) memcpy(conn->rxBuffer[ns], frame->data, conn->rxBufferSize[ns]);
+        conn->rxReceived[ns] = TRUE;
+        conn->srejSent[ns] = FALSE;
+    }
+
+    return advanceSelective(conn, fec ? 0 : offset, offset == 0 && !fec ? frame->data : NULL, packet);
+}
+
+// Rebuilds the one frame of a parity group that is missing, if all the others are here:
+// those from rxExpected on are buffered, the ones before it were delivered and are still in
+// rxBuffer. Whatever is still missing up to the end of the group is then asked for.
+// Returns the packet size, or 0 if nothing can be delivered yet.
+int receiveParity(LinkConnection *conn, const Frame *frame, const unsigned char **packet) {
+    unsigned char rebuilt[MAX_PAYLOAD_SIZE];
+    int longest = frame->dataSize - fcsSize(conn) - FEC_HEADER;
+
+    if (!checkFCS(conn, frame) || longest < 0 || longest > conn->linkParams.maxPayloadSize) return 0;
+
+    int first = frame->data[0], count = frame->data[1], sizes = frame->data[2] << 8 | frame->data[3];
+    int missing = -1, lost = 0, end = 0;
+
+    if (first >= conn->seqModulus || count < 1 || count > conn->linkParams.windowSize) return 0;
+
+    memcpy(rebuilt, frame->data + FEC_HEADER, longest);
+
+    for (int i = 0; i < count; i++) {
+        int ns = (first + i) % conn->seqModulus;
+        int offset = (ns - conn->rxExpected + conn->seqModulus) % conn->seqModulus;
+
+        // the window is at most half the sequence numbers, so this tells the two apart
+        if (offset < conn->seqModulus / 2) {
+            end = offset + 1;
+
+            if (!conn->rxReceived[ns]) {
+                missing = ns;
+                lost++;
+                continue;
             }
         }
-        printf("\nInfoFrame received correctly. Sending RR.\n");
-        supFrame[2] = (receiverNumber << 7) | 0x05;
-        supFrame[3] = supFrame[1] ^ supFrame[2];
-        write(fd, supFrame, 5);
-    } else {
-        printf("\nInfoFrame not received correctly. Error in data packet. Sending REJ.\n");
-        supFrame[2] = (receiverNumber << 7) | 0x01;
-        supFrame[3] = supFrame[1] ^ supFrame[2];
-        write(fd, supFrame, 5);
 
-        return -1;
+        xorParity(rebuilt, &longest, conn->rxBuffer[ns], conn->rxBufferSize[ns]);
+        sizes ^= conn->rxBufferSize[ns];
     }
 
-    (*sizeOfPacket) = size;
+    if (lost == 1 && sizes <= longest) {
+        printf("\nInfoFrame NS=%d rebuilt from the parity frame\n", missing);
+        memcpy(conn->rxBuffer[missing], rebuilt, sizes);
+        conn->rxBufferSize[missing] = sizes;
+        conn->rxReceived[missing] = TRUE;
+        conn->srejSent[missing] = FALSE;
+        conn->statistics.framesRebuilt++;
+    }
 
-    index = 0;
+    return advanceSelective(conn, end, NULL, packet);
+}
 
-    for (int i = 4; i < (*sizeOfPacket) - 2; i++) {
-        aux[index++] = packet[i];
+int llreadview_r(LinkConnection *conn, const unsigned char **packet) {
+    printf("\n------------------------------LLREAD------------------------------\n\n");
+
+    Frame *frame;
+
+    // frames that arrived ahead of time are handed over first, in order
+    if (conn->linkParams.arqMode == ARQ_SELECTIVE_REPEAT && conn->rxReceived[conn->rxExpected]) {
+        conn->rxReceived[conn->rxExpected] = FALSE;
+        return deliverPacket(conn, conn->rxBuffer[conn->rxExpected], conn->rxBufferSize[conn->rxExpected], packet);
     }
 
-    (*sizeOfPacket) = size - 6;
+    while (TRUE) {
+        if ((frame = nextFrame(conn, -1)) == NULL) continue;
 
-    memset(packet, 0, sizeof(packet));
+        if (frame->C == C_SET) {
+            // our UA got lost, the transmitter is still trying to connect
+            sendUA(conn);
+            continue;
+        }
 
-    for (int i = 0; i < (*sizeOfPacket); i++) {
-        packet[i] = aux[i];
+        if (frame->C == C_FEC) {
+            int size = conn->linkParams.fecGroup > 0 ? receiveParity(conn, frame, packet) : 0;
+            if (size > 0) return size;
+            continue;
+        }
+
+        if (!isInfoFrame(frame->C)) continue;
+
+        int size = conn->linkParams.arqMode == ARQ_SELECTIVE_REPEAT ? receiveSelective(conn, frame, packet)
+                                                     : receiveInOrder(conn, frame, packet);
+
+        if (size > 0) return size;
     }
+}
 
-    if (receiverNumber) {
-        receiverNumber = 0;
-    } else { receiverNumber = 1; }
+int llread_r(LinkConnection *conn, unsigned char *packet, int *sizeOfPacket) {
+    const unsigned char *view;
 
-    return 1;
+    (*sizeOfPacket) = llreadview_r(conn, &view);
+    memcpy(packet, view, *sizeOfPacket);
+
+    return *sizeOfPacket;
 }
 
 ////////////////////////////////////////////////
-// LLCLOSE
+// STATISTICS
 ////////////////////////////////////////////////
-int llclose(int showStatistics, LinkLayer connectionParameters, float runTime) {
-    alarmCount = 0;
-
-    printf("\n------------------------------LLCLOSE------------------------------\n\n");
 
-    if (connectionParameters.role == LlRx) {
+void llprintstatistics(const LinkStatistics *statistics, LinkParameters parameters, int baudRate) {
+    long samples = 0, payload = statistics->payloadSent + statistics->payloadReceived;
+    long frames = statistics->framesSent + statistics->retransmissions;
+
+    for (int i = 0; i < RTT_BUCKETS; i++) samples += statistics->rttHistogram[i];
+
+    double seconds = statistics->elapsed / 1000.0;
+    double rtt = samples > 0 ? (double) statistics->rttTotal / samples : 0;
+    double stuffing = statistics->payloadSent > 0 ? (double) statistics->stuffingBytes / statistics->payloadSent : 0;
+    double efficiency = seconds > 0 && baudRate > 0 ? payload * 8 / (seconds * baudRate) : 0;
+
+    // The most the ARQ mode allows: a window of frames per round trip, each taking its time
+    // on the line (the 1 / (1 + 2a) of stop-and-wait, W / (1 + 2a) with a window). Only a
+    // transmitter times round trips.
+    int window = parameters.arqMode == ARQ_STOP_AND_WAIT ? 1 : parameters.windowSize;
+    double frameTime = frames > 0 && baudRate > 0 ? statistics->wireSent * 8000.0 / frames / baudRate : 0;
+    double limit = rtt > 0 && frameTime > 0 ? window * frameTime / rtt : -1;
+
+    if (limit > 1) limit = 1;
+
+    printf("\n------------------------------STATISTICS------------------------------\n\n");
+    printf("Run time: %.3f s\n", seconds);
+    printf("I-frames sent: %ld (%ld bytes of packets), %ld resent, %ld timeouts, %ld REJ/SREJ received\n",
+           statistics->framesSent, statistics->payloadSent, statistics->retransmissions, statistics->timeouts,
+           statistics->rejReceived);
+    printf("I-frames received: %ld (%ld bytes of packets), %ld duplicates, %ld with a bad FCS, %ld REJ/SREJ sent\n",
+           statistics->framesReceived, statistics->payloadReceived, statistics->duplicates, statistics->fcsErrors,
+           statistics->rejSent);
+    printf("FEC: %ld parity frames sent, %ld I-frames rebuilt\n", statistics->parityFrames, statistics->framesRebuilt);
+    printf("On the line: %ld bytes sent, %ld received; stuffing added %ld bytes (%.1f%% of the packets sent)\n",
+           statistics->wireSent, statistics->wireReceived, statistics->stuffingBytes, stuffing * 100);
+    printf("Round trip times: %ld samples, mean %.1f ms\n", samples, rtt);
+
+    for (int i = 0; i < RTT_BUCKETS; i++) {
+        if (statistics->rttHistogram[i] == 0) continue;
+
+        if (i == 0) printf("  under 1 ms: %ld\n", statistics->rttHistogram[i]);
+        else if (i == RTT_BUCKETS - 1) printf("  %d ms and over: %ld\n", 1 << (i - 1), statistics->rttHistogram[i]);
+        else printf("  %d-%d ms: %ld\n", 1 << (i - 1), 1 << i, statistics->rttHistogram[i]);
+    }
 
-        unsigned char buf[6] = {0}, parcels[6] = {0};
-        unsigned char STOP = 0, UA = 0;
+    printf("Efficiency: %.1f%% of %d bit/s", efficiency * 100, baudRate);
+    if (limit >= 0) {
+        printf(", %s limit %.1f%% (window %d, frames of %.1f ms, round trip %.1f ms)",
+               parameters.arqMode == ARQ_STOP_AND_WAIT ? "stop-and-wait" : "window", limit * 100, window, frameTime, rtt);
+    }
+    printf("\n");
+
+    printf("{\"runTime\":%.3f,\"framesSent\":%ld,\"retransmissions\":%ld,\"timeouts\":%ld,\"rejReceived\":%ld,"
+           "\"framesReceived\":%ld,\"duplicates\":%ld,\"fcsErrors\":%ld,\"rejSent\":%ld,\"parityFrames\":%ld,"
+           "\"framesRebuilt\":%ld,\"payloadSent\":%ld,\"payloadReceived\":%ld,\"wireSent\":%ld,\"wireReceived\":%ld,"
+           "\"stuffingBytes\":%ld,\"rttMean\":%.1f,\"rttHistogram\":[",
+           seconds, statistics->framesSent, statistics->retransmissions, statistics->timeouts, statistics->rejReceived,
+           statistics->framesReceived, statistics->duplicates, statistics->fcsErrors, statistics->rejSent,
+           statistics->parityFrames, statistics->framesRebuilt, statistics->payloadSent, statistics->payloadReceived,
+           statistics->wireSent, statistics->wireReceived, statistics->stuffingBytes, rtt);
+
+    for (int i = 0; i < RTT_BUCKETS; i++) printf(i > 0 ? ",%ld" : "%ld", statistics->rttHistogram[i]);
+
+    printf("],\"baudRate\":%d,\"arqMode\":%d,\"windowSize\":%d,\"efficiency\":%.4f,", baudRate, parameters.arqMode,
+           window, efficiency);
+    if (limit >= 0) printf("\"limit\":%.4f}\n", limit);
+    else printf("\"limit\":null}\n");
+}
 
-        buf[0] = 0x7E;
-        buf[1] = 0x03;
-        buf[2] = 0x0B;
-        buf[3] = buf[1] ^ buf[2];
-        buf[4] = 0x7E;
-        buf[5] = '\0';
+////////////////////////////////////////////////
+// LLCLOSE
+////////////////////////////////////////////////
+// Disconnection of llclose; the connection is freed by the caller.
+// Return "1" on success or "-1" on error.
+int closeConnection(LinkConnection *conn, int showStatistics, float runTime) {
+    printf("\n------------------------------LLCLOSE------------------------------\n\n");
 
-        while (!STOP) {
-            int result = read(fd, buf, 5);
+    Frame *frame;
 
-            parcels[5] = '\0';
+    if (conn->role == LlTx) {
+        // every I-frame still in the window has to be acknowledged first
+        sendParity(conn);
+        if (waitForAcknowledgements(conn, 0) == -1) {
+            closePort(conn);
+            return -1;
+        }
 
-            if (result == -1) {
-                continue;
-            } else if (strcasecmp(buf, parcels) == 0) {
-                printf("\nDISC message received. Responding now.\n");
+        conn->alarm.count = 0;
+        conn->alarm.enabled = FALSE;
 
-                buf[1] = 0x01;
-                buf[3] = buf[1] ^ buf[2];
+        while (TRUE) {
+            if (conn->alarm.count >= conn->nTries) {
+                printf("\nAlarm limit reached, DISC message not sent\n");
+                closePort(conn);
+                return -1;
+            }
 
-                while (alarmCount < nTries) {
-                    if (!alarmEnabled) {
-                        printf("\nDISC message sent, %d bytes written\n", 5);
-                        write(fd, buf, 5);
-                        startAlarm(timeout);
-                    }
+            if (!conn->alarm.enabled) {
+                int bytes = sendSupervision(conn, A_ER, C_DISC);
+                printf("\nDISC message sent, %d bytes written\n", bytes);
+                armAlarm(&conn->alarm, conn->timeout);
+            }
 
-                    int result = read(fd, buf, 5);
-                    if (result != -1 && buf != 0 && buf[0] == 0x7E) {
-                        //se o UA estiver errado
-                        if (parcels[2] != 0x07 || (parcels[3] != (parcels[1] ^ parcels[2]))) {
-                            printf("\nUA not correct: 0x%02x%02x%02x%02x%02x\n", parcels[0], parcels[1], parcels[2],
-                                   parcels[3], parcels[4]);
-                            alarmEnabled = FALSE;
-                            continue;
-                        } else {
-                            printf("\nUA correctly received: 0x%02x%02x%02x%02x%02x\n", parcels[0], parcels[1],
-                                   parcels[2], parcels[3], parcels[4]);
-                            alarmEnabled = FALSE;
-                            close(fd);
-                            break;
-                        }
-                    }
-                }
+            if ((frame = nextFrame(conn, -1)) != NULL && frame->C == C_DISC) {
+                stopAlarm(&conn->alarm);
+                printf("\nDISC correctly received\n");
 
-                if (alarmCount >= nTries) {
-                    printf("\nAlarm limit reached, DISC message not sent\n");
-                    return -1;
-                }
-                STOP = TRUE;
+                int bytes = sendSupervision(conn, A_RE, C_UA);
+                printf("\nUA message sent, %d bytes written.\n\nI'm shutting off now, bye bye!\n", bytes);
+                break;
             }
         }
     } else {
-        alarmCount = 0;
+        while (TRUE) {
+            if ((frame = nextFrame(conn, -1)) == NULL) continue;
 
-        unsigned char buf[6] = {0}, parcels[6] = {0};
+            if (frame->C == C_DISC) break;
 
-        buf[0] = 0x7E;
-        buf[1] = 0x03;
-        buf[2] = 0x0B;
-        buf[3] = buf[1] ^ buf[2];
-        buf[4] = 0x7E;
-        buf[5] = '\0';
+            if (isInfoFrame(frame->C)) {
+                // the transmitter missed our last RR
+                sendSupervision(conn, A_ER, supervisionControl(conn, C_RR, conn->rxExpected));
+            }
+        }
 
-        while (alarmCount < nTries) {
-            if (!alarmEnabled) {
-                int bytes = write(fd, buf, 5);
-                printf("\nDISC message sent, %d bytes written\n", bytes);
-                startAlarm(timeout);
+        printf("\nDISC message received. Responding now.\n");
+
+        conn->alarm.count = 0;
+        conn->alarm.enabled = FALSE;
+
+        while (TRUE) {
+            if (conn->alarm.count >= conn->nTries) {
+                printf("\nAlarm limit reached, DISC message not sent\n");
+                closePort(conn);
+                return -1;
             }
 
-            int result = read(fd, buf, 5);
+            if (!conn->alarm.enabled) {
+                printf("\nDISC message sent, %d bytes written\n", sendSupervision(conn, A_RE, C_DISC));
+                armAlarm(&conn->alarm, conn->timeout);
+            }
 
-            buf[1] = 0x01;
-            buf[3] = buf[1] ^ buf[2];
-            parcels[5] = '\0';
+            if ((frame = nextFrame(conn, -1)) != NULL && frame->C == C_UA) {
+                stopAlarm(&conn->alarm);
+                printf("\nUA correctly received\n");
+                break;
+            }
+        }
+    }
 
-            if (result != -1 && buf != 0 && buf[0] == 0x7E) {
-                //se o DISC estiver errado 
-                if (strcasecmp(buf, parcels) != 0) {
-                    printf("\nDISC not correct: 0x%02x%02x%02x%02x%02x\n", parcels[0], parcels[1], parcels[2],
-                           parcels[3], parcels[4]);
-                    alarmEnabled = FALSE;
-                    continue;
-                } else {
-                    printf("\nDISC correctly received: 0x%02x%02x%02x%02x%02x\n", parcels[0], parcels[1], parcels[2],
-                           parcels[3], parcels[4]);
-                    alarmEnabled = FALSE;
+    closePort(conn);
 
-                    buf[1] = 0x01;
-                    buf[2] = 0x07;
-                    buf[3] = buf[1] ^ buf[2];
+    if (showStatistics) {
+        LinkStatistics statistics = llstatistics_r(conn);
 
-                    int bytes = write(fd, buf, 5);
+        llprintstatistics(&statistics, conn->linkParams, conn->baudRate);
+        printf("Processor time: %.3f s\n", runTime);
+    }
 
-                    close(fd);
+    return 1;
+}
 
-                    printf("\nUA message sent, %d bytes written.\n\nI'm shutting off now, bye bye!\n", bytes);
-                    return 1;
-                }
-            }
-        }
+int llflush_r(LinkConnection *conn) {
+    sendParity(conn);
+    return waitForAcknowledgements(conn, 0);
+}
 
-        if (alarmCount >= nTries) {
-            printf("\nAlarm limit reached, DISC message not sent\n");
-            close(fd);
+int llturn_r(LinkConnection *conn) {
+    if (conn->role == LlTx) {
+        if (llflush_r(conn) == -1) {
+            closePort(conn);
             return -1;
         }
-    }
 
-    if (showStatistics) {
-        printf("\n------------------------------STATISTICS------------------------------\n\n");
-        printf("\nNumber of packets sent: %d\nSize of data packets in information frame: %d\nTotal run time: %f\nAverage time per packet: %f\n",
-               lastFrameNumber, 200, runTime, runTime / 200.0);
+        conn->role = LlRx;
+        conn->turnAck = -1;
+    } else {
+        conn->role = LlTx;
+        conn->turnAck = supervisionControl(conn, C_RR, conn->rxExpected);
     }
 
-    return 1;
+    printf("\nLine turned, now the %s\n", conn->role == LlTx ? "transmitter" : "receiver");
+
+    conn->txBase = conn->txNext = conn->txOutstanding = 0;
+    conn->fecCount = conn->fecLongest = conn->fecSizes = 0;
+    conn->rxExpected = 0;
+    conn->rejSent = FALSE;
+    memset(conn->rxDeliveredSize, 0xFF, sizeof(conn->rxDeliveredSize));
+    memset(conn->rxReceived, 0, sizeof(conn->rxReceived));
+    memset(conn->srejSent, 0, sizeof(conn->srejSent));
+
+    return 0;
+}
+
+void llabort_r(LinkConnection *conn) {
+    closePort(conn);
+    closeAlarm(&conn->alarm);
+    free(conn);
+}
+
+int llclose_r(LinkConnection *conn, int showStatistics, float runTime) {
+    int result = closeConnection(conn, showStatistics, runTime);
+
+    closeAlarm(&conn->alarm);
+    free(conn);
+
+    return result;
+}
+
+////////////////////////////////////////////////
+// SINGLE CONNECTION API
+////////////////////////////////////////////////
+
+// The original entry points drive one connection, kept here
+LinkConnection *connection = NULL;
+
+int llopen(LinkLayer connectionParameters) {
+    return llopenhandshake(connectionParameters, NULL);
+}
+
+int llopenhandshake(LinkLayer connectionParameters, const HandshakeData *handshake) {
+    connection = llopen_r(connectionParameters, handshake);
+    return connection != NULL ? 1 : -1;
+}
+
+LinkParameters llparameters() {
+    return llparameters_r(connection);
+}
+
+LinkStatistics llstatistics() {
+    return llstatistics_r(connection);
+}
+
+int llhandshake(unsigned char *data) {
+    return llhandshake_r(connection, data);
+}
+
+int llwrite(const unsigned char *buf, int bufSize) {
+    return llwrite_r(connection, buf, bufSize);
+}
+
+int llwritev(const struct iovec *iov, int iovcnt) {
+    return llwritev_r(connection, iov, iovcnt);
+}
+
+int llframe(const struct iovec *iov, int iovcnt, TxFrame *frame) {
+    return llframe_r(connection, iov, iovcnt, frame);
+}
+
+int llsend(TxFrame *frame) {
+    return llsend_r(connection, frame);
+}
+
+int llflush() {
+    return llflush_r(connection);
+}
+
+int llturn() {
+    return llturn_r(connection);
+}
+
+int llread(unsigned char *packet, int *sizeOfPacket) {
+    return llread_r(connection, packet, sizeOfPacket);
+}
+
+int llreadview(const unsigned char **packet) {
+    return llreadview_r(connection, packet);
+}
+
+int llclose(int showStatistics, LinkLayer connectionParameters, float runTime) {
+    int result = llclose_r(connection, showStatistics, runTime);
+
+    connection = NULL;
+
+    return result;
 }
@@ -0,0 +1,149 @@
+// LZ77 block compression
+
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5 // a block always ends with this many literals
+#define MATCH_LIMIT 12  // and no match starts this close to its end
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline int hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes the extra bytes of a length of 15 or more, returns the new index
+static inline int putLength(unsigned char *out, int index, int length) {
+    while (length >= 255) {
+        out[index++] = 255;
+        length -= 255;
+    }
+    out[index++] = length;
+
+    return index;
+}
+
+// Reads the extra bytes of a length, -1 if the input ends first
+static inline int getLength(const unsigned char *in, int inSize, int *index, int length) {
+    unsigned char byte;
+
+    do {
+        if (*index >= inSize) return -1;
+        byte = in[(*index)++];
+        length += byte;
+    } while (byte == 255);
+
+    return length;
+}
+
+// Writes a sequence: literals from in, then a match of length bytes at offset (none if length is 0).
+// Returns the new index, or -1 if it doesn't fit in capacity.
+static int putSequence(unsigned char *out, int index, int capacity, const unsigned char *literals, int literalCount,
+                       int offset, int length) {
+    if (index + 1 + literalCount / 255 + 1 + literalCount + 2 + length / 255 + 1 > capacity) return -1;
+
+    int matchCode = length > 0 ? length - MIN_MATCH : 0;
+    unsigned char *token = out + index++;
+
+    *token = (literalCount >= 15 ? 15 : literalCount) << 4 | (matchCode >= 15 ? 15 : matchCode);
+
+    if (literalCount >= 15) index = putLength(out, index, literalCount - 15);
+
+    memcpy(out + index, literals, literalCount);
+    index += literalCount;
+
+    if (length == 0) return index;
+
+    out[index++] = offset & 0xFF;
+    out[index++] = offset >> 8;
+
+    if (matchCode >= 15) index = putLength(out, index, matchCode - 15);
+
+    return index;
+}
+
+int lzCompress(const unsigned char *in, int inSize, unsigned char *out, int capacity) {
+    int table[1 << HASH_BITS];
+    int anchor = 0, i = 0, index = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (i < inSize - MATCH_LIMIT) {
+        uint32_t value = read32(in + i);
+        int slot = hash(value), candidate = table[slot];
+
+        table[slot] = i;
+
+        if (candidate >= i || i - candidate > MAX_OFFSET || read32(in + candidate) != value) {
+            i++;
+            continue;
+        }
+
+        int length = MIN_MATCH;
+        while (i + length < inSize - LAST_LITERALS && in[candidate + length] == in[i + length]) length++;
+
+        // the match may also start a little earlier
+        while (i > anchor && candidate > 0 && in[i - 1] == in[candidate - 1]) {
+            i--;
+            candidate--;
+            length++;
+        }
+
+        index = putSequence(out, index, capacity, in + anchor, i - anchor, i - candidate, length);
+        if (index == -1) return -1;
+
+        i += length;
+        anchor = i;
+    }
+
+    return putSequence(out, index, capacity, in + anchor, inSize - anchor, 0, 0);
+}
+
+int lzDecompress(const unsigned char *in, int inSize, unsigned char *out, int capacity) {
+    int i = 0, index = 0;
+
+    while (i < inSize) {
+        int token = in[i++];
+        int literals = token >> 4, length = token & 15;
+
+        if (literals == 15 && (literals = getLength(in, inSize, &i, literals)) == -1) return -1;
+        if (literals > inSize - i || literals > capacity - index) return -1;
+
+        memcpy(out + index, in + i, literals);
+        index += literals;
+        i += literals;
+
+        // the last sequence has no match
+        if (i == inSize) break;
+        if (inSize - i < 2) return -1;
+
+        int offset = in[i] | in[i + 1] << 8;
+        i += 2;
+
+        if (length == 15 && (length = getLength(in, inSize, &i, length)) == -1) return -1;
+        length += MIN_MATCH;
+
+        if (offset == 0 || offset > index || length > capacity - index) return -1;
+
+        const unsigned char *match = out + index - offset;
+
+        if (offset >= length) {
+            memcpy(out + index, match, length);
+        } else {
+            // overlapping match, it repeats the last offset bytes
+            for (int k = 0; k < length; k++) out[index + k] = match[k];
+        }
+
+        index += length;
+    }
+
+    return index;
+}
@@ -0,0 +1,245 @@
+// Pipelined transfer engine
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "pipeline.h"
+#include "application_layer.h"
+#include "packet.h"
+
+#define PAGE_SIZE 4096
+
+// A pooled tx frame together with the packet it carries until it is framed
+typedef struct {
+    TxFrame frame; // first, so a TxFrame * from the link layer is also a PipelineFrame *
+    unsigned char header[MAX_DATA_PACKET_HEADER];
+    int headerSize;
+    const unsigned char *data;
+    int size;
+    unsigned char copy[MAX_PAYLOAD_SIZE]; // the data, when it comes from a block that is reused
+} PipelineFrame;
+
+PipelineFrame txPool[PIPELINE_FRAMES];
+
+// free -> reader -> cut -> framer -> ready -> serial thread -> (acknowledged) -> free
+SpscRing freeFrames, cutFrames, readyFrames;
+pthread_t readerThread, framerThread;
+
+const unsigned char *txContents;
+size_t txSize, txCut;
+int txCompressed;
+atomic_int txPacketSize;
+
+unsigned char txBlock[BLOCK_HEADER + LZ_BLOCK_SIZE];
+
+void *readFile(void *arg) {
+    const unsigned char *chunk = NULL;
+    size_t offset = 0, chunkSize = 0, cut = 0;
+    int nSequence = 0;
+
+    txCut = 0;
+
+    while (cut < chunkSize || offset < txSize) {
+        // the next block, compressed while the frames cut from the last one go out
+        if (cut == chunkSize) {
+            if (txCompressed) {
+                int blockSize = txSize - offset < LZ_BLOCK_SIZE ? txSize - offset : LZ_BLOCK_SIZE;
+
+                chunk = txBlock;
+                chunkSize = encodeBlock(txContents + offset, blockSize, txBlock);
+                offset += blockSize;
+            } else {
+                chunk = txContents;
+                chunkSize = offset = txSize;
+            }
+            cut = 0;
+        }
+
+        PipelineFrame *packet = spscPop(&freeFrames);
+
+        if (packet == NULL) break; // stopped
+
+        int size = atomic_load(&txPacketSize);
+        if ((size_t) size > chunkSize - cut) size = chunkSize - cut;
+
+        packet->size = size;
+        packet->headerSize = getDataPacketHeader(packet->header, nSequence++, size);
+
+        if (txCompressed) {
+            // the block is overwritten by the next one before this packet is framed
+            memcpy(packet->copy, chunk + cut, size);
+            packet->data = packet->copy;
+        } else {
+            packet->data = chunk + cut;
+
+            // touch every page so any disk read happens on this thread, not the serial one
+            volatile unsigned char touched = 0;
+            for (int i = 0; i < size; i += PAGE_SIZE) touched ^= packet->data[i];
+            touched ^= packet->data[size - 1];
+        }
+
+        cut += size;
+        txCut += size;
+        spscPush(&cutFrames, packet);
+    }
+
+    spscPush(&cutFrames, NULL);
+    return NULL;
+}
+
+void *frameData(void *arg) {
+    PipelineFrame *packet;
+
+    while ((packet = spscPop(&cutFrames)) != NULL) {
+        struct iovec iov[2] = {
+                {packet->header, packet->headerSize},
+                {(void *) packet->data, packet->size},
+        };
+
+        llframe(iov, 2, &packet->frame);
+        spscPush(&readyFrames, packet);
+    }
+
+    spscPush(&readyFrames, NULL);
+    return NULL;
+}
+
+int pipelineStartTx(const unsigned char *contents, size_t size, int packetSize, int compressed) {
+    txContents = contents;
+    txSize = size;
+    txCompressed = compressed;
+    atomic_store(&txPacketSize, packetSize);
+
+    spscInit(&freeFrames);
+    spscInit(&cutFrames);
+    spscInit(&readyFrames);
+
+    for (int i = 0; i < PIPELINE_FRAMES; i++) {
+        txPool[i].frame.pool = &freeFrames;
+        spscPush(&freeFrames, &txPool[i]);
+    }
+
+    if (pthread_create(&readerThread, NULL, readFile, NULL) != 0) return -1;
+
+    if (pthread_create(&framerThread, NULL, frameData, NULL) != 0) {
+        spscPush(&freeFrames, NULL);
+        pthread_join(readerThread, NULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+TxFrame *pipelineNextFrame() {
+    PipelineFrame *packet = spscPop(&readyFrames);
+    return packet != NULL ? &packet->frame : NULL;
+}
+
+void pipelineSetPacketSize(int packetSize) {
+    atomic_store(&txPacketSize, packetSize);
+}
+
+size_t pipelineStopTx() {
+    // wakes the reader if it is waiting for a frame; harmless if it already finished.
+    // The rings hold more than the whole pool, so nothing else can be blocked.
+    spscPush(&freeFrames, NULL);
+
+    pthread_join(readerThread, NULL);
+    pthread_join(framerThread, NULL);
+
+    spscDestroy(&freeFrames);
+    spscDestroy(&cutFrames);
+    spscDestroy(&readyFrames);
+
+    return txCut;
+}
+
+////////////////////////////////////////////////
+// WRITER
+////////////////////////////////////////////////
+
+WriteBatch rxPool[PIPELINE_BATCHES];
+
+// free -> serial thread -> full -> writer -> free
+SpscRing freeBatches, fullBatches;
+pthread_t writerThread;
+
+int writerFd;
+atomic_int writeFailed;
+atomic_long written; // end of the last batch written
+
+int writeBatch(int fd, const WriteBatch *batch) {
+    int written = 0;
+
+    while (written < batch->size) {
+        ssize_t bytes = pwrite(fd, batch->data + written, batch->size - written, batch->offset + written);
+
+        // a pipe has no offsets, its data only ever comes in order
+        if (bytes == -1 && errno == ESPIPE) bytes = write(fd, batch->data + written, batch->size - written);
+
+        if (bytes == -1) {
+            perror("pwrite");
+            return -1;
+        }
+
+        written += bytes;
+    }
+
+    return 0;
+}
+
+void *writeFile(void *arg) {
+    WriteBatch *batch;
+
+    while ((batch = spscPop(&fullBatches)) != NULL) {
+        if (writeBatch(writerFd, batch) == -1) atomic_store(&writeFailed, TRUE);
+        else atomic_store(&written, batch->offset + batch->size);
+        spscPush(&freeBatches, batch);
+    }
+
+    return NULL;
+}
+
+WriteBatch *pipelineStartWriter(int fd, int batchSize) {
+    writerFd = fd;
+    atomic_store(&writeFailed, FALSE);
+    atomic_store(&written, 0);
+
+    spscInit(&freeBatches);
+    spscInit(&fullBatches);
+
+    for (int i = 0; i < PIPELINE_BATCHES; i++) {
+        if (rxPool[i].data == NULL) rxPool[i].data = malloc(batchSize);
+        if (rxPool[i].data == NULL) return NULL;
+
+        rxPool[i].size = 0;
+        spscPush(&freeBatches, &rxPool[i]);
+    }
+
+    if (pthread_create(&writerThread, NULL, writeFile, NULL) != 0) return NULL;
+
+    return spscPop(&freeBatches);
+}
+
+WriteBatch *pipelineWrite(WriteBatch *batch) {
+    spscPush(&fullBatches, batch);
+
+    WriteBatch *empty = spscPop(&freeBatches);
+    empty->size = 0;
+
+    return empty;
+}
+
+long pipelineWritten() {
+    return atomic_load(&written);
+}
+
+int pipelineStopWriter() {
+    spscPush(&fullBatches, NULL);
+    pthread_join(writerThread, NULL);
+
+    spscDestroy(&freeBatches);
+    spscDestroy(&fullBatches);
+
+    return atomic_load(&writeFailed) ? -1 : 0;
+}
@@ -0,0 +1,44 @@
+// Retransmission timeout estimation
+
+#include "rtt.h"
+
+#define RTT_INITIAL_RTO 1000 // RFC 6298 initial timeout, before the first sample
+
+long long clampRto(const RttEstimator *rtt, long long rto) {
+    if (rto < rtt->minRto) return rtt->minRto;
+    if (rto > rtt->maxRto) return rtt->maxRto;
+    return rto;
+}
+
+void rttInit(RttEstimator *rtt, long long minRto, long long maxRto) {
+    rtt->srtt = 0;
+    rtt->rttvar = 0;
+    rtt->minRto = minRto;
+    rtt->maxRto = maxRto;
+    rtt->samples = 0;
+    rtt->rto = clampRto(rtt, RTT_INITIAL_RTO);
+}
+
+void rttSample(RttEstimator *rtt, long long sampleMs) {
+    if (sampleMs < 0) return;
+
+    if (rtt->samples == 0) {
+        rtt->srtt = sampleMs << 3;
+        rtt->rttvar = sampleMs << 1;
+    } else {
+        long long error = sampleMs - (rtt->srtt >> 3);
+
+        rtt->srtt += error;                             // SRTT = 7/8 SRTT + 1/8 R
+        if (error < 0) error = -error;
+        rtt->rttvar += error - (rtt->rttvar >> 2);      // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+    }
+
+    rtt->samples++;
+
+    // RTO = SRTT + max(G, 4 RTTVAR), with a clock granularity G of 1 ms
+    rtt->rto = clampRto(rtt, (rtt->srtt >> 3) + (rtt->rttvar > 1 ? rtt->rttvar : 1));
+}
+
+void rttBackoff(RttEstimator *rtt) {
+    rtt->rto = clampRto(rtt, rtt->rto * 2);
+}
@@ -0,0 +1,83 @@
+// Single-producer/single-consumer ring
+
+#include "spsc.h"
+
+void spscInit(SpscRing *ring) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->sleepers, 0);
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+}
+
+void spscDestroy(SpscRing *ring) {
+    pthread_mutex_destroy(&ring->mutex);
+    pthread_cond_destroy(&ring->cond);
+}
+
+// Wakes the other side if it went to sleep. The sequentially consistent accesses to
+// head/tail and sleepers guarantee that either the sleeper sees the change before it
+// waits or this sees the sleeper.
+void spscWake(SpscRing *ring) {
+    if (atomic_load(&ring->sleepers) == 0) return;
+
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+int spscTryPush(SpscRing *ring, void *item) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load(&ring->tail) == SPSC_CAPACITY) return 0;
+
+    ring->items[head % SPSC_CAPACITY] = item;
+    atomic_store(&ring->head, head + 1);
+    spscWake(ring);
+
+    return 1;
+}
+
+int spscTryPop(SpscRing *ring, void **item) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (atomic_load(&ring->head) == tail) return 0;
+
+    *item = ring->items[tail % SPSC_CAPACITY];
+    atomic_store(&ring->tail, tail + 1);
+    spscWake(ring);
+
+    return 1;
+}
+
+void spscPush(SpscRing *ring, void *item) {
+    while (!spscTryPush(ring, item)) {
+        pthread_mutex_lock(&ring->mutex);
+        atomic_fetch_add(&ring->sleepers, 1);
+
+        while (atomic_load(&ring->head) - atomic_load(&ring->tail) == SPSC_CAPACITY) {
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+        }
+
+        atomic_fetch_sub(&ring->sleepers, 1);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+}
+
+void *spscPop(SpscRing *ring) {
+    void *item;
+
+    while (!spscTryPop(ring, &item)) {
+        pthread_mutex_lock(&ring->mutex);
+        atomic_fetch_add(&ring->sleepers, 1);
+
+        while (atomic_load(&ring->head) == atomic_load(&ring->tail)) {
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+        }
+
+        atomic_fetch_sub(&ring->sleepers, 1);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+
+    return item;
+}
@@ -0,0 +1,222 @@
+// Byte stuffing and destuffing kernels
+
+#include <pthread.h>
+#include "stuffing.h"
+#include "link_layer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STUFFING_X86 1
+#endif
+
+typedef int (*StuffKernel)(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs);
+typedef int (*DestuffKernel)(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped);
+
+// Stuffs a single byte into out at index, returns the new index
+static inline int stuffByte(unsigned char byte, unsigned char *out, int index) {
+    if (byte == FLAG || byte == ESC) {
+        out[index++] = ESC;
+        out[index++] = byte ^ 0x20;
+    } else {
+        out[index++] = byte;
+    }
+
+    return index;
+}
+
+// Writes a block whose FLAG/ESC positions are set in mask, returns the new index
+static inline int stuffBlock(const unsigned char *buf, int blockSize, unsigned int mask, unsigned char *out, int index) {
+    int prev = 0;
+
+    while (mask) {
+        int pos = __builtin_ctz(mask);
+
+        memcpy(out + index, buf + prev, pos - prev);
+        index += pos - prev;
+        out[index++] = ESC;
+        out[index++] = buf[pos] ^ 0x20;
+
+        prev = pos + 1;
+        mask &= mask - 1;
+    }
+
+    memcpy(out + index, buf + prev, blockSize - prev);
+
+    return index + blockSize - prev;
+}
+
+int stuffScalar(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs) {
+    int index = 0;
+
+    if (fcs != NULL) fcsUpdate(fcs, buf, bufSize);
+
+    for (int i = 0; i < bufSize; i++) {
+        index = stuffByte(buf[i], out, index);
+    }
+
+    return index;
+}
+
+int destuffScalar(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped) {
+    int i = 0, index = *outSize;
+
+    for (; i < inSize; i++) {
+        if (in[i] == FLAG) break;
+
+        if (*escaped) {
+            out[index++] = in[i] ^ 0x20;
+            *escaped = FALSE;
+        } else if (in[i] == ESC) {
+            *escaped = TRUE;
+        } else {
+            out[index++] = in[i];
+        }
+    }
+
+    *outSize = index;
+    return i;
+}
+
+#ifdef STUFFING_X86
+
+__attribute__((target("sse2")))
+int stuffSse2(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs) {
+    const __m128i flag = _mm_set1_epi8((char) FLAG), esc = _mm_set1_epi8((char) ESC);
+    int i = 0, index = 0;
+
+    for (; i + 16 <= bufSize; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, flag), _mm_cmpeq_epi8(block, esc)));
+
+        if (fcs != NULL) fcsUpdate(fcs, buf + i, 16);
+
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *) (out + index), block);
+            index += 16;
+        } else {
+            index = stuffBlock(buf + i, 16, mask, out, index);
+        }
+    }
+
+    return index + stuffScalar(buf + i, bufSize - i, out + index, fcs);
+}
+
+__attribute__((target("avx2")))
+int stuffAvx2(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs) {
+    const __m256i flag = _mm256_set1_epi8((char) FLAG), esc = _mm256_set1_epi8((char) ESC);
+    int i = 0, index = 0;
+
+    for (; i + 32 <= bufSize; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (buf + i));
+        unsigned int mask = _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, flag), _mm256_cmpeq_epi8(block, esc)));
+
+        if (fcs != NULL) fcsUpdate(fcs, buf + i, 32);
+
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *) (out + index), block);
+            index += 32;
+        } else {
+            index = stuffBlock(buf + i, 32, mask, out, index);
+        }
+    }
+
+    return index + stuffSse2(buf + i, bufSize - i, out + index, fcs);
+}
+
+// The vector loops only skip over clean runs; every FLAG/ESC goes through the scalar step
+__attribute__((target("sse2")))
+int destuffSse2(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped) {
+    const __m128i flag = _mm_set1_epi8((char) FLAG), esc = _mm_set1_epi8((char) ESC);
+    int i = 0;
+
+    while (i < inSize) {
+        if (i + 16 > inSize) return i + destuffScalar(in + i, inSize - i, out, outSize, escaped);
+
+        if (!*escaped) {
+            __m128i block = _mm_loadu_si128((const __m128i *) (in + i));
+            unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, flag), _mm_cmpeq_epi8(block, esc)));
+            int clean = mask ? __builtin_ctz(mask) : 16;
+
+            _mm_storeu_si128((__m128i *) (out + *outSize), block);
+            *outSize += clean;
+            i += clean;
+
+            if (clean == 16) continue;
+        }
+
+        if (destuffScalar(in + i, 1, out, outSize, escaped) == 0) break; // FLAG
+        i++;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+int destuffAvx2(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped) {
+    const __m256i flag = _mm256_set1_epi8((char) FLAG), esc = _mm256_set1_epi8((char) ESC);
+    int i = 0;
+
+    while (i < inSize) {
+        if (i + 32 > inSize) return i + destuffSse2(in + i, inSize - i, out, outSize, escaped);
+
+        if (!*escaped) {
+            __m256i block = _mm256_loadu_si256((const __m256i *) (in + i));
+            unsigned int mask = _mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(block, flag), _mm256_cmpeq_epi8(block, esc)));
+            int clean = mask ? __builtin_ctz(mask) : 32;
+
+            _mm256_storeu_si256((__m256i *) (out + *outSize), block);
+            *outSize += clean;
+            i += clean;
+
+            if (clean == 32) continue;
+        }
+
+        if (destuffScalar(in + i, 1, out, outSize, escaped) == 0) break; // FLAG
+        i++;
+    }
+
+    return i;
+}
+
+#endif
+
+StuffKernel stuffKernel = NULL;
+DestuffKernel destuffKernel = NULL;
+const char *kernelName = "scalar";
+pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+
+void selectKernels() {
+    stuffKernel = stuffScalar;
+    destuffKernel = destuffScalar;
+
+#ifdef STUFFING_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        stuffKernel = stuffAvx2;
+        destuffKernel = destuffAvx2;
+        kernelName = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        stuffKernel = stuffSse2;
+        destuffKernel = destuffSse2;
+        kernelName = "sse2";
+    }
+#endif
+}
+
+int stuffBytes(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs) {
+    pthread_once(&kernelsOnce, selectKernels);
+    return stuffKernel(buf, bufSize, out, fcs);
+}
+
+int destuffBytes(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped) {
+    pthread_once(&kernelsOnce, selectKernels);
+    return destuffKernel(in, inSize, out, outSize, escaped);
+}
+
+const char *stuffingKernel() {
+    pthread_once(&kernelsOnce, selectKernels);
+    return kernelName;
+}
@@ -0,0 +1,97 @@
+// Timers and waiting. The alarm is a timerfd, so the link layer can sleep in poll()
+// on the serial port and the alarm at the same time instead of spinning on read().
+
+#include <poll.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+
+long long currentTimeMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void initAlarm(Alarm *alarm) {
+    alarm->fd = -1;
+    alarm->enabled = FALSE;
+    alarm->count = 0;
+}
+
+int armAlarmMs(Alarm *alarm, long long timeoutMs) {
+    struct itimerspec value = {0};
+
+    if (alarm->fd < 0) {
+        alarm->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (alarm->fd < 0) {
+            perror("timerfd_create");
+            return -1;
+        }
+    }
+
+    if (timeoutMs <= 0) timeoutMs = 1; // a zero it_value would disarm the timer
+
+    value.it_value.tv_sec = timeoutMs / 1000;
+    value.it_value.tv_nsec = (timeoutMs % 1000) * 1000000;
+
+    if (timerfd_settime(alarm->fd, 0, &value, NULL) == -1) {
+        perror("timerfd_settime");
+        return -1;
+    }
+
+    alarm->enabled = TRUE;
+
+    return 0;
+}
+
+//Starts the alarm
+int armAlarm(Alarm *alarm, int timeout) {
+    return armAlarmMs(alarm, timeout * 1000LL);
+}
+
+//Cancels a pending alarm
+void stopAlarm(Alarm *alarm) {
+    struct itimerspec value = {0};
+
+    if (alarm->fd >= 0) timerfd_settime(alarm->fd, 0, &value, NULL);
+    alarm->enabled = FALSE;
+}
+
+void closeAlarm(Alarm *alarm) {
+    if (alarm->fd >= 0) close(alarm->fd);
+    initAlarm(alarm);
+}
+
+// Called when the timerfd expires
+void alarmExpired(Alarm *alarm) {
+    unsigned long long expirations;
+
+    if (read(alarm->fd, &expirations, sizeof(expirations)) <= 0) return;
+
+    alarm->enabled = FALSE;
+    alarm->count++;
+
+    printf("\nAlarm #%d\n", alarm->count);
+}
+
+int waitReadable(int fd, Alarm *alarm, long long deadlineMs) {
+    struct pollfd fds[2] = {{fd, POLLIN, 0}, {alarm != NULL ? alarm->fd : -1, POLLIN, 0}};
+    int nfds = (alarm != NULL && alarm->fd >= 0 && alarm->enabled) ? 2 : 1, waitMs = -1;
+
+    if (deadlineMs >= 0) {
+        long long now = currentTimeMs();
+        waitMs = deadlineMs > now ? (int) (deadlineMs - now) : 0;
+    }
+
+    if (poll(fds, nfds, waitMs) <= 0) return FALSE;
+
+    if (nfds == 2 && (fds[1].revents & POLLIN)) alarmExpired(alarm);
+
+    return (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+}
+
+void waitWritable(int fd) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    poll(&pfd, 1, -1);
+}
@@ -0,0 +1,136 @@
+// XXH64 hash
+
+#include <string.h>
+#include "xxhash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+#define STRIPE 32
+
+static inline uint64_t rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// little endian, whatever the host
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | p[i];
+    return value;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t round64(uint64_t lane, uint64_t input) {
+    lane += input * PRIME2;
+    lane = rotl(lane, 31);
+    return lane * PRIME1;
+}
+
+static inline uint64_t mergeRound(uint64_t hash, uint64_t lane) {
+    hash ^= round64(0, lane);
+    return hash * PRIME1 + PRIME4;
+}
+
+// Mixes whole stripes of data into the lanes, returns the bytes consumed
+static size_t consumeStripes(uint64_t *lanes, const unsigned char *data, size_t size) {
+    size_t done = 0;
+
+    for (; done + STRIPE <= size; done += STRIPE) {
+        lanes[0] = round64(lanes[0], read64(data + done));
+        lanes[1] = round64(lanes[1], read64(data + done + 8));
+        lanes[2] = round64(lanes[2], read64(data + done + 16));
+        lanes[3] = round64(lanes[3], read64(data + done + 24));
+    }
+
+    return done;
+}
+
+void xxh64Init(Xxh64State *state, uint64_t seed) {
+    state->lanes[0] = seed + PRIME1 + PRIME2;
+    state->lanes[1] = seed + PRIME2;
+    state->lanes[2] = seed;
+    state->lanes[3] = seed - PRIME1;
+    state->total = 0;
+    state->buffered = 0;
+}
+
+void xxh64Update(Xxh64State *state, const void *data, size_t size) {
+    const unsigned char *p = data;
+
+    state->total += size;
+
+    // top up a stripe left over from the last call first
+    if (state->buffered > 0) {
+        size_t count = STRIPE - state->buffered < size ? STRIPE - state->buffered : size;
+
+        memcpy(state->buffer + state->buffered, p, count);
+        state->buffered += count;
+        p += count;
+        size -= count;
+
+        if (state->buffered < STRIPE) return;
+
+        consumeStripes(state->lanes, state->buffer, STRIPE);
+        state->buffered = 0;
+    }
+
+    size_t done = consumeStripes(state->lanes, p, size);
+
+    memcpy(state->buffer, p + done, size - done);
+    state->buffered = size - done;
+}
+
+uint64_t xxh64Digest(const Xxh64State *state) {
+    const unsigned char *p = state->buffer, *end = state->buffer + state->buffered;
+    uint64_t hash;
+
+    if (state->total >= STRIPE) {
+        const uint64_t *lanes = state->lanes;
+
+        hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+        for (int i = 0; i < 4; i++) hash = mergeRound(hash, lanes[i]);
+    } else {
+        hash = state->lanes[2] + PRIME5; // the seed, nothing was mixed in
+    }
+
+    hash += state->total;
+
+    for (; p + 8 <= end; p += 8) {
+        hash ^= round64(0, read64(p));
+        hash = rotl(hash, 27) * PRIME1 + PRIME4;
+    }
+
+    if (p + 4 <= end) {
+        hash ^= read32(p) * PRIME1;
+        hash = rotl(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        hash ^= *p * PRIME5;
+        hash = rotl(hash, 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed) {
+    Xxh64State state;
+
+    xxh64Init(&state, seed);
+    xxh64Update(&state, data, size);
+
+    return xxh64Digest(&state);
+}
@@ -0,0 +1,186 @@
+// Round trip of I-frames through COBS framing, over two pseudo terminals joined by a thread.
+// Sends frames whose data field (payload and FCS) decodes to a multiple of COBS_MAX_RUN,
+// including frames of the maximum payload size whose last block is a full run, so they
+// end with the code byte of an empty block right before the closing FLAG.
+//
+// Build and run from the repository root (or all tests with "make -C tests test"):
+//   gcc -Wall -DFRAMING_MODE=FRAMING_COBS -o bin/cobs_frames tests/cobs_frames.c src/*.c -Iinclude -lpthread -lutil
+//   bin/cobs_frames
+
+#include <pthread.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cobs.h"
+#include "link_layer.h"
+#include "link_connection.h"
+
+#define FLAG_POSITIONS 300 // frames of the maximum size, with a FLAG this far from the end at most
+#define TEST_TIMEOUT 60    // s, a frame the receiver keeps dropping is retransmitted forever
+
+typedef struct {
+    int masters[2];
+    int stop;
+} Cable;
+
+typedef struct {
+    LinkLayer parameters;
+    unsigned char (*frames)[MAX_PAYLOAD_SIZE];
+    int *sizes;
+    int count;
+    int failures;
+} Receiver;
+
+// Copies whatever one end writes to the other, until stopped or the test times out
+static void *runCable(void *arg) {
+    Cable *cable = arg;
+    unsigned char buf[4096];
+    time_t deadline = time(NULL) + TEST_TIMEOUT;
+
+    while (!cable->stop) {
+        if (time(NULL) > deadline) {
+            printf("Timed out, FAILED\n");
+            exit(1);
+        }
+
+        fd_set fds;
+        struct timeval wait = {0, 100000};
+
+        FD_ZERO(&fds);
+        FD_SET(cable->masters[0], &fds);
+        FD_SET(cable->masters[1], &fds);
+
+        int highest = cable->masters[0] > cable->masters[1] ? cable->masters[0] : cable->masters[1];
+        if (select(highest + 1, &fds, NULL, NULL, &wait) <= 0) continue;
+
+        for (int i = 0; i < 2; i++) {
+            if (!FD_ISSET(cable->masters[i], &fds)) continue;
+
+            int bytes = read(cable->masters[i], buf, sizeof(buf));
+            for (int written = 0; bytes > 0 && written < bytes;) {
+                int n = write(cable->masters[1 - i], buf + written, bytes - written);
+                if (n > 0) written += n;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void *runReceiver(void *arg) {
+    Receiver *receiver = arg;
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    LinkConnection *conn = llopen_r(receiver->parameters, NULL);
+
+    if (conn == NULL) {
+        receiver->failures = receiver->count;
+        return NULL;
+    }
+
+    for (int i = 0; i < receiver->count; i++) {
+        int size;
+
+        if (llread_r(conn, packet, &size) != receiver->sizes[i] ||
+            memcmp(packet, receiver->frames[i], size) != 0) {
+            printf("Frame %d of %d bytes received wrong\n", i, receiver->sizes[i]);
+            receiver->failures++;
+            break;
+        }
+    }
+
+    llclose_r(conn, FALSE, 0);
+    return NULL;
+}
+
+// Fills size bytes with data that has no FLAG in it
+static void fill(unsigned char *data, int size, int seed) {
+    for (int i = 0; i < size; i++) {
+        data[i] = (i * 7 + seed * 13 + 3) & 0xFF;
+        if (data[i] == FLAG) data[i] = 0;
+    }
+}
+
+int main() {
+    Cable cable = {{-1, -1}, FALSE};
+    LinkLayer parameters[2];
+    struct termios raw;
+
+    memset(parameters, 0, sizeof(parameters));
+    memset(&raw, 0, sizeof(raw));
+    cfmakeraw(&raw);
+
+    for (int i = 0; i < 2; i++) {
+        int slave; // kept open so the master doesn't see a hang up between opens
+
+        if (openpty(&cable.masters[i], &slave, parameters[i].serialPort, &raw, NULL) == -1) {
+            perror("openpty");
+            return 1;
+        }
+
+        tcsetattr(cable.masters[i], TCSANOW, &raw);
+        parameters[i].role = i == 0 ? LlTx : LlRx;
+        parameters[i].baudRate = BAUDRATE;
+        parameters[i].nRetransmissions = 3;
+        parameters[i].timeout = 1;
+    }
+
+    // payloads of whole runs with the FCS, then payloads of the maximum size with a FLAG moving
+    // back from the end, so for every FCS size one of them ends on a full run
+    int count = 3 + FLAG_POSITIONS;
+    unsigned char (*frames)[MAX_PAYLOAD_SIZE] = malloc(count * sizeof(*frames));
+    int *sizes = malloc(count * sizeof(int));
+
+    if (frames == NULL || sizes == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        sizes[i] = i < 3 ? (i + 1) * COBS_MAX_RUN : MAX_PAYLOAD_SIZE;
+        fill(frames[i], sizes[i], i);
+        if (i >= 3) frames[i][MAX_PAYLOAD_SIZE - 1 - (i - 3)] = FLAG;
+    }
+
+    Receiver receiver = {parameters[1], frames, sizes, count, 0};
+    pthread_t cableThread, receiverThread;
+
+    pthread_create(&cableThread, NULL, runCable, &cable);
+    pthread_create(&receiverThread, NULL, runReceiver, &receiver);
+
+    int failures = 0;
+    LinkConnection *conn = llopen_r(parameters[0], NULL);
+
+    if (conn == NULL || llparameters_r(conn).framing != FRAMING_COBS) {
+        printf("No COBS connection\n");
+        failures++;
+    }
+
+    for (int i = 0; failures == 0 && i < count; i++) {
+        if (llwrite_r(conn, frames[i], sizes[i]) != sizes[i]) {
+            printf("Frame %d of %d bytes not acknowledged\n", i, sizes[i]);
+            failures++;
+        }
+    }
+
+    if (conn != NULL) {
+        if (failures == 0) llflush_r(conn);
+        llclose_r(conn, FALSE, 0);
+    }
+
+    pthread_join(receiverThread, NULL);
+    cable.stop = TRUE;
+    pthread_join(cableThread, NULL);
+
+    failures += receiver.failures;
+    printf("%d frames, %s\n", count, failures == 0 ? "all received" : "FAILED");
+
+    free(frames);
+    free(sizes);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+// Byte stuffing and FCS kernels against plain reference versions. Every stuffing kernel
+// this CPU has (scalar, SSE2, AVX2) runs on buffers of every length up to a few vector
+// widths, with FLAG and ESC bytes at several densities, and is destuffed again in pieces
+// split at every point, so an ESC carried over between calls is covered. The slice-by-8
+// CRCs are checked against bitwise ones and the standard check values.
+//
+// Build and run from the repository root (or all tests with "make -C tests test"):
+//   gcc -Wall -o bin/kernels tests/kernels.c src/*.c -Iinclude -lpthread
+//   bin/kernels
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc.h"
+#include "link_layer.h"
+#include "stuffing.h"
+
+#define MAX_LENGTH 200 // bytes, several AVX2 blocks and a scalar tail
+
+typedef int (*StuffKernel)(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs);
+typedef int (*DestuffKernel)(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped);
+
+// The kernels behind stuffBytes/destuffBytes (src/stuffing.c)
+int stuffScalar(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs);
+int destuffScalar(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+int stuffSse2(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs);
+int stuffAvx2(const unsigned char *buf, int bufSize, unsigned char *out, Fcs *fcs);
+int destuffSse2(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped);
+int destuffAvx2(const unsigned char *in, int inSize, unsigned char *out, int *outSize, int *escaped);
+#endif
+
+typedef struct {
+    const char *name;
+    StuffKernel stuff;
+    DestuffKernel destuff;
+} Kernel;
+
+static uint16_t referenceCrc16(const unsigned char *buf, int size) {
+    uint16_t crc = 0xFFFF;
+
+    for (int i = 0; i < size; i++) {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+    }
+
+    return crc ^ 0xFFFF;
+}
+
+static uint32_t referenceCrc32(const unsigned char *buf, int size) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (int i = 0; i < size; i++) {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+static int referenceStuff(const unsigned char *buf, int size, unsigned char *out) {
+    int index = 0;
+
+    for (int i = 0; i < size; i++) {
+        if (buf[i] == FLAG || buf[i] == ESC) {
+            out[index++] = ESC;
+            out[index++] = buf[i] ^ 0x20;
+        } else {
+            out[index++] = buf[i];
+        }
+    }
+
+    return index;
+}
+
+// Random bytes where about one in density is a FLAG or an ESC (none if density is 0)
+static void fillRandom(unsigned char *buf, int size, int density) {
+    for (int i = 0; i < size; i++) {
+        buf[i] = rand() & 0xFF;
+        if (buf[i] == FLAG || buf[i] == ESC) buf[i] = 0x00;
+        if (density > 0 && rand() % density == 0) buf[i] = rand() % 2 ? FLAG : ESC;
+    }
+}
+
+static int checkCrcs() {
+    const unsigned char check[] = "123456789";
+    unsigned char buf[MAX_LENGTH];
+    int failures = 0;
+
+    if (crc16(check, 9) != 0x906E || crc32(check, 9) != 0xCBF43926) {
+        printf("CRC check values of \"123456789\": %04X %08X, expected 906E CBF43926\n", crc16(check, 9), crc32(check, 9));
+        failures++;
+    }
+
+    fillRandom(buf, sizeof(buf), 0);
+
+    for (int size = 0; size <= MAX_LENGTH; size++) {
+        if (crc16(buf, size) != referenceCrc16(buf, size) || crc32(buf, size) != referenceCrc32(buf, size)) {
+            printf("CRCs of %d bytes differ from the bitwise ones\n", size);
+            failures++;
+        }
+    }
+
+    // fed in two pieces the FCS is the same as in one
+    for (int type = FCS_XOR; type <= FCS_CRC32; type++) {
+        Fcs whole, split;
+        unsigned char expected[4], actual[4];
+
+        fcsInit(&whole, type);
+        fcsUpdate(&whole, buf, MAX_LENGTH);
+        fcsFinal(&whole, expected);
+
+        for (int cut = 0; cut <= MAX_LENGTH; cut++) {
+            fcsInit(&split, type);
+            fcsUpdate(&split, buf, cut);
+            fcsUpdate(&split, buf + cut, MAX_LENGTH - cut);
+
+            if (fcsFinal(&split, actual) != fcsSizeOf(type) || memcmp(actual, expected, fcsSizeOf(type)) != 0) {
+                printf("FCS type %d fed in pieces cut at %d differs\n", type, cut);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    return failures;
+}
+
+// Destuffs in, split at cut, the way llread does with a frame read in two pieces
+static int destuffSplit(const Kernel *kernel, const unsigned char *in, int inSize, int cut, unsigned char *out) {
+    int outSize = 0, escaped = FALSE;
+
+    if (kernel->destuff(in, cut, out, &outSize, &escaped) != cut) return -1;
+    if (kernel->destuff(in + cut, inSize - cut, out, &outSize, &escaped) != inSize - cut) return -1;
+
+    return escaped ? -1 : outSize;
+}
+
+static int checkKernel(const Kernel *kernel) {
+    const int densities[] = {0, 50, 8, 2, 1};
+    unsigned char buf[MAX_LENGTH], expected[2 * MAX_LENGTH + 1], stuffed[2 * MAX_LENGTH + 1], destuffed[MAX_LENGTH + 64];
+
+    for (int d = 0; d < (int) (sizeof(densities) / sizeof(densities[0])); d++) {
+        for (int size = 0; size <= MAX_LENGTH; size++) {
+            fillRandom(buf, size, densities[d]);
+
+            Fcs fcs;
+            unsigned char value[4], reference[4];
+            int expectedSize = referenceStuff(buf, size, expected);
+
+            fcsInit(&fcs, FCS_CRC32);
+            int stuffedSize = kernel->stuff(buf, size, stuffed, &fcs);
+            fcsFinal(&fcs, value);
+
+            uint32_t crc = referenceCrc32(buf, size);
+            for (int i = 0; i < 4; i++) reference[i] = crc >> (8 * i);
+
+            if (stuffedSize != expectedSize || memcmp(stuffed, expected, expectedSize) != 0) {
+                printf("%s: %d bytes stuffed wrong\n", kernel->name, size);
+                return 1;
+            }
+            if (memcmp(value, reference, 4) != 0) {
+                printf("%s: FCS of %d bytes updated wrong while stuffing\n", kernel->name, size);
+                return 1;
+            }
+
+            for (int cut = 0; cut <= stuffedSize; cut++) {
+                if (destuffSplit(kernel, stuffed, stuffedSize, cut, destuffed) != size || memcmp(destuffed, buf, size) != 0) {
+                    printf("%s: %d bytes destuffed wrong in pieces cut at %d\n", kernel->name, size, cut);
+                    return 1;
+                }
+            }
+
+            // a FLAG stops destuffing right where it is and isn't consumed
+            int outSize = 0, escaped = FALSE;
+            stuffed[stuffedSize] = FLAG;
+
+            if (kernel->destuff(stuffed, stuffedSize + 1, destuffed, &outSize, &escaped) != stuffedSize || outSize != size) {
+                printf("%s: destuffing of %d bytes didn't stop at the FLAG\n", kernel->name, size);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int main() {
+    Kernel kernels[3] = {{"scalar", stuffScalar, destuffScalar}};
+    int count = 1;
+
+    srand(1);
+
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) kernels[count++] = (Kernel) {"sse2", stuffSse2, destuffSse2};
+    if (__builtin_cpu_supports("avx2")) kernels[count++] = (Kernel) {"avx2", stuffAvx2, destuffAvx2};
+#endif
+
+    int failures = checkCrcs();
+
+    for (int i = 0; i < count; i++) {
+        failures += checkKernel(&kernels[i]);
+    }
+
+    printf("CRCs and %d stuffing kernels (%s selected), %s\n", count, stuffingKernel(),
+           failures == 0 ? "all match" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
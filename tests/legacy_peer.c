@@ -0,0 +1,335 @@
+// Interoperation with a peer that doesn't negotiate, over a pseudo terminal. The test plays
+// the original implementation: it drops a SET with an info field, answers only a plain one
+// with a plain UA, and sends and checks stop-and-wait I-frames with a 1-bit N(S), XOR BCC2
+// and 0x7D byte stuffing. Both directions are checked, with one frame REJected on the way.
+//
+// Build and run from the repository root (or all tests with "make -C tests test"):
+//   gcc -Wall -o bin/legacy_peer tests/legacy_peer.c src/*.c -Iinclude -lpthread -lutil
+//   bin/legacy_peer
+
+#include <pthread.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include "link_layer.h"
+#include "link_connection.h"
+
+#define PACKETS 20
+#define REJECTED 5       // packet the legacy receiver REJects the first time
+#define PEER_TIMEOUT 10  // s without a frame before the test gives up
+#define PEER_RETRY 1     // s the legacy transmitter waits for an answer
+#define PEER_TRIES 5     // times it sends a frame
+
+typedef struct {
+    LinkLayer parameters;
+    unsigned char (*packets)[LEGACY_PAYLOAD_SIZE];
+    int *sizes;
+    int failures;
+} Peer;
+
+// Reads the next frame: A, C, BCC1, then the destuffed info field and BCC2 if any.
+// Return its size, or "-1" if none arrives in timeout seconds.
+static int readFrame(int fd, unsigned char *frame, int max, int timeout) {
+    int size = 0, inFrame = FALSE, escaped = FALSE;
+    unsigned char byte;
+
+    while (TRUE) {
+        fd_set fds;
+        struct timeval wait = {timeout, 0};
+
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (select(fd + 1, &fds, NULL, NULL, &wait) <= 0 || read(fd, &byte, 1) != 1) return -1;
+
+        if (byte == FLAG) {
+            if (inFrame && size > 0) return size;
+            inFrame = TRUE;
+            size = 0;
+            escaped = FALSE;
+        } else if (inFrame && byte == ESC) {
+            escaped = TRUE;
+        } else if (inFrame && size < max) {
+            frame[size++] = escaped ? byte ^ 0x20 : byte;
+            escaped = FALSE;
+        }
+    }
+}
+
+static int stuff(unsigned char byte, unsigned char *out) {
+    if (byte != FLAG && byte != ESC) {
+        out[0] = byte;
+        return 1;
+    }
+
+    out[0] = ESC;
+    out[1] = byte ^ 0x20;
+    return 2;
+}
+
+// Writes a frame, with the info field and its XOR BCC2 if info isn't NULL
+static void writeFrame(int fd, unsigned char A, unsigned char C, const unsigned char *info, int size) {
+    unsigned char frame[2 * LEGACY_PAYLOAD_SIZE + 8], bcc2 = 0;
+    int index = 0;
+
+    frame[index++] = FLAG;
+    frame[index++] = A;
+    frame[index++] = C;
+    frame[index++] = A ^ C;
+
+    if (info != NULL) {
+        for (int i = 0; i < size; i++) {
+            index += stuff(info[i], frame + index);
+            bcc2 ^= info[i];
+        }
+        index += stuff(bcc2, frame + index);
+    }
+
+    frame[index++] = FLAG;
+
+    if (write(fd, frame, index) != index) perror("write");
+}
+
+static int isPlain(const unsigned char *frame, int size, unsigned char C) {
+    return size == 3 && frame[1] == C && frame[2] == (frame[0] ^ frame[1]);
+}
+
+// Packets of every size up to the legacy maximum, with FLAG and ESC bytes in them
+static void fillPackets(unsigned char (*packets)[LEGACY_PAYLOAD_SIZE], int *sizes) {
+    for (int i = 0; i < PACKETS; i++) {
+        sizes[i] = 1 + i * (LEGACY_PAYLOAD_SIZE - 1) / (PACKETS - 1);
+
+        for (int j = 0; j < sizes[i]; j++) {
+            packets[i][j] = (j * 11 + i * 29) & 0xFF;
+        }
+        packets[i][sizes[i] / 2] = i % 2 == 0 ? FLAG : ESC;
+    }
+}
+
+static int checkParameters(LinkConnection *conn) {
+    LinkParameters params = llparameters_r(conn);
+
+    if (params.arqMode != ARQ_STOP_AND_WAIT || params.fcsType != FCS_XOR || params.framing != FRAMING_HDLC ||
+        params.maxPayloadSize != LEGACY_PAYLOAD_SIZE || params.packetFormat != PACKET_FORMAT_V0) {
+        printf("Settings other than the legacy ones agreed\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void *runTransmitter(void *arg) {
+    Peer *peer = arg;
+    LinkConnection *conn = llopen_r(peer->parameters, NULL);
+
+    if (conn == NULL) {
+        peer->failures++;
+        return NULL;
+    }
+
+    peer->failures += checkParameters(conn);
+
+    for (int i = 0; peer->failures == 0 && i < PACKETS; i++) {
+        if (llwrite_r(conn, peer->packets[i], peer->sizes[i]) != peer->sizes[i]) {
+            printf("Packet %d not acknowledged\n", i);
+            peer->failures++;
+        }
+    }
+
+    if (peer->failures == 0) llflush_r(conn);
+    if (llclose_r(conn, FALSE, 0) != 1) peer->failures++;
+
+    return NULL;
+}
+
+static void *runReceiver(void *arg) {
+    Peer *peer = arg;
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    LinkConnection *conn = llopen_r(peer->parameters, NULL);
+
+    if (conn == NULL) {
+        peer->failures++;
+        return NULL;
+    }
+
+    peer->failures += checkParameters(conn);
+
+    for (int i = 0; peer->failures == 0 && i < PACKETS; i++) {
+        int size;
+
+        if (llread_r(conn, packet, &size) != peer->sizes[i] || memcmp(packet, peer->packets[i], size) != 0) {
+            printf("Packet %d received wrong\n", i);
+            peer->failures++;
+        }
+    }
+
+    if (llclose_r(conn, FALSE, 0) != 1) peer->failures++;
+
+    return NULL;
+}
+
+// The original receiver, against our transmitter. Return the number of failures.
+static int legacyReceiver(int fd, unsigned char (*packets)[LEGACY_PAYLOAD_SIZE], int *sizes) {
+    unsigned char frame[LEGACY_PAYLOAD_SIZE + 8];
+    int size, setsWithInfo = 0, received = 0, expected = 0, rejected = FALSE;
+
+    // only a SET with nothing between BCC1 and the closing FLAG gets an answer
+    while ((size = readFrame(fd, frame, sizeof(frame), PEER_TIMEOUT)) != -1 && !isPlain(frame, size, C_SET)) {
+        if (frame[1] == C_SET) setsWithInfo++;
+    }
+
+    if (size == -1 || setsWithInfo == 0) {
+        printf("No plain SET after a SET with capabilities\n");
+        return 1;
+    }
+
+    writeFrame(fd, A_RE, C_UA, NULL, 0);
+
+    while ((size = readFrame(fd, frame, sizeof(frame), PEER_TIMEOUT)) != -1) {
+        if (isPlain(frame, size, C_SET)) {
+            writeFrame(fd, A_RE, C_UA, NULL, 0);
+            continue;
+        }
+
+        if (isPlain(frame, size, C_DISC)) break;
+
+        unsigned char bcc2 = 0;
+        for (int i = 3; i < size - 1; i++) bcc2 ^= frame[i];
+
+        if (size < 5 || (frame[1] != 0x00 && frame[1] != 0x40) || frame[2] != (frame[0] ^ frame[1]) ||
+            frame[size - 1] != bcc2) {
+            printf("Not an I-frame of the original format\n");
+            return 1;
+        }
+
+        int ns = frame[1] >> 6;
+
+        if (ns == expected && received == REJECTED && !rejected) {
+            rejected = TRUE;
+            writeFrame(fd, A_ER, (expected << 7) | C_REJ, NULL, 0);
+            continue;
+        }
+
+        if (ns == expected) {
+            if (received >= PACKETS || size - 4 != sizes[received] || memcmp(frame + 3, packets[received], size - 4) != 0) {
+                printf("Packet %d received wrong\n", received);
+                return 1;
+            }
+            received++;
+            expected ^= 1;
+        }
+
+        writeFrame(fd, A_ER, (expected << 7) | C_RR, NULL, 0);
+    }
+
+    if (size == -1 || received != PACKETS) {
+        printf("%d of %d packets before DISC\n", received, PACKETS);
+        return 1;
+    }
+
+    writeFrame(fd, A_RE, C_DISC, NULL, 0);
+    size = readFrame(fd, frame, sizeof(frame), PEER_TIMEOUT);
+
+    return size != -1 && isPlain(frame, size, C_UA) ? 0 : 1;
+}
+
+// Sends a frame until frame (the answer) satisfies C, up to PEER_TRIES times
+static int exchange(int fd, unsigned char A, unsigned char C, const unsigned char *info, int infoSize, unsigned char answer,
+                    unsigned char *frame, int max) {
+    for (int try = 0; try < PEER_TRIES; try++) {
+        writeFrame(fd, A, C, info, infoSize);
+
+        int size = readFrame(fd, frame, max, PEER_RETRY);
+        if (size != -1 && isPlain(frame, size, answer)) return size;
+    }
+
+    return -1;
+}
+
+// The original transmitter, against our receiver. Return the number of failures.
+static int legacyTransmitter(int fd, unsigned char (*packets)[LEGACY_PAYLOAD_SIZE], int *sizes) {
+    unsigned char frame[LEGACY_PAYLOAD_SIZE + 8];
+
+    // a plain UA, which the original transmitter reads as exactly 5 bytes
+    if (exchange(fd, A_ER, C_SET, NULL, 0, C_UA, frame, sizeof(frame)) == -1) {
+        printf("No plain UA\n");
+        return 1;
+    }
+
+    for (int i = 0, ns = 0; i < PACKETS; i++, ns ^= 1) {
+        // RR asks for the next frame; a REJ is answered by the retry
+        if (exchange(fd, A_ER, ns << 6, packets[i], sizes[i], ((ns ^ 1) << 7) | C_RR, frame, sizeof(frame)) == -1) {
+            printf("Packet %d not acknowledged\n", i);
+            return 1;
+        }
+    }
+
+    if (exchange(fd, A_ER, C_DISC, NULL, 0, C_DISC, frame, sizeof(frame)) == -1) {
+        printf("No DISC\n");
+        return 1;
+    }
+
+    writeFrame(fd, A_RE, C_UA, NULL, 0);
+    return 0;
+}
+
+// Runs one direction: ours opened with role on a new pseudo terminal, the legacy end on its master
+static int runDirection(LinkLayerRole role, unsigned char (*packets)[LEGACY_PAYLOAD_SIZE], int *sizes) {
+    Peer peer = {{{0}}, packets, sizes, 0};
+    struct termios raw;
+    int master, slave; // the slave is kept open so the master doesn't see a hang up before llopen
+
+    memset(&raw, 0, sizeof(raw));
+    cfmakeraw(&raw);
+
+    if (openpty(&master, &slave, peer.parameters.serialPort, &raw, NULL) == -1) {
+        perror("openpty");
+        return 1;
+    }
+
+    tcsetattr(master, TCSANOW, &raw);
+    peer.parameters.role = role;
+    peer.parameters.baudRate = BAUDRATE;
+    peer.parameters.nRetransmissions = 3;
+    peer.parameters.timeout = 1;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, role == LlTx ? runTransmitter : runReceiver, &peer);
+
+    int failures = role == LlTx ? legacyReceiver(master, packets, sizes) : legacyTransmitter(master, packets, sizes);
+
+    // our end may still be waiting for frames that will never come
+    if (failures > 0) {
+        printf("%s to a legacy peer FAILED\n", role == LlTx ? "Transmitting" : "Receiving");
+        exit(1);
+    }
+
+    pthread_join(thread, NULL);
+    close(master);
+    close(slave);
+
+    return failures + peer.failures;
+}
+
+int main() {
+    unsigned char (*packets)[LEGACY_PAYLOAD_SIZE] = malloc(PACKETS * sizeof(*packets));
+    int sizes[PACKETS];
+
+    if (packets == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    fillPackets(packets, sizes);
+
+    int failures = runDirection(LlTx, packets, sizes);
+    failures += runDirection(LlRx, packets, sizes);
+
+    printf("%d packets each way, %s\n", PACKETS, failures == 0 ? "all received" : "FAILED");
+    free(packets);
+
+    return failures == 0 ? 0 : 1;
+}
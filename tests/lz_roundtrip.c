@@ -0,0 +1,143 @@
+// LZ block compression round trips: zeros, text, random bytes and tiny blocks of every size
+// up to a few sequences decompress to exactly what was compressed. Output that doesn't fit
+// the capacity given is refused on both sides, and neither garbage nor truncated blocks make
+// the decompressor write past its capacity.
+//
+// Build and run from the repository root (or all tests with "make -C tests test"):
+//   gcc -Wall -o bin/lz_roundtrip tests/lz_roundtrip.c src/*.c -Iinclude -lpthread
+//   bin/lz_roundtrip
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "link_layer.h"
+#include "lz.h"
+#include "packet.h"
+
+#define TINY_SIZES 40  // blocks of 0 to this many bytes
+#define GUARD 64       // bytes after the capacity that must stay untouched
+#define GARBAGE_RUNS 2000
+
+enum { ZEROS, TEXT, RANDOM, KINDS };
+
+static const char *kindNames[KINDS] = {"zeros", "text", "random"};
+
+static unsigned char input[LZ_BLOCK_SIZE];
+static unsigned char compressed[2 * LZ_BLOCK_SIZE];
+static unsigned char output[LZ_BLOCK_SIZE + GUARD];
+
+static void fill(unsigned char *buf, int size, int kind) {
+    const char *words[] = {"the ", "link ", "layer ", "frame ", "sends ", "a ", "packet ", "\n"};
+
+    for (int i = 0; i < size;) {
+        if (kind == ZEROS) {
+            buf[i++] = 0;
+        } else if (kind == RANDOM) {
+            buf[i++] = rand() & 0xFF;
+        } else {
+            const char *word = words[rand() % 8];
+            for (int j = 0; word[j] != '\0' && i < size; j++) buf[i++] = word[j];
+        }
+    }
+}
+
+static int isGuarded(int capacity) {
+    for (int i = capacity; i < capacity + GUARD; i++) {
+        if (output[i] != 0xA5) return FALSE;
+    }
+    return TRUE;
+}
+
+// Compresses and decompresses size bytes. Return the number of failures.
+static int roundTrip(int size, int kind) {
+    fill(input, size, kind);
+
+    int compressedSize = lzCompress(input, size, compressed, sizeof(compressed));
+
+    if (compressedSize < 0) {
+        printf("%d bytes of %s didn't compress\n", size, kindNames[kind]);
+        return 1;
+    }
+
+    memset(output, 0xA5, sizeof(output));
+
+    if (lzDecompress(compressed, compressedSize, output, size) != size || memcmp(output, input, size) != 0 ||
+        !isGuarded(size)) {
+        printf("%d bytes of %s decompressed wrong\n", size, kindNames[kind]);
+        return 1;
+    }
+
+    // one byte less room than the block takes is refused
+    if (size > 0 && lzDecompress(compressed, compressedSize, output, size - 1) != -1) {
+        printf("%d bytes of %s decompressed into %d bytes of room\n", size, kindNames[kind], size - 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main() {
+    int failures = 0;
+
+    srand(1);
+
+    for (int kind = 0; kind < KINDS; kind++) {
+        for (int size = 0; size <= TINY_SIZES; size++) failures += roundTrip(size, kind);
+
+        failures += roundTrip(1000, kind);
+        failures += roundTrip(LZ_BLOCK_SIZE, kind);
+    }
+
+    // zeros and text are worth compressing, random bytes aren't
+    fill(input, LZ_BLOCK_SIZE, ZEROS);
+    if (lzCompress(input, LZ_BLOCK_SIZE, compressed, LZ_BLOCK_SIZE / 100) == -1) {
+        printf("A block of zeros didn't compress to 1%%\n");
+        failures++;
+    }
+
+    fill(input, LZ_BLOCK_SIZE, TEXT);
+    if (lzCompress(input, LZ_BLOCK_SIZE, compressed, LZ_BLOCK_SIZE / 2) == -1) {
+        printf("A block of text didn't compress to half\n");
+        failures++;
+    }
+
+    fill(input, LZ_BLOCK_SIZE, RANDOM);
+    if (lzCompress(input, LZ_BLOCK_SIZE, compressed, LZ_BLOCK_SIZE - 1) != -1) {
+        printf("A block of random bytes compressed to less than its size\n");
+        failures++;
+    }
+
+    // every prefix of a valid block, and random garbage, decompresses within capacity or fails
+    fill(input, LZ_BLOCK_SIZE, TEXT);
+    int compressedSize = lzCompress(input, 4096, compressed, sizeof(compressed));
+
+    for (int size = 0; size < compressedSize; size++) {
+        memset(output, 0xA5, sizeof(output));
+
+        int result = lzDecompress(compressed, size, output, 4096);
+        if (result > 4096 || !isGuarded(4096) || (result > 0 && memcmp(output, input, result) != 0)) {
+            printf("A block truncated to %d bytes decompressed out of bounds\n", size);
+            failures++;
+            break;
+        }
+    }
+
+    for (int run = 0; run < GARBAGE_RUNS; run++) {
+        int size = 1 + rand() % 512, capacity = rand() % 2048;
+
+        fill(compressed, size, RANDOM);
+        memset(output, 0xA5, sizeof(output));
+
+        int result = lzDecompress(compressed, size, output, capacity);
+        if (result > capacity || !isGuarded(capacity)) {
+            printf("Garbage of %d bytes decompressed past %d bytes of room\n", size, capacity);
+            failures++;
+            break;
+        }
+    }
+
+    printf("LZ blocks of zeros, text and random bytes, %s\n", failures == 0 ? "all round trips match" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,210 @@
+// Link parameter negotiation without a line: capability blocks over a matrix of ARQ modes,
+// windows, FCS types offered, framing, compression, FEC groups and packet formats are encoded
+// and decoded back, and every pair is combined both ways round. The agreement must not depend
+// on which end is which, must pick the strongest FCS both offer and stay within what either
+// end can do. A peer that doesn't negotiate, or an older one that leaves out TLVs, gets the
+// legacy settings for what it doesn't mention; a malformed block is refused.
+//
+// Build and run from the repository root (or all tests with "make -C tests test"):
+//   gcc -Wall -o bin/negotiation tests/negotiation.c src/*.c -Iinclude -lpthread
+//   bin/negotiation
+
+#include <stdio.h>
+#include <string.h>
+
+#include "crc.h"
+#include "link_layer.h"
+#include "link_connection.h"
+
+// Negotiation internals (src/link_layer.c)
+LinkParameters localParameters();
+LinkParameters legacyParameters();
+int encodeParameters(const LinkParameters *params, unsigned char *out);
+int decodeParameters(const unsigned char *in, int size, LinkParameters *params);
+LinkParameters combineParameters(const LinkParameters *a, const LinkParameters *b);
+
+static const int arqModes[] = {ARQ_STOP_AND_WAIT, ARQ_GO_BACK_N, ARQ_SELECTIVE_REPEAT};
+static const int windows[] = {1, 4, MAX_SEQ_MODULUS - 1};
+static const int payloads[] = {LEGACY_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE};
+static const int fcsMasks[] = {1 << FCS_XOR, (1 << FCS_XOR) | (1 << FCS_CRC16), (1 << FCS_XOR) | (1 << FCS_CRC32), 0x07};
+static const int framings[] = {FRAMING_HDLC, FRAMING_COBS};
+static const int compressions[] = {COMPRESSION_NONE, COMPRESSION_LZ};
+static const int fecGroups[] = {0, 3};
+static const int packetFormats[] = {PACKET_FORMAT_V1, PACKET_FORMAT_V2};
+
+#define COUNT(array) ((int) (sizeof(array) / sizeof(array[0])))
+#define MATRIX_SIZE (COUNT(arqModes) * COUNT(windows) * COUNT(payloads) * COUNT(fcsMasks) * COUNT(framings) * \
+                     COUNT(compressions) * COUNT(fecGroups) * COUNT(packetFormats))
+
+static LinkParameters matrix[MATRIX_SIZE];
+
+static int sameParameters(const LinkParameters *a, const LinkParameters *b) {
+    return a->arqMode == b->arqMode && a->windowSize == b->windowSize && a->maxPayloadSize == b->maxPayloadSize &&
+           a->fcsType == b->fcsType && a->fcsTypes == b->fcsTypes && a->framing == b->framing &&
+           a->compression == b->compression && a->fecGroup == b->fecGroup && a->packetFormat == b->packetFormat;
+}
+
+// Settings of entry i of the matrix, the highest FCS offered being the one the end is built with
+static LinkParameters matrixEntry(int i) {
+    LinkParameters params;
+
+    params.arqMode = arqModes[i % COUNT(arqModes)];
+    i /= COUNT(arqModes);
+    params.windowSize = params.arqMode == ARQ_STOP_AND_WAIT ? 1 : windows[i % COUNT(windows)];
+    i /= COUNT(windows);
+    params.maxPayloadSize = payloads[i % COUNT(payloads)];
+    i /= COUNT(payloads);
+    params.fcsTypes = fcsMasks[i % COUNT(fcsMasks)];
+    params.fcsType = params.fcsTypes & (1 << FCS_CRC32) ? FCS_CRC32 : params.fcsTypes & (1 << FCS_CRC16) ? FCS_CRC16 : FCS_XOR;
+    i /= COUNT(fcsMasks);
+    params.framing = framings[i % COUNT(framings)];
+    i /= COUNT(framings);
+    params.compression = compressions[i % COUNT(compressions)];
+    i /= COUNT(compressions);
+    params.fecGroup = fecGroups[i % COUNT(fecGroups)];
+    i /= COUNT(fecGroups);
+    params.packetFormat = packetFormats[i % COUNT(packetFormats)];
+
+    return params;
+}
+
+// What a and b must agree on, one setting at a time. Return a description of the first
+// setting the agreement gets wrong, or NULL.
+static const char *checkAgreement(const LinkParameters *a, const LinkParameters *b, const LinkParameters *agreed) {
+    int common = a->fcsTypes & b->fcsTypes;
+    int fcsType = common & (1 << FCS_CRC32) ? FCS_CRC32 : common & (1 << FCS_CRC16) ? FCS_CRC16 : FCS_XOR;
+    int arqMode = a->arqMode < b->arqMode ? a->arqMode : b->arqMode;
+    int windowLimit = a->windowSize < b->windowSize ? a->windowSize : b->windowSize;
+
+    if (agreed->fcsType != fcsType || agreed->fcsTypes != 1 << fcsType) return "FCS type";
+    if (agreed->arqMode != arqMode) return "ARQ mode";
+    if (agreed->windowSize < 1 || agreed->windowSize > windowLimit ||
+        (arqMode == ARQ_STOP_AND_WAIT && agreed->windowSize != 1) ||
+        (arqMode == ARQ_SELECTIVE_REPEAT && agreed->windowSize > MAX_SEQ_MODULUS / 2) ||
+        agreed->windowSize >= MAX_SEQ_MODULUS)
+        return "window";
+    if (agreed->maxPayloadSize != (a->maxPayloadSize < b->maxPayloadSize ? a->maxPayloadSize : b->maxPayloadSize))
+        return "maximum payload";
+    if (agreed->framing != (a->framing == b->framing ? a->framing : FRAMING_HDLC)) return "framing";
+    if (agreed->compression != (a->compression == b->compression ? a->compression : COMPRESSION_NONE))
+        return "compression";
+    if (agreed->fecGroup < 0 || agreed->fecGroup > agreed->windowSize ||
+        (agreed->fecGroup > 0 && (arqMode != ARQ_SELECTIVE_REPEAT || a->fecGroup == 0 || b->fecGroup == 0)))
+        return "FEC group";
+    if (agreed->packetFormat != (a->packetFormat < b->packetFormat ? a->packetFormat : b->packetFormat))
+        return "packet format";
+
+    return NULL;
+}
+
+static int checkMatrix() {
+    unsigned char block[MAX_PAYLOAD_SIZE];
+    int failures = 0;
+
+    // every entry survives its capability block, apart from the FCS type in use, which
+    // isn't sent: each end works it out from the types offered
+    for (int i = 0; i < MATRIX_SIZE; i++) {
+        LinkParameters params = matrixEntry(i), decoded;
+        int size = encodeParameters(&params, block);
+
+        if (decodeParameters(block, size, &decoded) != 0) {
+            printf("Capability block %d refused\n", i);
+            return 1;
+        }
+
+        decoded.fcsType = params.fcsType;
+        if (!sameParameters(&decoded, &params)) {
+            printf("Capability block %d decoded wrong\n", i);
+            return 1;
+        }
+
+        matrix[i] = decoded;
+    }
+
+    for (int i = 0; i < MATRIX_SIZE; i++) {
+        for (int j = i; j < MATRIX_SIZE; j++) {
+            LinkParameters ab = combineParameters(&matrix[i], &matrix[j]);
+            LinkParameters ba = combineParameters(&matrix[j], &matrix[i]);
+            const char *wrong = checkAgreement(&matrix[i], &matrix[j], &ab);
+
+            if (!sameParameters(&ab, &ba)) {
+                printf("Entries %d and %d agree on different settings at either end\n", i, j);
+                failures++;
+            } else if (wrong != NULL) {
+                printf("Entries %d and %d agree on the wrong %s\n", i, j, wrong);
+                failures++;
+            }
+
+            if (failures > 10) return failures;
+        }
+    }
+
+    return failures;
+}
+
+static int checkPeers() {
+    LinkParameters local = localParameters(), legacy = legacyParameters(), decoded, agreed;
+    unsigned char block[MAX_PAYLOAD_SIZE];
+    int failures = 0;
+
+    // two ends built alike agree on what they were built with
+    int size = encodeParameters(&local, block);
+    decodeParameters(block, size, &decoded);
+    agreed = combineParameters(&local, &decoded);
+
+    if (agreed.fcsType != FCS_TYPE || agreed.arqMode != ARQ_MODE || agreed.framing != FRAMING_MODE ||
+        agreed.packetFormat != PACKET_FORMAT) {
+        printf("Two ends built alike agree on other settings\n");
+        failures++;
+    }
+
+    // an empty block is a peer that doesn't negotiate
+    if (decodeParameters(block, 0, &decoded) != 0 || !sameParameters(&decoded, &legacy)) {
+        printf("An empty capability block isn't the legacy settings\n");
+        failures++;
+    }
+
+    if (legacy.arqMode != ARQ_STOP_AND_WAIT || legacy.windowSize != 1 || legacy.fcsType != FCS_XOR ||
+        legacy.framing != FRAMING_HDLC || legacy.compression != COMPRESSION_NONE || legacy.fecGroup != 0 ||
+        legacy.maxPayloadSize != LEGACY_PAYLOAD_SIZE || legacy.packetFormat != PACKET_FORMAT_V0) {
+        printf("The legacy settings aren't the original protocol\n");
+        failures++;
+    }
+
+    // an older peer that doesn't offer FCS types, with a TLV this end doesn't know, gets XOR BCC2
+    const unsigned char older[] = {TLV_MAX_PAYLOAD, 2, 0x01, 0x00, TLV_ARQ_MODE, 1, ARQ_GO_BACK_N, 0x7F, 3, 1, 2, 3,
+                                   TLV_WINDOW_SIZE, 1, 4};
+
+    if (decodeParameters(older, sizeof(older), &decoded) != 0) {
+        printf("A capability block with an unknown TLV refused\n");
+        failures++;
+    } else {
+        agreed = combineParameters(&local, &decoded);
+
+        if (agreed.fcsType != FCS_XOR || agreed.maxPayloadSize != 256 || agreed.framing != FRAMING_HDLC ||
+            agreed.compression != COMPRESSION_NONE || agreed.packetFormat != PACKET_FORMAT_V1) {
+            printf("A peer that leaves TLVs out gets other than the legacy settings for them\n");
+            failures++;
+        }
+    }
+
+    // a TLV running past the end of the block, and a lone byte after the last one
+    const unsigned char overrun[] = {TLV_MAX_PAYLOAD, 2, 0x03, 0xE8, TLV_WINDOW_SIZE, 2, 4};
+    const unsigned char trailing[] = {TLV_MAX_PAYLOAD, 2, 0x03, 0xE8, TLV_WINDOW_SIZE};
+
+    if (decodeParameters(overrun, sizeof(overrun), &decoded) != -1 ||
+        decodeParameters(trailing, sizeof(trailing), &decoded) != -1) {
+        printf("A malformed capability block accepted\n");
+        failures++;
+    }
+
+    return failures;
+}
+
+int main() {
+    int failures = checkMatrix() + checkPeers();
+
+    printf("%d capability blocks, every pair negotiated, %s\n", MATRIX_SIZE, failures == 0 ? "all agree" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+// A receiver that misses wide data packets stops the transfer: after START and the first
+// data packets, the transmitter skips a sequence number. The receiver must keep only what
+// came before the gap and not write the packets after it at the wrong offset.
+//
+// Build and run from the repository root (or all tests with "make -C tests test"):
+//   gcc -Wall -DPACKET_FORMAT=PACKET_FORMAT_V2 -o bin/wide_gap tests/wide_gap.c src/*.c -Iinclude -lpthread -lutil
+//   bin/wide_gap
+
+#include <pthread.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "application_layer.h"
+#include "link_layer.h"
+#include "link_connection.h"
+#include "packet.h"
+
+#define DATA_SIZE 500    // bytes per data packet
+#define BEFORE_GAP 3     // data packets received in order
+#define TEST_TIMEOUT 60  // s
+#define OUTPUT "wide_gap.out"
+
+typedef struct {
+    int masters[2];
+    int stop;
+} Cable;
+
+typedef struct {
+    char serialPort[50];
+    int done;
+} Receiver;
+
+// Copies whatever one end writes to the other, until stopped or the test times out
+static void *runCable(void *arg) {
+    Cable *cable = arg;
+    unsigned char buf[4096];
+    time_t deadline = time(NULL) + TEST_TIMEOUT;
+
+    while (!cable->stop) {
+        if (time(NULL) > deadline) {
+            printf("Timed out, FAILED\n");
+            exit(1);
+        }
+
+        fd_set fds;
+        struct timeval wait = {0, 100000};
+
+        FD_ZERO(&fds);
+        FD_SET(cable->masters[0], &fds);
+        FD_SET(cable->masters[1], &fds);
+
+        int highest = cable->masters[0] > cable->masters[1] ? cable->masters[0] : cable->masters[1];
+        if (select(highest + 1, &fds, NULL, NULL, &wait) <= 0) continue;
+
+        for (int i = 0; i < 2; i++) {
+            if (!FD_ISSET(cable->masters[i], &fds)) continue;
+
+            int bytes = read(cable->masters[i], buf, sizeof(buf));
+            for (int written = 0; bytes > 0 && written < bytes;) {
+                int n = write(cable->masters[1 - i], buf + written, bytes - written);
+                if (n > 0) written += n;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void *runReceiver(void *arg) {
+    Receiver *receiver = arg;
+
+    applicationLayer(receiver->serialPort, "rx", BAUDRATE, 3, 1, OUTPUT);
+    receiver->done = TRUE;
+
+    return NULL;
+}
+
+static int writeWidePacket(LinkConnection *conn, uint32_t sequence, const unsigned char *data) {
+    unsigned char packet[WIDE_DATA_PACKET_HEADER + DATA_SIZE];
+
+    packet[0] = WIDE_DATA_PACKET;
+    for (int i = 0; i < 4; i++) packet[1 + i] = sequence >> (8 * (3 - i));
+    packet[5] = DATA_SIZE >> 8;
+    packet[6] = DATA_SIZE & 0xFF;
+    memcpy(packet + WIDE_DATA_PACKET_HEADER, data + sequence * DATA_SIZE, DATA_SIZE);
+
+    return llwrite_r(conn, packet, sizeof(packet));
+}
+
+int main() {
+    Cable cable = {{-1, -1}, FALSE};
+    Receiver receiver = {"", FALSE};
+    LinkLayer parameters;
+    struct termios raw;
+    char serialPorts[2][50];
+
+    memset(&parameters, 0, sizeof(parameters));
+    memset(&raw, 0, sizeof(raw));
+    cfmakeraw(&raw);
+
+    for (int i = 0; i < 2; i++) {
+        int slave; // kept open so the master doesn't see a hang up between opens
+
+        if (openpty(&cable.masters[i], &slave, serialPorts[i], &raw, NULL) == -1) {
+            perror("openpty");
+            return 1;
+        }
+        tcsetattr(cable.masters[i], TCSANOW, &raw);
+    }
+
+    strcpy(parameters.serialPort, serialPorts[0]);
+    strcpy(receiver.serialPort, serialPorts[1]);
+    parameters.role = LlTx;
+    parameters.baudRate = BAUDRATE;
+    parameters.nRetransmissions = 3;
+    parameters.timeout = 1;
+
+    unsigned char data[(BEFORE_GAP + 2) * DATA_SIZE];
+    for (int i = 0; i < (int) sizeof(data); i++) data[i] = (i * 7 + i / DATA_SIZE) & 0xFF;
+
+    unlink(OUTPUT);
+
+    pthread_t cableThread, receiverThread;
+    pthread_create(&cableThread, NULL, runCable, &cable);
+    pthread_create(&receiverThread, NULL, runReceiver, &receiver);
+
+    int failures = 0;
+    LinkConnection *conn = llopen_r(parameters, NULL);
+
+    if (conn == NULL || llparameters_r(conn).packetFormat != PACKET_FORMAT_V2) {
+        printf("No connection with wide data packets\n");
+        return 1;
+    }
+
+    // START with the size of everything, without a hash, so no journal is left behind
+    unsigned char start[] = {CONTROL_START, 0x00, 2, sizeof(data) >> 8, sizeof(data) & 0xFF, 0x01, 1, 'x'};
+
+    if (llwrite_r(conn, start, sizeof(start)) != sizeof(start)) failures++;
+
+    for (uint32_t sequence = 0; failures == 0 && sequence < BEFORE_GAP; sequence++) {
+        if (writeWidePacket(conn, sequence, data) != WIDE_DATA_PACKET_HEADER + DATA_SIZE) failures++;
+    }
+
+    // packet BEFORE_GAP goes missing; the receiver gives up on the one after it, so it may
+    // not be acknowledged
+    if (failures == 0) {
+        writeWidePacket(conn, BEFORE_GAP + 1, data);
+        llflush_r(conn);
+    }
+
+    for (int waited = 0; !receiver.done && waited < TEST_TIMEOUT * 10; waited++) usleep(100000);
+
+    struct stat file;
+
+    if (!receiver.done) {
+        printf("The receiver went on after the gap\n");
+        failures++;
+    } else if (stat(OUTPUT, &file) == -1 || file.st_size != BEFORE_GAP * DATA_SIZE) {
+        printf("The received file isn't the %d bytes before the gap\n", BEFORE_GAP * DATA_SIZE);
+        failures++;
+    } else {
+        FILE *output = fopen(OUTPUT, "rb");
+        unsigned char received[BEFORE_GAP * DATA_SIZE];
+
+        if (output == NULL || fread(received, 1, sizeof(received), output) != sizeof(received) ||
+            memcmp(received, data, sizeof(received)) != 0) {
+            printf("The data before the gap was received wrong\n");
+            failures++;
+        }
+        if (output != NULL) fclose(output);
+    }
+
+    llabort_r(conn);
+    pthread_join(receiverThread, NULL);
+    cable.stop = TRUE;
+    pthread_join(cableThread, NULL);
+    unlink(OUTPUT);
+
+    printf("Gap after %d data packets, %s\n", BEFORE_GAP, failures == 0 ? "transfer stopped" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+// XXH64 against published test vectors, from empty input to more than one 32 byte stripe,
+// and fed piece by piece in every piece size up to two stripes, with digests taken midway,
+// against the one call hash of the same bytes.
+//
+// Build and run from the repository root (or all tests with "make -C tests test"):
+//   gcc -Wall -o bin/xxhash_vectors tests/xxhash_vectors.c src/*.c -Iinclude -lpthread
+//   bin/xxhash_vectors
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xxhash.h"
+
+#define STREAM_SIZE 1000 // bytes hashed in pieces
+
+typedef struct {
+    const char *input;
+    uint64_t seed;
+    uint64_t hash;
+} Vector;
+
+static const Vector vectors[] = {
+        {"", 0, 0xEF46DB3751D8E999ULL},
+        {"a", 0, 0xD24EC4F1A98C6E5BULL},
+        {"abc", 0, 0x44BC2CF5AD770999ULL},
+        {"Nobody inspects the spammish repetition", 0, 0xFBCEA83C8A378BF1ULL},
+};
+
+int main() {
+    int failures = 0;
+
+    for (int i = 0; i < (int) (sizeof(vectors) / sizeof(vectors[0])); i++) {
+        uint64_t hash = xxh64(vectors[i].input, strlen(vectors[i].input), vectors[i].seed);
+
+        if (hash != vectors[i].hash) {
+            printf("XXH64 of \"%s\" is %016" PRIX64 ", expected %016" PRIX64 "\n", vectors[i].input, hash, vectors[i].hash);
+            failures++;
+        }
+    }
+
+    unsigned char data[STREAM_SIZE];
+
+    srand(1);
+    for (int i = 0; i < STREAM_SIZE; i++) data[i] = rand() & 0xFF;
+
+    for (int piece = 1; piece <= 64; piece++) {
+        Xxh64State state;
+
+        xxh64Init(&state, piece);
+
+        for (int offset = 0; offset < STREAM_SIZE; offset += piece) {
+            int size = STREAM_SIZE - offset < piece ? STREAM_SIZE - offset : piece;
+
+            xxh64Update(&state, data + offset, size);
+
+            // a digest midway matches the hash of what was fed so far and doesn't disturb the rest
+            if (xxh64Digest(&state) != xxh64(data, offset + size, piece)) {
+                printf("Digest after %d bytes in pieces of %d differs\n", offset + size, piece);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    printf("XXH64 vectors and pieces of 1 to 64 bytes, %s\n", failures == 0 ? "all match" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}